@@ -5,10 +5,42 @@
 #include <memory>
 #include <array>
 #include <unordered_set>
+#include <unordered_map>
+#include <stdexcept>
+#include <chrono>
 #include <cstdio>
 #include <cctype>
 #include <cstdint>
 #include <cassert>
+#include <algorithm>
+#include <iterator>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <cmath>
+#include <complex>
+#include <random>
+#include <cstring>
+#include <climits>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 #define SHOW_INSTRS
 
@@ -24,7 +56,16 @@ enum class gate_opcode : int
     rotate_pi_by_4,
     inv_rotate_pi_by_4,
     rotate_pi_by_2,
-    inv_rotate_pi_by_2
+    inv_rotate_pi_by_2,
+    peres,
+    inv_peres,
+    multi_target,
+    rotate_z,
+    rotate_y,
+    phase,
+    diagonal_batch,
+    layer,
+    sequence
 };
 
 struct program_spec
@@ -45,11 +86,121 @@ struct program_spec
     // gate instruction encoding:
     // 1. gate opcode
     // 2. operand count
-    // 3. operand variable IDs
+    // 3. operand variable IDs. controls come first, in variable order, and targets last.
+    //    controls that are active when their variable is 0 have negated_control_bit set.
+    // multi_target gates have the operands: control count, controls, then a base gate opcode and a target per target.
+    // the base gates are applied to their targets at once if all controls are active.
+    // rotate_z, rotate_y and phase gates have an angle before their controls, see angle_operand().
+    // diagonal_batch gates have the whole instructions of a run of diagonal gates as their operands.
+    // layer gates have the whole instructions of gates whose variable spans don't overlap, in variable order, as their operands.
+    // sequence gates have the whole instructions of a run of gates as their operands, applied one after another.
     std::vector<int> gate_stream;
 };
 
-program_spec parse(const char* txt)
+const int negated_control_bit = 0x40000000;
+
+inline int operand_var_id(int operand)
+{
+    return operand & ~negated_control_bit;
+}
+
+inline bool is_negated_control(int operand)
+{
+    return (operand & negated_control_bit) != 0;
+}
+
+// orders operands by variable, regardless of polarity
+inline bool operand_var_less(int operand0, int operand1)
+{
+    return operand_var_id(operand0) < operand_var_id(operand1);
+}
+
+// the angle of a rotation is stored in radians as the bits of a double, in two operands.
+const int angle_operand_count = 2;
+
+inline bool has_angle_operand(gate_opcode opcode)
+{
+    return opcode == gate_opcode::rotate_z || opcode == gate_opcode::rotate_y || opcode == gate_opcode::phase;
+}
+
+inline double angle_operand(const int* operands)
+{
+    double angle;
+    memcpy(&angle, operands, sizeof(angle));
+    return angle;
+}
+
+inline void append_angle_operand(double angle, std::vector<int>* gate_stream)
+{
+    int operands[angle_operand_count];
+    static_assert(sizeof(operands) == sizeof(angle), "an angle takes two operands");
+    memcpy(operands, &angle, sizeof(angle));
+    gate_stream->insert(end(*gate_stream), operands, operands + angle_operand_count);
+}
+
+// the smallest and largest variable an instruction acts on
+void get_instruction_span(const int* instr, int* first_var_out, int* last_var_out)
+{
+    gate_opcode opcode = (gate_opcode)instr[0];
+    const int* first_param = instr + 2;
+    const int* last_param = first_param + instr[1];
+
+    int first_var = INT_MAX;
+    int last_var = -1;
+    auto add_var = [&](int operand)
+    {
+        first_var = std::min(first_var, operand_var_id(operand));
+        last_var = std::max(last_var, operand_var_id(operand));
+    };
+
+    if (opcode == gate_opcode::diagonal_batch || opcode == gate_opcode::layer || opcode == gate_opcode::sequence)
+    {
+        for (const int* inner = first_param; inner < last_param; inner += 2 + inner[1])
+        {
+            int inner_first, inner_last;
+            get_instruction_span(inner, &inner_first, &inner_last);
+            add_var(inner_first);
+            add_var(inner_last);
+        }
+    }
+    else if (opcode == gate_opcode::multi_target)
+    {
+        const int* first_target = first_param + 1 + first_param[0];
+        std::for_each(first_param + 1, first_target, add_var);
+        for (const int* target = first_target; target < last_param; target += 2)
+        {
+            add_var(target[1]);
+        }
+    }
+    else
+    {
+        std::for_each(first_param + (has_angle_operand(opcode) ? angle_operand_count : 0), last_param, add_var);
+    }
+
+    *first_var_out = first_var;
+    *last_var_out = last_var;
+}
+
+// receives the parts of a program as they are parsed, so decoding can start before the whole file is read.
+class parse_listener
+{
+public:
+    virtual ~parse_listener() = default;
+
+    // called once every tag has been read, at BEGIN.
+    virtual void on_header(const program_spec& spec) = 0;
+
+    // called for every gate instruction, in the encoding of program_spec::gate_stream.
+    virtual void on_gate(const int* instr) = 0;
+
+    // if true, parsed gates aren't kept in the gate stream of the returned spec.
+    virtual bool discard_gates() const
+    {
+        return false;
+    }
+};
+
+program_spec parse(const char* txt, parse_listener* listener = NULL)
 {
     static auto is_eol = [](const char* s)
     {
@@ -195,8 +346,22 @@ program_spec parse(const char* txt)
         return s;
     };
 
-    static auto parse_spec = [](const char* s)
+    static auto parse_spec = [](const char* s, parse_listener* listener)
     {
+        // hands the last gate of the stream to the listener
+        auto emit_gate = [&](program_spec& spec, size_t instr_i)
+        {
+            if (listener)
+            {
+                listener->on_gate(&spec.gate_stream[instr_i]);
+
+                if (listener->discard_gates())
+                {
+                    spec.gate_stream.clear();
+                }
+            }
+        };
+
         program_spec spec;
 
         spec.num_variables = 0;
@@ -253,6 +418,12 @@ program_spec parse(const char* txt)
 
                         s = s_begin;
                         state = parser_state::reading_gate_list;
+
+                        if (listener)
+                        {
+                            listener->on_header(spec);
+                        }
+
                         continue;
                     }
 
@@ -507,6 +678,8 @@ program_spec parse(const char* txt)
                             throw std::runtime_error("gate needs at least 1 input");
                         }
 
+                        size_t instr_i = spec.gate_stream.size();
+
                         if (is_toffoli)
                             spec.gate_stream.push_back((int)gate_opcode::toffoli);
                         else if (is_y)
@@ -541,34 +714,53 @@ program_spec parse(const char* txt)
                                 throw std::runtime_error("too many parameters");
                             }
 
+                            // a leading - negates a control
+                            bool negated = *first == '-';
+                            if (negated)
+                            {
+                                first++;
+                            }
+
                             auto found = spec.variable_name_to_id.find(std::string(first, last));
                             if (found == end(spec.variable_name_to_id))
                             {
                                 throw std::runtime_error("undeclared variable");
                             }
 
-                            spec.gate_stream.push_back(found->second);
+                            spec.gate_stream.push_back(negated ? found->second | negated_control_bit : found->second);
 
                             pcnt -= 1;
                         });
 
+                        if (pcnt != 0)
+                        {
+                            throw std::runtime_error("too few parameters");
+                        }
+
                         int last_var = -1;
                         for (size_t i = first_param_i; i < spec.gate_stream.size() - 1; i++)
                         {
                             if (last_var == -1)
                             {
-                                last_var = spec.gate_stream[i];
+                                last_var = operand_var_id(spec.gate_stream[i]);
                                 continue;
                             }
 
-                            if (last_var >= spec.gate_stream[i])
+                            if (last_var >= operand_var_id(spec.gate_stream[i]))
                             {
                                 throw std::runtime_error("parameters must be in variable order");
                             }
 
-                            last_var = spec.gate_stream[i];
+                            last_var = operand_var_id(spec.gate_stream[i]);
                         }
 
+                        if (is_negated_control(spec.gate_stream.back()))
+                        {
+                            throw std::runtime_error("targets can't be negated");
+                        }
+
+                        emit_gate(spec, instr_i);
+
                         continue;
                     }
 
@@ -585,6 +777,8 @@ program_spec parse(const char* txt)
                             throw std::runtime_error("gate needs at least 2 inputs");
                         }
 
+                        size_t instr_i = spec.gate_stream.size();
+
                         spec.gate_stream.push_back((int)gate_opcode::fredkin);
                         spec.gate_stream.push_back(pcnt);
 
@@ -597,34 +791,53 @@ program_spec parse(const char* txt)
                                 throw std::runtime_error("too many parameters");
                             }
 
+                            // a leading - negates a control
+                            bool negated = *first == '-';
+                            if (negated)
+                            {
+                                first++;
+                            }
+
                             auto found = spec.variable_name_to_id.find(std::string(first, last));
                             if (found == end(spec.variable_name_to_id))
                             {
                                 throw std::runtime_error("undeclared variable");
                             }
 
-                            spec.gate_stream.push_back(found->second);
+                            spec.gate_stream.push_back(negated ? found->second | negated_control_bit : found->second);
 
                             pcnt -= 1;
                         });
 
+                        if (pcnt != 0)
+                        {
+                            throw std::runtime_error("too few parameters");
+                        }
+
                         int last_var = -1;
                         for (size_t i = first_param_i; i < spec.gate_stream.size() - 1; i++)
                         {
                             if (last_var == -1)
                             {
-                                last_var = spec.gate_stream[i];
+                                last_var = operand_var_id(spec.gate_stream[i]);
                                 continue;
                             }
 
-                            if (last_var >= spec.gate_stream[i])
+                            if (last_var >= operand_var_id(spec.gate_stream[i]))
                             {
                                 throw std::runtime_error("parameters must be in variable order");
                             }
 
-                            last_var = spec.gate_stream[i];
+                            last_var = operand_var_id(spec.gate_stream[i]);
+                        }
+
+                        if (is_negated_control(spec.gate_stream.back()) || is_negated_control(spec.gate_stream[spec.gate_stream.size() - 2]))
+                        {
+                            throw std::runtime_error("targets can't be negated");
                         }
 
+                        emit_gate(spec, instr_i);
+
                         continue;
                     }
 
@@ -644,1823 +857,9790 @@ program_spec parse(const char* txt)
         return spec;
     };
 
-    return parse_spec(txt);
+    return parse_spec(txt, listener);
 }
 
-class qmdd
+// reads an OpenQASM 2.0 program.
+// every qubit is both an input and an output, in declaration order, named like "q[0]".
+// classical registers are ignored. measurements are only allowed after the last gate on a qubit,
+// since the result is the matrix of the circuit before them.
+// gate names with extra leading c's get extra controls, like ccz or cccx.
+program_spec parse_qasm(const char* txt, parse_listener* listener = NULL)
 {
-public:
-    // to configure p-valued logic
-    static const int p = 2;
-
-    struct node_handle
-    { 
-        uint32_t value;
-
-        bool operator==(const node_handle& other) const
-        {
-            return value == other.value;
-        }
-
-        bool operator!=(const node_handle& other) const
-        {
-            return !(operator==(other));
-        }
+    enum class token_kind
+    {
+        identifier,
+        integer,
+        real,
+        string,
+        symbol,
+        end
     };
 
-    struct weight_handle
-    { 
-        uint32_t value;
+    struct gate_call
+    {
+        std::string name;
 
-        bool operator==(const weight_handle& other) const
-        {
-            return value == other.value;
-        }
+        // angles of rotation gates
+        std::vector<double> params;
 
-        bool operator!=(const weight_handle& other) const
-        {
-            return !(operator==(other));
-        }
+        // indices into the arguments of the enclosing definition
+        std::vector<int> args;
     };
 
-    static constexpr node_handle invalid_node = node_handle{ uint32_t(-1) };
-    static constexpr weight_handle invalid_weight = weight_handle{ uint32_t(-1) };
+    struct gate_definition
+    {
+        int num_args;
+        std::vector<gate_call> body;
+    };
 
-    static constexpr weight_handle weight_0_handle = weight_handle{ 0 };
-    static constexpr weight_handle weight_1_handle = weight_handle{ 1 };
+    struct qubit_register
+    {
+        int first_var_id;
+        int size;
+    };
 
-    struct edge
+    struct reader
     {
-        weight_handle w;
-        node_handle v;
+        parse_listener* listener;
 
-        edge()
-            : w(invalid_weight)
-            , v(invalid_node)
-        { }
+        const char* s;
+        int line = 1;
+        const char* linestart;
 
-        edge(weight_handle ww, node_handle vv)
-            : w(ww), v(vv)
-        { }
+        token_kind kind;
+        std::string text;
+        int token_line;
+        int token_col;
 
-        explicit edge(node_handle vv)
-            : w(weight_1_handle), v(vv)
-        { }
+        program_spec spec;
+        bool has_header = false;
 
-        bool operator==(const edge& other) const
-        {
-            return w == other.w && v == other.v;
-        }
+        std::map<std::string, qubit_register> qregs;
+        std::map<std::string, int> cregs;
+        std::map<std::string, gate_definition> definitions;
+        std::vector<bool> measured;
 
-        bool operator!=(const edge& other) const
+        void advance()
         {
-            return !(operator==(other));
-        }
-    };
+            for (;;)
+            {
+                while (*s && std::isspace(*s))
+                {
+                    if (*s == '\n')
+                    {
+                        line++;
+                        linestart = s + 1;
+                    }
+                    s++;
+                }
 
-    enum edge_op
-    {
-        edge_op_add,
-        edge_op_mul,
-        edge_op_kro
-    };
+                if (s[0] == '/' && s[1] == '/')
+                {
+                    while (*s && *s != '\n')
+                    {
+                        s++;
+                    }
+                    continue;
+                }
 
-    enum weight_op
-    {
-        weight_op_add,
-        weight_op_sub,
-        weight_op_mul,
-        weight_op_div
-    };
+                break;
+            }
 
-private:
-    class weight
-    {
-        // rational algorithms from Boost.Rational (see boost/rational.hpp for explanation)
-        class rational
-        {
-            int num;
-            int den;
+            token_line = line;
+            token_col = int(s - linestart);
 
-            static int gcd_euclidean(int a, int b)
+            const char* start = s;
+            if (!*s)
             {
-                return b == 0 ? a : gcd_euclidean(b, a % b);
+                kind = token_kind::end;
             }
-
-            static int gcd(int a, int b)
+            else if (std::isalpha(*s) || *s == '_')
             {
-                int result = gcd_euclidean(a, b);
-                return result < 0 ? -result : result;
+                kind = token_kind::identifier;
+                while (std::isalnum(*s) || *s == '_')
+                {
+                    s++;
+                }
+            }
+            else if (std::isdigit(*s) || (*s == '.' && std::isdigit(s[1])))
+            {
+                kind = token_kind::integer;
+                while (std::isdigit(*s))
+                {
+                    s++;
+                }
+                if (*s == '.')
+                {
+                    kind = token_kind::real;
+                    s++;
+                    while (std::isdigit(*s))
+                    {
+                        s++;
+                    }
+                }
+                if ((*s == 'e' || *s == 'E') && (std::isdigit(s[1]) || ((s[1] == '+' || s[1] == '-') && std::isdigit(s[2]))))
+                {
+                    kind = token_kind::real;
+                    s += 2;
+                    while (std::isdigit(*s))
+                    {
+                        s++;
+                    }
+                }
+            }
+            else if (*s == '"')
+            {
+                kind = token_kind::string;
+                s++;
+                while (*s && *s != '"' && *s != '\n')
+                {
+                    s++;
+                }
+                if (*s != '"')
+                {
+                    throw std::runtime_error("unterminated string");
+                }
+                text.assign(start + 1, s);
+                s++;
+                return;
+            }
+            else
+            {
+                kind = token_kind::symbol;
+                if ((s[0] == '-' && s[1] == '>') || (s[0] == '=' && s[1] == '='))
+                {
+                    s += 2;
+                }
+                else
+                {
+                    s++;
+                }
             }
 
-        public:
-            rational() = default;
-
-            explicit rational(int n)
-                : num(n), den(1)
-            { }
+            text.assign(start, s);
+        }
 
-            int numerator() const
+        bool accept_symbol(const char* sym)
+        {
+            if (kind == token_kind::symbol && text == sym)
             {
-                return num;
+                advance();
+                return true;
             }
+            return false;
+        }
 
-            int denominator() const
+        void expect_symbol(const char* sym)
+        {
+            if (!accept_symbol(sym))
             {
-                return den;
+                throw std::runtime_error(std::string("expected ") + sym);
             }
+        }
 
-            bool operator==(const rational& other) const
+        std::string expect_identifier()
+        {
+            if (kind != token_kind::identifier)
             {
-                return num == other.num && den == other.den;
+                throw std::runtime_error("expected identifier");
             }
+            std::string id = text;
+            advance();
+            return id;
+        }
 
-            bool operator!=(const rational& other) const
+        int expect_integer()
+        {
+            if (kind != token_kind::integer || text.size() > 9)
             {
-                return !(operator==(other));
+                throw std::runtime_error("expected integer");
             }
+            int value = std::stoi(text);
+            advance();
+            return value;
+        }
 
-            rational& operator+=(const rational& other)
+        // a constant expression of real numbers and pi
+        double expect_expression()
+        {
+            double value = expect_term();
+            for (;;)
             {
-                // Protect against self-modification
-                int r_num = other.num;
-                int r_den = other.den;
-
-                int g = gcd(den, r_den);
-                den /= g;
-                num = num * (r_den / g) + r_num * den;
-                g = gcd(num, g);
-                num /= g;
-                den *= r_den / g;
-                
-                return *this;
+                if (accept_symbol("+"))
+                    value += expect_term();
+                else if (accept_symbol("-"))
+                    value -= expect_term();
+                else
+                    return value;
             }
+        }
 
-            rational& operator-=(const rational& other)
+        double expect_term()
+        {
+            double value = expect_factor();
+            for (;;)
             {
-                // Protect against self-modification
-                int r_num = other.num;
-                int r_den = other.den;
+                if (accept_symbol("*"))
+                    value *= expect_factor();
+                else if (accept_symbol("/"))
+                    value /= expect_factor();
+                else
+                    return value;
+            }
+        }
 
-                int g = gcd(den, r_den);
-                den /= g;
-                num = num * (r_den / g) - r_num * den;
-                g = gcd(num, g);
-                num /= g;
-                den *= r_den / g;
+        double expect_factor()
+        {
+            if (accept_symbol("-"))
+            {
+                return -expect_factor();
+            }
+            if (accept_symbol("+"))
+            {
+                return expect_factor();
+            }
 
-                return *this;
+            double value = expect_primary();
+            if (accept_symbol("^"))
+            {
+                value = std::pow(value, expect_factor());
             }
+            return value;
+        }
 
-            rational& operator*=(const rational& other)
+        double expect_primary()
+        {
+            if (kind == token_kind::integer || kind == token_kind::real)
             {
-                // Protect against self-modification
-                int r_num = other.num;
-                int r_den = other.den;
+                double value = std::stod(text);
+                advance();
+                return value;
+            }
 
-                int gcd1 = gcd(num, r_den);
-                int gcd2 = gcd(r_num, den);
-                num = (num / gcd1) * (r_num / gcd2);
-                den = (den / gcd2) * (r_den / gcd1);
+            if (accept_symbol("("))
+            {
+                double value = expect_expression();
+                expect_symbol(")");
+                return value;
+            }
 
-                return *this;
+            if (kind != token_kind::identifier)
+            {
+                throw std::runtime_error("expected expression");
             }
 
-            rational& operator/=(const rational& other)
+            std::string name = expect_identifier();
+            if (name == "pi")
             {
-                // Protect against self-modification
-                int r_num = other.num;
-                int r_den = other.den;
+                return 3.14159265358979323846;
+            }
 
-                assert(r_num != 0);
+            static const std::map<std::string, double (*)(double)> functions = {
+                { "sin", [](double x) { return std::sin(x); } },
+                { "cos", [](double x) { return std::cos(x); } },
+                { "tan", [](double x) { return std::tan(x); } },
+                { "exp", [](double x) { return std::exp(x); } },
+                { "ln", [](double x) { return std::log(x); } },
+                { "sqrt", [](double x) { return std::sqrt(x); } }
+            };
 
-                if (num == 0)
-                    return *this;
+            auto found = functions.find(name);
+            if (found == end(functions))
+            {
+                throw std::runtime_error("unknown identifier " + name);
+            }
 
-                int gcd1 = gcd(num, r_num);
-                int gcd2 = gcd(r_den, den);
-                num = (num / gcd1) * (r_den / gcd2);
-                den = (den / gcd2) * (r_num / gcd1);
+            expect_symbol("(");
+            double value = found->second(expect_expression());
+            expect_symbol(")");
+            return value;
+        }
 
-                if (den < 0)
+        // the parenthesized parameters of a gate, if any
+        std::vector<double> accept_params()
+        {
+            std::vector<double> params;
+            if (accept_symbol("("))
+            {
+                do
                 {
-                    num = -num;
-                    den = -den;
-                }
+                    int param_line = token_line, param_col = token_col;
+                    double value = expect_expression();
+                    if (!std::isfinite(value))
+                    {
+                        // report the error at the start of the parameter
+                        token_line = param_line;
+                        token_col = param_col;
+                        throw std::runtime_error("angle isn't finite");
+                    }
+                    params.push_back(value);
+                } while (accept_symbol(","));
+                expect_symbol(")");
+            }
+            return params;
+        }
 
-                return *this;
+        // the qubits of a register or of a single indexed qubit
+        std::vector<int> expect_qubits()
+        {
+            std::string name = expect_identifier();
+
+            auto found = qregs.find(name);
+            if (found == end(qregs))
+            {
+                throw std::runtime_error(cregs.count(name) ? "expected qubit, got classical bit" : "undeclared register " + name);
             }
 
-            rational operator+(const rational& other) const
+            std::vector<int> qubits;
+            if (accept_symbol("["))
             {
-                rational tmp(*this);
-                return tmp += other;
+                int index = expect_integer();
+                if (index >= found->second.size)
+                {
+                    throw std::runtime_error("index out of range for " + name);
+                }
+                expect_symbol("]");
+                qubits.push_back(found->second.first_var_id + index);
+            }
+            else
+            {
+                for (int i = 0; i < found->second.size; i++)
+                {
+                    qubits.push_back(found->second.first_var_id + i);
+                }
             }
+            return qubits;
+        }
 
-            rational operator-(const rational& other) const
+        // finds the gate_opcode of a standard gate. fredkin means swap.
+        static bool find_builtin(const std::string& name, gate_opcode* opcode, int* num_controls, bool* is_identity)
+        {
+            *is_identity = false;
+
+            // u1 is the older name of p
+            if (name == "u1" || name == "cu1")
             {
-                rational tmp(*this);
-                return tmp -= other;
+                *opcode = gate_opcode::phase;
+                *num_controls = name == "cu1" ? 1 : 0;
+                return true;
             }
 
-            rational operator*(const rational& other) const
+            if (name == "CX")
             {
-                rational tmp(*this);
-                return tmp *= other;
+                *opcode = gate_opcode::toffoli;
+                *num_controls = 1;
+                return true;
             }
 
-            rational operator/(const rational& other) const
+            if (name == "id")
             {
-                rational tmp(*this);
-                return tmp /= other;
+                *opcode = gate_opcode::toffoli;
+                *num_controls = 0;
+                *is_identity = true;
+                return true;
             }
-        };
 
-        class irrational
-        {
-            rational intpart;
-            rational sqrt2part;
+            size_t num_c = 0;
+            while (num_c < name.size() && name[num_c] == 'c')
+            {
+                num_c++;
+            }
 
-        public:
-            irrational() = default;
+            static const std::map<std::string, gate_opcode> bases = {
+                { "x", gate_opcode::toffoli },
+                { "y", gate_opcode::pauli_y },
+                { "z", gate_opcode::pauli_z },
+                { "h", gate_opcode::hadamard },
+                { "s", gate_opcode::rotate_pi_by_2 },
+                { "sdg", gate_opcode::inv_rotate_pi_by_2 },
+                { "t", gate_opcode::rotate_pi_by_4 },
+                { "tdg", gate_opcode::inv_rotate_pi_by_4 },
+                { "sx", gate_opcode::sqrtnot },
+                { "sxdg", gate_opcode::inv_sqrtnot },
+                { "swap", gate_opcode::fredkin },
+                { "rz", gate_opcode::rotate_z },
+                { "ry", gate_opcode::rotate_y },
+                { "p", gate_opcode::phase }
+            };
 
-            explicit irrational(const rational& i)
-                : intpart(i)
-                , sqrt2part(0)
-            { }
+            auto found = bases.find(name.substr(num_c));
+            if (found == end(bases))
+            {
+                return false;
+            }
 
-            irrational(const rational& i, const rational& sq2)
-                : intpart(i)
-                , sqrt2part(sq2)
-            { }
+            *opcode = found->second;
+            *num_controls = (int)num_c;
+            return true;
+        }
 
-            rational integer() const
+        // number of qubits the gate takes, or -1 if the gate is unknown
+        int gate_arity(const std::string& name) const
+        {
+            auto defined = definitions.find(name);
+            if (defined != end(definitions))
             {
-                return intpart;
+                return defined->second.num_args;
             }
 
-            rational sqrt2() const
+            gate_opcode opcode;
+            int num_controls;
+            bool is_identity;
+            if (!find_builtin(name, &opcode, &num_controls, &is_identity))
             {
-                return sqrt2part;
+                return -1;
             }
+            return num_controls + (opcode == gate_opcode::fredkin ? 2 : 1);
+        }
 
-            bool operator==(const irrational& other) const
+        // number of parameters the gate takes. gates defined in the program take none.
+        int gate_param_count(const std::string& name) const
+        {
+            gate_opcode opcode;
+            int num_controls;
+            bool is_identity;
+            if (definitions.count(name) || !find_builtin(name, &opcode, &num_controls, &is_identity))
             {
-                return intpart == other.intpart && sqrt2part == other.sqrt2part;
+                return 0;
             }
+            return has_angle_operand(opcode) ? 1 : 0;
+        }
 
-            irrational& operator+=(const irrational& other)
+        void check_params(const std::string& name, const std::vector<double>& params) const
+        {
+            int param_count = gate_param_count(name);
+            if ((int)params.size() != param_count)
             {
-                intpart += other.intpart;
-                sqrt2part += other.sqrt2part;
+                throw std::runtime_error(name + " takes " + std::to_string(param_count) + " parameters");
+            }
+        }
 
-                return *this;
+        void send_header()
+        {
+            if (!has_header)
+            {
+                has_header = true;
+                if (listener)
+                {
+                    listener->on_header(spec);
+                }
             }
+        }
 
-            irrational& operator-=(const irrational& other)
+        // appends the gate to the gate stream, expanding gate definitions
+        void emit(const std::string& name, const std::vector<double>& params, const std::vector<int>& qubits)
+        {
+            auto defined = definitions.find(name);
+            if (defined != end(definitions))
             {
-                intpart -= other.intpart;
-                sqrt2part -= other.sqrt2part;
+                std::vector<int> call_qubits;
+                for (const gate_call& call : defined->second.body)
+                {
+                    call_qubits.clear();
+                    for (int arg : call.args)
+                    {
+                        call_qubits.push_back(qubits[arg]);
+                    }
+                    emit(call.name, call.params, call_qubits);
+                }
+                return;
+            }
 
-                return *this;
+            gate_opcode opcode;
+            int num_controls;
+            bool is_identity;
+            if (!find_builtin(name, &opcode, &num_controls, &is_identity))
+            {
+                throw std::logic_error("unknown gate " + name);
             }
 
-            irrational& operator*=(const irrational& other)
+            for (size_t i = 0; i < qubits.size(); i++)
             {
-                // (a + b sqrt(2)) * (c + d sqrt(2))
-                // = ac + ad sqrt(2) + bc sqrt(2) + bd 2
-                // = (ac + 2bd) + (ad + bc) sqrt(2)
-                rational a = intpart, b = sqrt2part, c = other.intpart, d = other.sqrt2part;
-                
-                intpart = a * c + rational(2) * b * d;
-                sqrt2part = a * d + b * c;
+                if (measured[qubits[i]])
+                {
+                    throw std::runtime_error("gate on measured qubit " + spec.variable_names[qubits[i]]);
+                }
 
-                return *this;
+                for (size_t j = 0; j < i; j++)
+                {
+                    if (qubits[i] == qubits[j])
+                    {
+                        throw std::runtime_error("duplicate qubit " + spec.variable_names[qubits[i]]);
+                    }
+                }
             }
 
-            irrational& operator/=(const irrational& other)
+            send_header();
+
+            if (is_identity)
             {
-                // derived with wolfram alpha lol
-                rational a = intpart, b = sqrt2part, c = other.intpart, d = other.sqrt2part;
+                return;
+            }
 
-                rational denom = (c * c - rational(2) * d * d);
-                intpart = (a * c - rational(2) * b * d) / denom;
-                sqrt2part = (b * c - a * d) / denom;
+            size_t instr_i = spec.gate_stream.size();
 
-                return *this;
+            spec.gate_stream.push_back((int)opcode);
+            spec.gate_stream.push_back((int)qubits.size() + (has_angle_operand(opcode) ? angle_operand_count : 0));
+
+            if (has_angle_operand(opcode))
+            {
+                append_angle_operand(params[0], &spec.gate_stream);
             }
 
-            irrational operator+(const irrational& other) const
+            // controls are in variable order, the targets stay in place
+            size_t first_control_i = spec.gate_stream.size();
+            spec.gate_stream.insert(end(spec.gate_stream), begin(qubits), end(qubits));
+            std::sort(spec.gate_stream.begin() + first_control_i, spec.gate_stream.begin() + first_control_i + num_controls, operand_var_less);
+
+            if (listener)
             {
-                irrational tmp(*this);
-                return tmp += other;
+                listener->on_gate(&spec.gate_stream[instr_i]);
+
+                if (listener->discard_gates())
+                {
+                    spec.gate_stream.clear();
+                }
             }
+        }
 
-            irrational operator-(const irrational& other) const
+        void parse_qreg()
+        {
+            if (has_header)
             {
-                irrational tmp(*this);
-                return tmp -= other;
+                throw std::runtime_error("qreg after the first gate");
             }
 
-            irrational operator*(const irrational& other) const
+            std::string name = expect_identifier();
+            expect_symbol("[");
+            int size = expect_integer();
+            expect_symbol("]");
+            expect_symbol(";");
+
+            if (size == 0)
             {
-                irrational tmp(*this);
-                return tmp *= other;
+                throw std::runtime_error("empty register");
             }
 
-            irrational operator/(const irrational& other) const
+            if (qregs.count(name) || cregs.count(name))
             {
-                irrational tmp(*this);
-                return tmp /= other;
+                throw std::runtime_error("duplicate register " + name);
             }
-        };
 
-        irrational real;
-        irrational imag;
+            qregs.emplace(name, qubit_register{ spec.num_variables, size });
 
-    public:
-        weight() = default;
+            for (int i = 0; i < size; i++)
+            {
+                int var_id = spec.num_variables;
+                std::string var_name = name + "[" + std::to_string(i) + "]";
+
+                spec.variable_name_to_id.emplace(var_name, var_id);
+                spec.variable_names.push_back(var_name);
+                spec.variable_input_list_index.push_back(var_id);
+                spec.variable_output_list_index.push_back(var_id);
+                spec.variable_constant_input.push_back(-1);
+                spec.input_variable_ids.push_back(var_id);
+                spec.output_variable_ids.push_back(var_id);
+                measured.push_back(false);
+
+                spec.num_variables += 1;
+            }
 
-        static weight zero()
-        {
-            weight w;
-            w.real = irrational(rational(0));
-            w.imag = irrational(rational(0));
-            return w;
+            spec.num_inputs = spec.num_variables;
+            spec.num_outputs = spec.num_variables;
         }
 
-        static weight one()
+        void parse_creg()
         {
-            weight w;
-            w.real = irrational(rational(1));
-            w.imag = irrational(rational(0));
-            return w;
-        }
+            std::string name = expect_identifier();
+            expect_symbol("[");
+            int size = expect_integer();
+            expect_symbol("]");
+            expect_symbol(";");
 
-        static weight i()
-        {
-            weight w;
-            w.real = irrational(rational(0));
-            w.imag = irrational(rational(1));
-            return w;
-        }
+            if (qregs.count(name) || cregs.count(name))
+            {
+                throw std::runtime_error("duplicate register " + name);
+            }
 
-        static weight sq2()
-        {
-            weight w;
-            w.real = irrational(rational(0), rational(1));
-            w.imag = irrational(rational(0));
-            return w;
+            cregs.emplace(name, size);
         }
 
-        bool operator==(const weight& other) const
+        void parse_measure()
         {
-            return real == other.real && imag == other.imag;
-        }
+            std::vector<int> qubits = expect_qubits();
+            expect_symbol("->");
 
-        bool operator!=(const weight& other) const
-        {
-            return !(operator==(other));
+            std::string creg = expect_identifier();
+            if (!cregs.count(creg))
+            {
+                throw std::runtime_error("undeclared classical register " + creg);
+            }
+            if (accept_symbol("["))
+            {
+                if (expect_integer() >= cregs[creg])
+                {
+                    throw std::runtime_error("index out of range for " + creg);
+                }
+                expect_symbol("]");
+            }
+            expect_symbol(";");
+
+            for (int qubit : qubits)
+            {
+                measured[qubit] = true;
+            }
         }
 
-        weight& operator+=(const weight& other)
+        void parse_definition()
         {
-            // (a + bi) + (c + di)
-            // = (a + c) + (b + d)i
-            irrational a = real, b = imag, c = other.real, d = other.imag;
+            std::string name = expect_identifier();
+            if (accept_symbol("("))
+            {
+                throw std::runtime_error("gate definitions with parameters aren't supported");
+            }
 
-            real = a + c;
-            imag = b + d;
+            std::map<std::string, int> formals;
+            do
+            {
+                std::string formal = expect_identifier();
+                if (!formals.emplace(formal, (int)formals.size()).second)
+                {
+                    throw std::runtime_error("duplicate argument " + formal);
+                }
+            } while (accept_symbol(","));
 
-            return *this;
-        }
+            gate_definition definition;
+            definition.num_args = (int)formals.size();
 
-        weight operator+(const weight& other) const
-        {
-            weight tmp(*this);
-            return tmp += other;
-        }
+            expect_symbol("{");
+            while (!accept_symbol("}"))
+            {
+                gate_call call;
+                call.name = expect_identifier();
 
-        weight& operator-=(const weight& other)
-        {
-            // (a + bi) - (c + di)
-            // = (a - c) + (b - d)i
-            irrational a = real, b = imag, c = other.real, d = other.imag;
-
-            real = a - c;
-            imag = b - d;
+                bool is_barrier = call.name == "barrier";
+                if (!is_barrier)
+                {
+                    // parameters are constants, since definitions can't have parameters of their own
+                    call.params = accept_params();
+                }
 
-            return *this;
-        }
+                do
+                {
+                    std::string formal = expect_identifier();
+                    auto found = formals.find(formal);
+                    if (found == end(formals))
+                    {
+                        throw std::runtime_error("unknown argument " + formal);
+                    }
+                    call.args.push_back(found->second);
+                } while (accept_symbol(","));
+                expect_symbol(";");
 
-        weight operator-(const weight& other) const
-        {
-            weight tmp(*this);
-            return tmp -= other;
-        }
+                if (is_barrier)
+                {
+                    continue;
+                }
 
-        weight& operator*=(const weight& other)
-        {
-            // (a + bi) * (c + di)
-            // = ac + adi + bci - bd
-            // = (ac - bd) + (ad + bc)i
-            irrational a = real, b = imag, c = other.real, d = other.imag;
-            
-            real = a * c - b * d;
-            imag = a * d + b * c;
+                int arity = gate_arity(call.name);
+                if (arity == -1)
+                {
+                    throw std::runtime_error("unknown gate " + call.name);
+                }
+                if (arity != (int)call.args.size())
+                {
+                    throw std::runtime_error(call.name + " takes " + std::to_string(arity) + " qubits");
+                }
+                check_params(call.name, call.params);
 
-            return *this;
-        }
+                definition.body.push_back(call);
+            }
 
-        weight operator*(const weight& other) const
-        {
-            weight tmp(*this);
-            return tmp *= other;
+            if (!definitions.emplace(name, definition).second)
+            {
+                throw std::runtime_error("duplicate gate definition " + name);
+            }
         }
 
-        weight& operator/=(const weight& other)
+        void parse_application(const std::string& name)
         {
-            // proof: http://mathworld.wolfram.com/ComplexDivision.html
-            irrational a = real, b = imag, c = other.real, d = other.imag;
+            std::vector<double> params = accept_params();
 
-            irrational denom = c * c + d * d;
-            real = (a * c + b * d) / denom;
-            imag = (b * c - a * d) / denom;
+            std::vector<std::vector<int>> operands;
+            do
+            {
+                operands.push_back(expect_qubits());
+            } while (accept_symbol(","));
 
-            return *this;
-        }
+            // the semicolon is consumed last, so errors point at the statement
+            if (kind != token_kind::symbol || text != ";")
+            {
+                throw std::runtime_error("expected ;");
+            }
 
-        weight operator/(const weight& other) const
-        {
-            weight tmp(*this);
-            return tmp /= other;
-        }
+            bool is_barrier = name == "barrier";
+            if (is_barrier)
+            {
+                advance();
+                return;
+            }
 
-        std::string to_string() const
-        {
-            static const auto rational_to_string = [](const rational& r, char mode)
+            int arity = gate_arity(name);
+            if (arity == -1)
             {
-                std::string s;
+                throw std::runtime_error("unknown gate " + name);
+            }
+            if (arity != (int)operands.size())
+            {
+                throw std::runtime_error(name + " takes " + std::to_string(arity) + " qubits");
+            }
+            check_params(name, params);
 
-                if (mode == 'r')
-                {
-                    s += std::to_string(r.numerator());
-                }
-                
-                if (mode == 'i')
+            // whole registers apply the gate once per qubit
+            size_t num_applications = 1;
+            for (const std::vector<int>& operand : operands)
+            {
+                if (operand.size() != 1)
                 {
-                    if (r.numerator() == 1)
-                    {
-                        s += "i";
-                    }
-                    else if (r.numerator() == -1)
+                    if (num_applications != 1 && num_applications != operand.size())
                     {
-                        s += "-i";
-                    }
-                    else
-                    {
-                        s += std::to_string(r.numerator()) + "i";
+                        throw std::runtime_error("registers of different sizes");
                     }
+                    num_applications = operand.size();
                 }
+            }
 
-                if (r.denominator() != 1)
+            std::vector<int> qubits(operands.size());
+            for (size_t i = 0; i < num_applications; i++)
+            {
+                for (size_t j = 0; j < operands.size(); j++)
                 {
-                    s += "/" + std::to_string(r.denominator());
+                    qubits[j] = operands[j][operands[j].size() == 1 ? 0 : i];
                 }
+                emit(name, params, qubits);
+            }
 
-                return s;
-            };
+            advance();
+        }
 
-            static const auto irrational_to_string = [](const irrational& ir, char mode)
+        void parse_program()
+        {
+            advance();
+
+            if (expect_identifier() != "OPENQASM")
             {
-                std::string s;
+                throw std::runtime_error("expected OPENQASM");
+            }
+            if ((kind != token_kind::real && kind != token_kind::integer) || std::stod(text) < 2.0 || std::stod(text) >= 3.0)
+            {
+                throw std::runtime_error("expected version 2.0");
+            }
+            advance();
+            expect_symbol(";");
 
-                bool wrote_intpart = false;
-                if (ir.integer() != rational(0))
-                {
-                    s += rational_to_string(ir.integer(), mode);
+            while (kind != token_kind::end)
+            {
+                std::string keyword = expect_identifier();
 
-                    wrote_intpart = true;
-                }
-                
-                bool wrote_sqrt2part = false;
-                if (ir.sqrt2() != rational(0))
+                if (keyword == "include")
                 {
-                    if (wrote_intpart && ir.sqrt2().numerator() > 0)
+                    if (kind != token_kind::string || text != "qelib1.inc")
                     {
-                        s += "+";
+                        throw std::runtime_error("only qelib1.inc can be included");
                     }
-
-                    if (ir.sqrt2().denominator() != 1)
-                        s += "(";
-
-                    s += rational_to_string(ir.sqrt2(), mode);
-
-                    if (ir.sqrt2().denominator() != 1)
-                        s += ")";
-
-                    // utf8 sqrt symbol
-                    s += "\xe2\x88\x9a";
-
-                    s += "2";
-
-                    wrote_sqrt2part = true;
+                    advance();
+                    expect_symbol(";");
                 }
-
-                if (!wrote_intpart && !wrote_sqrt2part)
+                else if (keyword == "qreg")
                 {
-                    s += "0";
+                    parse_qreg();
                 }
-
-                return s;
-            };
-
-            static const auto complex_to_string = [](const irrational& real, const irrational& imag)
-            {
-                std::string s;
-
-                int num_real_terms = int(real.integer() != rational(0)) + int(real.sqrt2() != rational(0));
-                if (num_real_terms > 0)
+                else if (keyword == "creg")
                 {
-                    if (num_real_terms > 1)
-                        s += "(";
-
-                    s += irrational_to_string(real, 'r');
-
-                    if (num_real_terms > 1)
-                        s += ")";
+                    parse_creg();
                 }
-
-                int num_imag_terms = int(imag.integer() != rational(0)) + int(imag.sqrt2() != rational(0));
-                if (num_imag_terms > 0)
+                else if (keyword == "measure")
                 {
-                    if (num_real_terms > 0)
-                        s += "+";
-
-                    if (num_imag_terms > 1)
-                        s += "(";
-
-                    s += irrational_to_string(imag, 'i');
-
-                    if (num_imag_terms > 1)
-                        s += ")";
+                    parse_measure();
                 }
-
-                if (num_real_terms == 0 && num_imag_terms == 0)
+                else if (keyword == "gate")
                 {
-                    s += "0";
+                    parse_definition();
                 }
+                else if (keyword == "opaque" || keyword == "reset" || keyword == "if" || keyword == "U")
+                {
+                    throw std::runtime_error(keyword + " isn't supported");
+                }
+                else
+                {
+                    parse_application(keyword);
+                }
+            }
 
-                return s;
-            };
-
-            std::string s = complex_to_string(real, imag);
-
-            return s;
+            send_header();
         }
     };
 
-    class unique_table
+    reader r;
+    r.listener = listener;
+    r.s = txt;
+    r.linestart = txt;
+    r.token_line = 1;
+    r.token_col = 0;
+    r.spec.num_variables = 0;
+    r.spec.num_inputs = 0;
+    r.spec.num_outputs = 0;
+
+    try
     {
-        struct node
-        {
-            uint32_t var;
-            std::array<node_handle,p*p> children;
-            std::array<weight_handle, p*p> weights;
+        r.parse_program();
+    }
+    catch (const std::exception& e)
+    {
+        throw std::runtime_error(std::to_string(r.token_line) + ":" + std::to_string(r.token_col) + ": " + e.what());
+    }
 
-            bool operator==(const node& other) const
-            {
-                return std::tie(var, children, weights) == std::tie(other.var, other.children, other.weights);
-            }
-        };
+    return r.spec;
+}
+
+// reads a RevLib .real program.
+// peres gates (p) and inverse peres gates (pi) are kept as single instructions.
+// controls can be given in any order, they are sorted into variable order.
+program_spec parse_real(const char* txt, parse_listener* listener = NULL)
+{
+    program_spec spec;
+    spec.num_variables = 0;
+    spec.num_inputs = 0;
+    spec.num_outputs = 0;
 
-        static const uint32_t capacity = 0x100000;
-        static_assert((capacity & (capacity - 1)) == 0, "capacity must be power of two");
+    int line = 0;
+    const char* linestart = txt;
+    const char* token_start = txt;
 
-        static const uint32_t ddutmask = capacity - 1;
+    int declared_num_variables = -1;
+    bool has_variable_listing = false;
+    std::string constants;
+    std::string garbage;
 
-        std::unique_ptr<node[]> node_pool;
+    enum class parser_state
+    {
+        reading_tags,
+        reading_gate_list,
+        end
+    };
 
-        uint32_t pool_head;
+    parser_state state = parser_state::reading_tags;
 
-        node* pool_alloc()
+    try
+    {
+        for (const char* s = txt; *s && state != parser_state::end; )
         {
-            uint32_t old_head = pool_head++;
+            line++;
+            linestart = s;
+            token_start = s;
 
-            if (old_head >= capacity)
+            const char* eol = s;
+            while (*eol && *eol != '\n')
             {
-                printf("pool_alloc failed\n");
-                std::abort();
+                eol++;
             }
 
-            return &node_pool[old_head];
-        }
+            // whitespace separated tokens, up to a comment
+            std::vector<std::string> tokens;
+            std::vector<const char*> token_starts;
+            for (const char* t = s; t < eol && *t != '#'; )
+            {
+                if (std::isspace(*t))
+                {
+                    t++;
+                    continue;
+                }
 
-        std::unique_ptr<node_handle[]> table;
+                const char* t_end = t;
+                while (t_end < eol && !std::isspace(*t_end) && *t_end != '#')
+                {
+                    t_end++;
+                }
 
-        node* true_node;
+                tokens.push_back(std::string(t, t_end));
+                token_starts.push_back(t);
+                t = t_end;
+            }
 
-        node_handle to_handle(const node* n) const
-        {
-            return node_handle{ uint32_t(n - &node_pool[0]) };
-        }
+            s = *eol ? eol + 1 : eol;
 
-        const node* to_node(node_handle h) const
-        {
-            return (const node*)&node_pool[h.value];
-        }
+            if (tokens.empty())
+            {
+                continue;
+            }
 
-    public:
-        void init(uint32_t num_vars)
-        {
-            node_pool.reset(new node[capacity]);
-            pool_head = 0;
+            token_start = token_starts[0];
 
-            table.reset(new node_handle[capacity]);
-            for (uint32_t i = 0; i < capacity; i++)
+            std::string keyword = tokens[0];
+            for (char& c : keyword)
             {
-                table[i] = invalid_node;
+                c = (char)std::tolower(c);
             }
 
-            true_node = pool_alloc();
-            true_node->var = num_vars;
-            for (int i = 0; i < p*p; i++)
+            if (state == parser_state::reading_tags)
             {
-                true_node->children[i] = to_handle(true_node);
-                true_node->weights[i] = weight_1_handle;
-            }
-        }
+                if (keyword == ".version" || keyword == ".inputs" || keyword == ".outputs" ||
+                    keyword == ".inputbus" || keyword == ".outputbus" || keyword == ".state")
+                {
+                    // labels only, the roles of the lines come from .constants and .garbage
+                    continue;
+                }
 
-        node_handle get_true() const
-        {
-            return to_handle(true_node);
-        }
+                if (keyword == ".numvars")
+                {
+                    if (tokens.size() != 2 || tokens[1].find_first_not_of("0123456789") != std::string::npos || tokens[1].size() > 9)
+                        throw std::runtime_error("expected number of variables");
 
-        int get_var(node_handle h) const
-        {
-            return to_node(h)->var;
-        }
+                    declared_num_variables = std::stoi(tokens[1]);
+                    continue;
+                }
 
-        void get_children(node_handle h, node_handle children[p*p]) const
-        {
-            const node* n = to_node(h);
-            for (int i = 0; i < p*p; i++)
-            {
-                children[i] = n->children[i];
-            }
-        }
+                if (keyword == ".variables")
+                {
+                    if (has_variable_listing)
+                        throw std::runtime_error("duplicate variable listing (.variables)");
 
-        node_handle get_child(node_handle h, int i) const
-        {
-            return to_node(h)->children[i];
-        }
+                    has_variable_listing = true;
 
-        void get_weights(node_handle h, weight_handle weights[p*p]) const
-        {
-            const node* n = to_node(h);
-            for (int i = 0; i < p*p; i++)
-            {
-                weights[i] = n->weights[i];
-            }
-        }
+                    for (size_t i = 1; i < tokens.size(); i++)
+                    {
+                        token_start = token_starts[i];
 
-        weight_handle get_weight(node_handle h, int i) const
-        {
-            return to_node(h)->weights[i];
-        }
+                        bool inserted = spec.variable_name_to_id.emplace(tokens[i], spec.num_variables).second;
+                        if (!inserted)
+                        {
+                            throw std::runtime_error("duplicate variable name");
+                        }
 
-        node_handle insert(uint32_t var, const node_handle children[p*p], const weight_handle weights[p*p])
-        {
-            node n;
-            n.var = var;
-            for (int i = 0; i < p*p; i++)
-            {
-                n.children[i] = children[i];
-                n.weights[i] = weights[i];
-            }
+                        spec.variable_names.push_back(tokens[i]);
+                        spec.num_variables += 1;
+                    }
 
-            uint32_t key = var;
-            for (int i = 0; i < p*p; i++)
-            {
-                key += children[i].value + weights[i].value;
-            }
-            key = key & ddutmask;
+                    continue;
+                }
 
-            while (table[key] != invalid_node)
-            {
-                const node* curr = to_node(table[key]);
-                if (*curr == n)
+                if (keyword == ".constants" || keyword == ".garbage")
                 {
-                    return to_handle(curr);
-                }
-                key = (key + 1) & ddutmask;
-            }
+                    if (tokens.size() != 2)
+                        throw std::runtime_error("expected one character per variable");
 
-            node* new_node = pool_alloc();
-            *new_node = n;
+                    (keyword == ".constants" ? constants : garbage) = tokens[1];
+                    continue;
+                }
 
-            node_handle handle = to_handle(new_node);
-            table[key] = handle;
-            return handle;
-        }
-    };
+                if (keyword == ".begin")
+                {
+                    if (!has_variable_listing)
+                        throw std::runtime_error("missing variable listing (.variables)");
+                    if (declared_num_variables != -1 && declared_num_variables != spec.num_variables)
+                        throw std::runtime_error(".numvars doesn't match .variables");
+                    if (!constants.empty() && (int)constants.size() != spec.num_variables)
+                        throw std::runtime_error(".constants doesn't have one character per variable");
+                    if (!garbage.empty() && (int)garbage.size() != spec.num_variables)
+                        throw std::runtime_error(".garbage doesn't have one character per variable");
+
+                    spec.variable_input_list_index.resize(spec.num_variables, -1);
+                    spec.variable_output_list_index.resize(spec.num_variables, -1);
+                    spec.variable_constant_input.resize(spec.num_variables, -1);
+
+                    for (int var_id = 0; var_id < spec.num_variables; var_id++)
+                    {
+                        char constant = constants.empty() ? '-' : constants[var_id];
+                        if (constant == '-')
+                        {
+                            spec.variable_input_list_index[var_id] = spec.num_inputs;
+                            spec.input_variable_ids.push_back(var_id);
+                            spec.num_inputs += 1;
+                        }
+                        else if (constant == '0' || constant == '1')
+                        {
+                            spec.variable_constant_input[var_id] = constant - '0';
+                        }
+                        else
+                        {
+                            throw std::runtime_error(".constants can only contain -, 0 and 1");
+                        }
 
-    class computed_table
-    {
-        struct cache_entry
-        {
-            edge e0;
-            edge e1;
-            edge_op op;
-            edge result;
-        };
+                        char garbage_flag = garbage.empty() ? '-' : garbage[var_id];
+                        if (garbage_flag == '-')
+                        {
+                            spec.variable_output_list_index[var_id] = spec.num_outputs;
+                            spec.output_variable_ids.push_back(var_id);
+                            spec.num_outputs += 1;
+                        }
+                        else if (garbage_flag != '1')
+                        {
+                            throw std::runtime_error(".garbage can only contain - and 1");
+                        }
+                    }
 
-        static const uint32_t ctsize = 1024;
-        static_assert((ctsize & (ctsize - 1)) == 0, "ctsize must be a power of two");
+                    state = parser_state::reading_gate_list;
 
-        static const uint32_t ctmask = ctsize - 1;
+                    if (listener)
+                    {
+                        listener->on_header(spec);
+                    }
 
-        std::vector<cache_entry> cache;
+                    continue;
+                }
 
-        static uint32_t hash(const edge& e0, const edge& e1, edge_op op)
-        {
-            return (e0.v.value + e1.v.value + e0.w.value + e1.w.value + op) & ctmask;
-        }
+                throw std::runtime_error("expected tag or .begin");
+            }
+            else if (state == parser_state::reading_gate_list)
+            {
+                if (keyword == ".end")
+                {
+                    state = parser_state::end;
+                    continue;
+                }
 
-    public:
-        computed_table()
-            : cache(ctsize, cache_entry{ edge(), edge(), (edge_op)0, edge() })
-        { }
+                // gate kind, an optional +, then the parameter count
+                size_t kind_end = 0;
+                while (kind_end < keyword.size() && std::isalpha(keyword[kind_end]))
+                {
+                    kind_end++;
+                }
 
-        edge find(const edge& e0, const edge& e1, edge_op op) const
-        {
-            uint32_t key = hash(e0, e1, op);
+                std::string kind = keyword.substr(0, kind_end);
+                if (kind_end < keyword.size() && keyword[kind_end] == '+')
+                {
+                    kind += '+';
+                    kind_end++;
+                }
 
-            const cache_entry& entry = cache[key];
-            if (entry.e0 == e0 && entry.e1 == e1 && entry.op == op)
-                return entry.result;
-            else
-                return edge(invalid_weight, invalid_node);
-        }
+                std::string count = keyword.substr(kind_end);
+                if (count.empty() || count.size() > 5 || count.find_first_not_of("0123456789") != std::string::npos)
+                {
+                    throw std::runtime_error("expected gate");
+                }
 
-        void insert(const edge& e0, const edge& e1, edge_op op, const edge& r)
-        {
-            uint32_t key = hash(e0, e1, op);
-            cache[key] = cache_entry{ e0, e1, op, r };
-        }
-    };
+                int pcnt = std::stoi(count);
 
-    class unique_weights
-    {
-        std::vector<weight> weights;
+                gate_opcode opcode;
+                int num_targets;
+                if (kind == "t")
+                {
+                    opcode = gate_opcode::toffoli;
+                    num_targets = 1;
+                }
+                else if (kind == "v")
+                {
+                    opcode = gate_opcode::sqrtnot;
+                    num_targets = 1;
+                }
+                else if (kind == "v+")
+                {
+                    opcode = gate_opcode::inv_sqrtnot;
+                    num_targets = 1;
+                }
+                else if (kind == "f")
+                {
+                    opcode = gate_opcode::fredkin;
+                    num_targets = 2;
+                }
+                else if (kind == "p")
+                {
+                    opcode = gate_opcode::peres;
+                    num_targets = 2;
+                }
+                else if (kind == "pi")
+                {
+                    opcode = gate_opcode::inv_peres;
+                    num_targets = 2;
+                }
+                else
+                {
+                    throw std::runtime_error("unsupported gate " + tokens[0]);
+                }
 
-    public:
-        unique_weights()
-        {
-            weights.push_back(weight::zero());
-            weights.push_back(weight::one());
-        }
+                int min_pcnt = opcode == gate_opcode::peres || opcode == gate_opcode::inv_peres ? 3 : num_targets;
+                if (pcnt < min_pcnt)
+                {
+                    throw std::runtime_error("gate needs at least " + std::to_string(min_pcnt) + " inputs");
+                }
 
-        weight_handle insert(const weight& w)
-        {
-            for (size_t i = 0; i < weights.size(); i++)
-            {
-                if (weights[i] == w)
+                if ((int)tokens.size() - 1 != pcnt)
                 {
-                    return weight_handle{ uint32_t(i) };
+                    throw std::runtime_error((int)tokens.size() - 1 > pcnt ? "too many parameters" : "too few parameters");
                 }
-            }
 
-            weights.push_back(w);
-            return weight_handle{ uint32_t(weights.size() - 1) };
-        }
+                size_t instr_i = spec.gate_stream.size();
 
-        weight get_weight(weight_handle w) const
-        {
-            return weights[w.value];
-        }
-    };
+                spec.gate_stream.push_back((int)opcode);
+                spec.gate_stream.push_back(pcnt);
 
-    class computed_weights
-    {
-        struct cache_entry
-        {
-            weight_handle w0;
-            weight_handle w1;
-            weight_op op;
-            weight_handle result;
-        };
+                size_t first_param_i = spec.gate_stream.size();
 
-        static const uint32_t ctsize = 1024;
-        static_assert((ctsize & (ctsize - 1)) == 0, "ctsize must be a power of two");
+                for (size_t i = 1; i < tokens.size(); i++)
+                {
+                    token_start = token_starts[i];
 
-        static const uint32_t ctmask = ctsize - 1;
+                    // a leading - negates a control
+                    bool negated = tokens[i][0] == '-';
+                    if (negated && i + num_targets >= tokens.size())
+                    {
+                        throw std::runtime_error("targets can't be negated");
+                    }
 
-        std::vector<cache_entry> cache;
+                    auto found = spec.variable_name_to_id.find(negated ? tokens[i].substr(1) : tokens[i]);
+                    if (found == end(spec.variable_name_to_id))
+                    {
+                        throw std::runtime_error("undeclared variable");
+                    }
 
-        static uint32_t hash(weight_handle w0, weight_handle w1, weight_op op)
-        {
-            return (w0.value + w1.value + op) & ctmask;
-        }
+                    for (size_t j = first_param_i; j < spec.gate_stream.size(); j++)
+                    {
+                        if (operand_var_id(spec.gate_stream[j]) == found->second)
+                        {
+                            throw std::runtime_error("duplicate parameter");
+                        }
+                    }
 
-    public:
-        computed_weights()
-            : cache(ctsize, cache_entry{ invalid_weight, invalid_weight, (weight_op)0, invalid_weight })
-        { }
+                    spec.gate_stream.push_back(negated ? found->second | negated_control_bit : found->second);
+                }
 
-        weight_handle find(weight_handle w0, weight_handle w1, weight_op op) const
-        {
-            uint32_t key = hash(w0, w1, op);
+                std::sort(spec.gate_stream.begin() + first_param_i, spec.gate_stream.end() - num_targets, operand_var_less);
 
-            const cache_entry& entry = cache[key];
-            if (entry.w0 == w0 && entry.w1 == w1 && entry.op == op)
-                return entry.result;
-            else
-                return invalid_weight;
+                if (listener)
+                {
+                    listener->on_gate(&spec.gate_stream[instr_i]);
+
+                    if (listener->discard_gates())
+                    {
+                        spec.gate_stream.clear();
+                    }
+                }
+            }
         }
 
-        void insert(weight_handle w0, weight_handle w1, weight_op op, weight_handle r)
+        if (state != parser_state::end)
         {
-            uint32_t key = hash(w0, w1, op);
-            cache[key] = cache_entry{ w0, w1, op, r };
+            throw std::runtime_error(state == parser_state::reading_tags ? "expected .begin" : "expected .end");
         }
-    };
-
-    unique_table uniquetb;
-    computed_table computedtb;
+    }
+    catch (const std::exception& e)
+    {
+        throw std::runtime_error(std::to_string(line) + ":" + std::to_string(token_start - linestart) + ": " + e.what());
+    }
 
-    unique_weights uniquewt;
-    computed_weights computedwt;
+    return spec;
+}
 
-    node_handle true_node;
+// a file mapped into memory. the operating system pages its contents in and out on demand.
+class mapped_file
+{
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+    void* base = nullptr;
+    size_t length = 0;
 
 public:
-    explicit qmdd(uint32_t num_vars)
-    {
-        uniquetb.init(num_vars);
+    mapped_file() = default;
 
-        true_node = uniquetb.get_true();
-    }
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
 
-    node_handle get_true() const
+    ~mapped_file()
     {
-        return true_node;
+        close();
     }
 
-    int get_var(node_handle h) const
+    static size_t page_size()
     {
-        return uniquetb.get_var(h);
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return (size_t)sysconf(_SC_PAGESIZE);
+#endif
     }
 
-    void get_children(node_handle h, node_handle children[4]) const
+    // creates or truncates the file, sizes it, and maps the whole file.
+    // the file starts out filled with zeros, and is sparse where the file system allows it.
+    void open(const char* path, size_t size)
     {
-        return uniquetb.get_children(h, children);
-    }
+        close();
 
-    void get_weights(node_handle h, weight_handle weights[4]) const
-    {
-        return uniquetb.get_weights(h, weights);
-    }
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            throw std::runtime_error(std::string("failed to open ") + path);
+        }
 
-    node_handle make_node(uint32_t var, const node_handle children[4], const weight_handle weights[4])
-    {
-        // enforce no-redundancy constraint of QMDD
-        bool redundant = true;
-        for (int i = 0; i < p*p - 1; i++)
+        DWORD unused;
+        DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &unused, NULL);
+
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), NULL);
+        if (mapping == NULL)
         {
-            if (children[i] != children[i + 1] ||
-                weights[i] != weights[i + 1])
-            {
-                redundant = false;
-                break;
-            }
+            close();
+            throw std::runtime_error(std::string("failed to map ") + path);
         }
-        if (redundant)
+
+        base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (base == NULL)
         {
-            return children[0];
+            close();
+            throw std::runtime_error(std::string("failed to map ") + path);
+        }
+#else
+        fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            throw std::runtime_error(std::string("failed to open ") + path);
         }
 
-        // enforce uniqueness constraint of QMDD
-        return uniquetb.insert(var, children, weights);
+        if (ftruncate(fd, (off_t)size) != 0)
+        {
+            close();
+            throw std::runtime_error(std::string("failed to resize ") + path);
+        }
+
+        void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            close();
+            throw std::runtime_error(std::string("failed to map ") + path);
+        }
+
+        base = mapped;
+#endif
+        length = size;
     }
 
-    weight_handle get_weight_i_handle()
+    // opens the named shared memory segment, or creates it with the given size, and maps it.
+    // a new segment starts out filled with zeros. returns true if this call created the segment.
+    // the segment outlives the processes that map it, until it is removed (on Linux, from /dev/shm).
+    bool open_shared(const char* name, size_t size)
     {
-        weight weight_i = weight::i();
-        return uniquewt.insert(weight_i);
-    }
+        close();
 
-    weight_handle get_weight_sq2_handle()
-    {
-        weight weight_sq2 = weight::sq2();
-        return uniquewt.insert(weight_sq2);
-    }
+        bool created = true;
 
-    weight_handle apply(weight_handle w0, weight_handle w1, weight_op op)
-    {
-        weight_handle found = computedwt.find(w0, w1, op);
-        if (found != invalid_weight)
+#ifdef _WIN32
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), name);
+        if (mapping == NULL)
         {
-            return found;
+            throw std::runtime_error(std::string("failed to open shared memory ") + name);
         }
+        created = GetLastError() != ERROR_ALREADY_EXISTS;
 
-        weight new_weight;
-        if (op == weight_op_add)
+        base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (base == NULL)
         {
-            new_weight = uniquewt.get_weight(w0) + uniquewt.get_weight(w1);
+            close();
+            throw std::runtime_error(std::string("failed to map shared memory ") + name);
         }
-        else if (op == weight_op_sub)
+#else
+        std::string shm_name = name[0] == '/' ? name : std::string("/") + name;
+
+        fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1 && errno == EEXIST)
         {
-            new_weight = uniquewt.get_weight(w0) - uniquewt.get_weight(w1);
+            created = false;
+            fd = shm_open(shm_name.c_str(), O_RDWR, 0600);
         }
-        else if (op == weight_op_mul)
+        if (fd == -1)
         {
-            new_weight = uniquewt.get_weight(w0) * uniquewt.get_weight(w1);
+            throw std::runtime_error(std::string("failed to open shared memory ") + name);
         }
-        else if (op == weight_op_div)
+
+        if (created)
         {
-            new_weight = uniquewt.get_weight(w0) / uniquewt.get_weight(w1);
+            if (ftruncate(fd, (off_t)size) != 0)
+            {
+                close();
+                shm_unlink(shm_name.c_str());
+                throw std::runtime_error(std::string("failed to resize shared memory ") + name);
+            }
         }
         else
         {
-            assert(!"unimplemented op");
-            return invalid_weight;
-        }
+            // the creator sizes the segment right after creating it
+            struct stat info;
+            for (int attempt = 0; fstat(fd, &info) == 0 && info.st_size == 0 && attempt < 10000; attempt++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
 
-        weight_handle w = uniquewt.insert(new_weight);
+            if ((size_t)info.st_size != size)
+            {
+                close();
+                throw std::runtime_error(std::string("shared memory ") + name + " has a different size");
+            }
+        }
 
-        computedwt.insert(w0, w1, op, w);
+        void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            close();
+            throw std::runtime_error(std::string("failed to map shared memory ") + name);
+        }
 
-        return w;
+        base = mapped;
+#endif
+        length = size;
+        return created;
     }
 
-    edge apply(const edge& e0, const edge& e1, edge_op op)
+    void close()
     {
-        // helper to make the code better match the pseudo-code
-        struct apply_helper
-        {
-            qmdd* const dd;
-
-            weight_handle w(const edge& e)
-            {
-                return e.w; 
-            }
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base) munmap(base, length);
+        if (fd != -1) ::close(fd);
+        fd = -1;
+#endif
+        base = nullptr;
+        length = 0;
+    }
 
-            node_handle v(const edge& e)
-            {
-                return e.v;
-            }
+    void* data() const
+    {
+        return base;
+    }
 
-            int x(const edge& e)
-            { 
-                return dd->get_var(e.v); 
-            }
+    size_t size() const
+    {
+        return length;
+    }
 
-            edge Ei(const edge& e, int i)
-            {
-                return edge(dd->uniquetb.get_weight(e.v, i), dd->uniquetb.get_child(e.v, i));
-            }
+    // keeps a range of pages in memory. returns false if the operating system refused, eg. due to a lock limit.
+    bool lock(size_t offset, size_t len)
+    {
+#ifdef _WIN32
+        return VirtualLock((char*)base + offset, len) != 0;
+#else
+        return mlock((char*)base + offset, len) == 0;
+#endif
+    }
 
-            bool term(const edge& e)
-            { 
-                return e.v == dd->get_true();
-            }
+    // number of bytes of a range that are currently resident in memory. offset must be page aligned.
+    size_t resident_bytes(size_t offset, size_t len) const
+    {
+        size_t page = page_size();
+        size_t num_pages = (len + page - 1) / page;
 
-            weight_handle normalize(weight_handle children[p*p])
-            {
-                for (int i = 0; i < p*p; i++)
-                {
-                    if (children[i] != weight_0_handle)
-                    {
-                        weight_handle edge_weight = children[i];
+#ifdef _WIN32
+        std::vector<PSAPI_WORKING_SET_EX_INFORMATION> info(num_pages);
+        for (size_t i = 0; i < num_pages; i++)
+        {
+            info[i].VirtualAddress = (char*)base + offset + i * page;
+        }
 
-                        // normalize this child
-                        children[i] = weight_1_handle;
+        if (!QueryWorkingSetEx(GetCurrentProcess(), info.data(), DWORD(info.size() * sizeof(info[0]))))
+        {
+            return 0;
+        }
 
-                        // normalize the other children
-                        for (int j = i + 1; j < p*p; j++)
-                        {
-                            if (children[j] != weight_0_handle)
-                            {
-                                children[j] = dd->apply(children[j], edge_weight, weight_op_div);
-                            }
-                        }
+        size_t resident_pages = 0;
+        for (size_t i = 0; i < num_pages; i++)
+        {
+            resident_pages += info[i].VirtualAttributes.Valid;
+        }
+#else
+#ifdef __APPLE__
+        std::vector<char> vec(num_pages);
+#else
+        std::vector<unsigned char> vec(num_pages);
+#endif
+        if (mincore((char*)base + offset, len, vec.data()) != 0)
+        {
+            return 0;
+        }
 
-                        return edge_weight;
-                    }
-                }
+        size_t resident_pages = 0;
+        for (size_t i = 0; i < num_pages; i++)
+        {
+            resident_pages += vec[i] & 1;
+        }
+#endif
+        return resident_pages * page;
+    }
+};
 
-                // all weights were 0
-                return weight_0_handle;
-            }
+// thrown when a configured resource budget is exceeded.
+// the diagram is left in a consistent state, so partial results are still usable.
+class budget_exceeded : public std::runtime_error
+{
+public:
+    explicit budget_exceeded(const std::string& what)
+        : std::runtime_error(what)
+    { }
+};
 
-            edge add(const edge& e0, const edge& e1)
-            {
-                if (term(e0))
-                {
-                    // addition with 0 always returns other input
-                    if (w(e0) == weight_0_handle)
-                        return e1;
-                    else if (term(e1))
-                        return edge(dd->apply(w(e0), w(e1), weight_op_add), dd->get_true());
-                }
+class qmdd
+{
+public:
+    // to configure p-valued logic
+    static const int p = 2;
 
-                // enforce variable order of e0 < e1
-                if (x(e0) > x(e1))
-                    return add(e1, e0);
+    struct node_handle
+    { 
+        uint32_t value;
 
-                // recursively add the p*p quadrants
-                node_handle z_children[p*p];
-                weight_handle z_weights[p*p];
-                for (int i = 0; i < p*p; i++)
-                {
-                    edge q0 = edge(dd->apply(w(e0), w(Ei(e0, i)), weight_op_mul), v(Ei(e0, i)));
+        bool operator==(const node_handle& other) const
+        {
+            return value == other.value;
+        }
 
-                    edge q1;
-                    if (x(e0) == x(e1))
-                        q1 = edge(dd->apply(w(e1), w(Ei(e1, i)), weight_op_mul), v(Ei(e1, i)));
-                    else
-                        q1 = e1;
+        bool operator!=(const node_handle& other) const
+        {
+            return !(operator==(other));
+        }
+    };
 
-                    edge zi = dd->apply(q0, q1, edge_op_add);
-                    z_children[i] = zi.v;
-                    z_weights[i] = zi.w;
-                }
+    struct weight_handle
+    { 
+        uint32_t value;
 
-                // normalize weights
-                weight_handle new_weight = normalize(z_weights);
+        bool operator==(const weight_handle& other) const
+        {
+            return value == other.value;
+        }
 
-                // make the new node
-                node_handle new_node = dd->make_node(x(e0), z_children, z_weights);
+        bool operator!=(const weight_handle& other) const
+        {
+            return !(operator==(other));
+        }
+    };
 
-                return edge(new_weight, new_node);
-            }
+    static constexpr node_handle invalid_node = node_handle{ uint32_t(-1) };
+    static constexpr weight_handle invalid_weight = weight_handle{ uint32_t(-1) };
 
-            edge mul(const edge& e0, const edge& e1)
-            {
-                // multiplication with "1" terminal as base case
-                if (term(e0))
-                {
-                    // multiplication with 0 always returns 0
-                    if (w(e0) == weight_0_handle)
-                        return e0;
-                    else if (w(e0) == weight_1_handle)
-                        return e1; // avoid multiplication for the case of multiplying by 1
-                    else
-                        return edge(dd->apply(w(e0), w(e1), weight_op_mul), v(e1));
-                }
+    static constexpr weight_handle weight_0_handle = weight_handle{ 0 };
+    static constexpr weight_handle weight_1_handle = weight_handle{ 1 };
 
-                // enforce variable order of e0 < e1
-                if (x(e0) > x(e1))
-                    return add(e1, e0);
+    struct edge
+    {
+        weight_handle w;
+        node_handle v;
 
-                // recursively multiply the p*p quadrants
-                node_handle z_children[p*p];
-                weight_handle z_weights[p*p];
-                for (int i = 0; i < p * p; i += p)
-                {
-                    for (int j = 0; j < p; j++)
-                    {
-                        edge zij = edge(weight_0_handle, dd->get_true());
-                        for (int k = 0; k < p; k++)
-                        {
-                            edge q0 = edge(dd->apply(w(e0), w(Ei(e0, i + k)), weight_op_mul), v(Ei(e0, i + k)));
+        edge()
+            : w(invalid_weight)
+            , v(invalid_node)
+        { }
 
-                            edge q1;
-                            if (x(e0) == x(e1))
-                                q1 = edge(dd->apply(w(e1), w(Ei(e1, j + p*k)), weight_op_mul), v(Ei(e1, j + p*k)));
-                            else
-                                q1 = e1;
+        edge(weight_handle ww, node_handle vv)
+            : w(ww), v(vv)
+        { }
 
-                            edge q0q1 = dd->apply(q0, q1, edge_op_mul);
-                            zij = dd->apply(zij, q0q1, edge_op_add);
-                        }
-                        z_children[i + j] = zij.v;
-                        z_weights[i + j] = zij.w;
-                    }
-                }
+        explicit edge(node_handle vv)
+            : w(weight_1_handle), v(vv)
+        { }
 
-                // normalize weights
-                weight_handle new_weight = normalize(z_weights);
+        bool operator==(const edge& other) const
+        {
+            return w == other.w && v == other.v;
+        }
 
-                node_handle new_node = dd->make_node(x(e0), z_children, z_weights);
+        bool operator!=(const edge& other) const
+        {
+            return !(operator==(other));
+        }
+    };
 
-                return edge(new_weight, new_node);
-            }
+    enum edge_op
+    {
+        edge_op_add,
+        edge_op_mul,
+        edge_op_kro
+    };
+
+    enum weight_op
+    {
+        weight_op_add,
+        weight_op_sub,
+        weight_op_mul,
+        weight_op_div
+    };
+
+    struct memory_usage
+    {
+        // entries in use and the number of entries that fit
+        size_t entries;
+        size_t capacity;
+
+        // bytes in use and the number of bytes used when full
+        size_t used_bytes;
+        size_t capacity_bytes;
+
+        size_t peak_entries;
+        size_t peak_used_bytes;
+    };
+
+    enum memory_subsystem
+    {
+        memory_node_pool,
+        memory_unique_table,
+        memory_unique_weights,
+        memory_computed_table,
+        memory_computed_weights,
+        memory_subsystem_count
+    };
+
+    static const char* memory_subsystem_name(int subsystem)
+    {
+        static const char* names[memory_subsystem_count] = {
+            "node_pool",
+            "unique_table",
+            "unique_weights",
+            "computed_table",
+            "computed_weights"
+        };
+        return names[subsystem];
+    }
+
+    struct memory_report
+    {
+        memory_usage subsystems[memory_subsystem_count];
+        size_t total_used_bytes;
+        size_t peak_total_used_bytes;
+    };
+
+private:
+    class weight
+    {
+        // rational algorithms from Boost.Rational (see boost/rational.hpp for explanation)
+        class rational
+        {
+            int num;
+            int den;
+
+            static int gcd_euclidean(int a, int b)
+            {
+                return b == 0 ? a : gcd_euclidean(b, a % b);
+            }
+
+            static int gcd(int a, int b)
+            {
+                int result = gcd_euclidean(a, b);
+                return result < 0 ? -result : result;
+            }
+
+        public:
+            rational() = default;
+
+            explicit rational(int n)
+                : num(n), den(1)
+            { }
+
+            // assumes n/d is already in lowest terms with d > 0
+            rational(int n, int d)
+                : num(n), den(d)
+            { }
+
+            int numerator() const
+            {
+                return num;
+            }
+
+            int denominator() const
+            {
+                return den;
+            }
+
+            bool operator==(const rational& other) const
+            {
+                return num == other.num && den == other.den;
+            }
+
+            bool operator!=(const rational& other) const
+            {
+                return !(operator==(other));
+            }
+
+            rational& operator+=(const rational& other)
+            {
+                // Protect against self-modification
+                int r_num = other.num;
+                int r_den = other.den;
+
+                int g = gcd(den, r_den);
+                den /= g;
+                num = num * (r_den / g) + r_num * den;
+                g = gcd(num, g);
+                num /= g;
+                den *= r_den / g;
+                
+                return *this;
+            }
+
+            rational& operator-=(const rational& other)
+            {
+                // Protect against self-modification
+                int r_num = other.num;
+                int r_den = other.den;
+
+                int g = gcd(den, r_den);
+                den /= g;
+                num = num * (r_den / g) - r_num * den;
+                g = gcd(num, g);
+                num /= g;
+                den *= r_den / g;
+
+                return *this;
+            }
+
+            rational& operator*=(const rational& other)
+            {
+                // Protect against self-modification
+                int r_num = other.num;
+                int r_den = other.den;
+
+                int gcd1 = gcd(num, r_den);
+                int gcd2 = gcd(r_num, den);
+                num = (num / gcd1) * (r_num / gcd2);
+                den = (den / gcd2) * (r_den / gcd1);
+
+                return *this;
+            }
+
+            rational& operator/=(const rational& other)
+            {
+                // Protect against self-modification
+                int r_num = other.num;
+                int r_den = other.den;
+
+                assert(r_num != 0);
+
+                if (num == 0)
+                    return *this;
+
+                int gcd1 = gcd(num, r_num);
+                int gcd2 = gcd(r_den, den);
+                num = (num / gcd1) * (r_den / gcd2);
+                den = (den / gcd2) * (r_num / gcd1);
+
+                if (den < 0)
+                {
+                    num = -num;
+                    den = -den;
+                }
+
+                return *this;
+            }
+
+            rational operator+(const rational& other) const
+            {
+                rational tmp(*this);
+                return tmp += other;
+            }
+
+            rational operator-(const rational& other) const
+            {
+                rational tmp(*this);
+                return tmp -= other;
+            }
+
+            rational operator*(const rational& other) const
+            {
+                rational tmp(*this);
+                return tmp *= other;
+            }
+
+            rational operator/(const rational& other) const
+            {
+                rational tmp(*this);
+                return tmp /= other;
+            }
+        };
+
+        class irrational
+        {
+            rational intpart;
+            rational sqrt2part;
+
+        public:
+            irrational() = default;
+
+            explicit irrational(const rational& i)
+                : intpart(i)
+                , sqrt2part(0)
+            { }
+
+            irrational(const rational& i, const rational& sq2)
+                : intpart(i)
+                , sqrt2part(sq2)
+            { }
+
+            rational integer() const
+            {
+                return intpart;
+            }
+
+            rational sqrt2() const
+            {
+                return sqrt2part;
+            }
+
+            bool operator==(const irrational& other) const
+            {
+                return intpart == other.intpart && sqrt2part == other.sqrt2part;
+            }
+
+            irrational& operator+=(const irrational& other)
+            {
+                intpart += other.intpart;
+                sqrt2part += other.sqrt2part;
+
+                return *this;
+            }
+
+            irrational& operator-=(const irrational& other)
+            {
+                intpart -= other.intpart;
+                sqrt2part -= other.sqrt2part;
+
+                return *this;
+            }
+
+            irrational& operator*=(const irrational& other)
+            {
+                // (a + b sqrt(2)) * (c + d sqrt(2))
+                // = ac + ad sqrt(2) + bc sqrt(2) + bd 2
+                // = (ac + 2bd) + (ad + bc) sqrt(2)
+                rational a = intpart, b = sqrt2part, c = other.intpart, d = other.sqrt2part;
+                
+                intpart = a * c + rational(2) * b * d;
+                sqrt2part = a * d + b * c;
+
+                return *this;
+            }
+
+            irrational& operator/=(const irrational& other)
+            {
+                // derived with wolfram alpha lol
+                rational a = intpart, b = sqrt2part, c = other.intpart, d = other.sqrt2part;
+
+                rational denom = (c * c - rational(2) * d * d);
+                intpart = (a * c - rational(2) * b * d) / denom;
+                sqrt2part = (b * c - a * d) / denom;
+
+                return *this;
+            }
+
+            irrational operator+(const irrational& other) const
+            {
+                irrational tmp(*this);
+                return tmp += other;
+            }
+
+            irrational operator-(const irrational& other) const
+            {
+                irrational tmp(*this);
+                return tmp -= other;
+            }
+
+            irrational operator*(const irrational& other) const
+            {
+                irrational tmp(*this);
+                return tmp *= other;
+            }
+
+            irrational operator/(const irrational& other) const
+            {
+                irrational tmp(*this);
+                return tmp /= other;
+            }
+        };
+
+        irrational real;
+        irrational imag;
+
+        // weights that can't be written in the exact form, like the phases of arbitrary rotations, are kept as floating-point numbers instead.
+        // arithmetic with an approximate weight gives an approximate weight.
+        // exact weights keep their floating-point value here too, so comparing them with approximate weights doesn't recompute it.
+        bool exact = true;
+        double approx_real = 0.0;
+        double approx_imag = 0.0;
+
+        static double to_double(const rational& r)
+        {
+            return double(r.numerator()) / r.denominator();
+        }
+
+        static double to_double(const irrational& ir)
+        {
+            return to_double(ir.integer()) + to_double(ir.sqrt2()) * std::sqrt(2.0);
+        }
+
+        // called whenever the exact parts change
+        weight& cache_value()
+        {
+            approx_real = to_double(real);
+            approx_imag = to_double(imag);
+            return *this;
+        }
+
+    public:
+        double real_value() const
+        {
+            return approx_real;
+        }
+
+        double imag_value() const
+        {
+            return approx_imag;
+        }
+
+        // approximate weights closer than this in both parts are the same weight
+        static constexpr double tolerance = 1e-12;
+
+        weight() = default;
+
+        static weight approximate(double real_part, double imag_part)
+        {
+            weight w = zero();
+            w.exact = false;
+            w.approx_real = real_part;
+            w.approx_imag = imag_part;
+            return w;
+        }
+
+        static weight zero()
+        {
+            weight w;
+            w.real = irrational(rational(0));
+            w.imag = irrational(rational(0));
+            return w.cache_value();
+        }
+
+        static weight one()
+        {
+            weight w;
+            w.real = irrational(rational(1));
+            w.imag = irrational(rational(0));
+            return w.cache_value();
+        }
+
+        static weight i()
+        {
+            weight w;
+            w.real = irrational(rational(0));
+            w.imag = irrational(rational(1));
+            return w.cache_value();
+        }
+
+        static weight sq2()
+        {
+            weight w;
+            w.real = irrational(rational(0), rational(1));
+            w.imag = irrational(rational(0));
+            return w.cache_value();
+        }
+
+        // components are (numerator, denominator) pairs for:
+        // real integer part, real sqrt(2) part, imaginary integer part, imaginary sqrt(2) part.
+        // approximate weights have zero denominators, and the bits of the real and imaginary doubles in the numerators.
+        static const int num_components = 8;
+
+        static weight from_components(const int c[num_components])
+        {
+            if (c[1] == 0)
+            {
+                uint32_t bits[4] = { uint32_t(c[0]), uint32_t(c[2]), uint32_t(c[4]), uint32_t(c[6]) };
+                double parts[2];
+                memcpy(parts, bits, sizeof(parts));
+                return approximate(parts[0], parts[1]);
+            }
+
+            weight w;
+            w.real = irrational(rational(c[0], c[1]), rational(c[2], c[3]));
+            w.imag = irrational(rational(c[4], c[5]), rational(c[6], c[7]));
+            return w.cache_value();
+        }
+
+        void to_components(int c[num_components]) const
+        {
+            if (!exact)
+            {
+                double parts[2] = { approx_real, approx_imag };
+                uint32_t bits[4];
+                memcpy(bits, parts, sizeof(bits));
+                for (int i = 0; i < 4; i++)
+                {
+                    c[i * 2 + 0] = int(bits[i]);
+                    c[i * 2 + 1] = 0;
+                }
+                return;
+            }
+
+            const rational parts[] = { real.integer(), real.sqrt2(), imag.integer(), imag.sqrt2() };
+            for (int i = 0; i < 4; i++)
+            {
+                c[i * 2 + 0] = parts[i].numerator();
+                c[i * 2 + 1] = parts[i].denominator();
+            }
+        }
+
+        bool operator==(const weight& other) const
+        {
+            if (exact && other.exact)
+            {
+                return real == other.real && imag == other.imag;
+            }
+
+            return std::abs(real_value() - other.real_value()) <= tolerance &&
+                std::abs(imag_value() - other.imag_value()) <= tolerance;
+        }
+
+        bool operator!=(const weight& other) const
+        {
+            return !(operator==(other));
+        }
+
+        weight& operator+=(const weight& other)
+        {
+            if (!exact || !other.exact)
+            {
+                return *this = approximate(real_value() + other.real_value(), imag_value() + other.imag_value());
+            }
+
+            // (a + bi) + (c + di)
+            // = (a + c) + (b + d)i
+            irrational a = real, b = imag, c = other.real, d = other.imag;
+
+            real = a + c;
+            imag = b + d;
+
+            return cache_value();
+        }
+
+        weight operator+(const weight& other) const
+        {
+            weight tmp(*this);
+            return tmp += other;
+        }
+
+        weight& operator-=(const weight& other)
+        {
+            if (!exact || !other.exact)
+            {
+                return *this = approximate(real_value() - other.real_value(), imag_value() - other.imag_value());
+            }
+
+            // (a + bi) - (c + di)
+            // = (a - c) + (b - d)i
+            irrational a = real, b = imag, c = other.real, d = other.imag;
+
+            real = a - c;
+            imag = b - d;
+
+            return cache_value();
+        }
+
+        weight operator-(const weight& other) const
+        {
+            weight tmp(*this);
+            return tmp -= other;
+        }
+
+        weight& operator*=(const weight& other)
+        {
+            if (!exact || !other.exact)
+            {
+                double a = real_value(), b = imag_value(), c = other.real_value(), d = other.imag_value();
+                return *this = approximate(a * c - b * d, a * d + b * c);
+            }
+
+            // (a + bi) * (c + di)
+            // = ac + adi + bci - bd
+            // = (ac - bd) + (ad + bc)i
+            irrational a = real, b = imag, c = other.real, d = other.imag;
+            
+            real = a * c - b * d;
+            imag = a * d + b * c;
+
+            return cache_value();
+        }
+
+        weight operator*(const weight& other) const
+        {
+            weight tmp(*this);
+            return tmp *= other;
+        }
+
+        weight& operator/=(const weight& other)
+        {
+            if (!exact || !other.exact)
+            {
+                double a = real_value(), b = imag_value(), c = other.real_value(), d = other.imag_value();
+                double denom = c * c + d * d;
+                return *this = approximate((a * c + b * d) / denom, (b * c - a * d) / denom);
+            }
+
+            // proof: http://mathworld.wolfram.com/ComplexDivision.html
+            irrational a = real, b = imag, c = other.real, d = other.imag;
+
+            irrational denom = c * c + d * d;
+            real = (a * c + b * d) / denom;
+            imag = (b * c - a * d) / denom;
+
+            return cache_value();
+        }
+
+        weight operator/(const weight& other) const
+        {
+            weight tmp(*this);
+            return tmp /= other;
+        }
+
+        std::string to_string() const
+        {
+            if (!exact)
+            {
+                // 6 significant digits, dropping parts that round to 0
+                char buf[64];
+                bool has_real = std::abs(approx_real) > tolerance;
+                bool has_imag = std::abs(approx_imag) > tolerance;
+                if (has_real && has_imag)
+                    snprintf(buf, sizeof(buf), "%.6g%+.6gi", approx_real, approx_imag);
+                else if (has_imag)
+                    snprintf(buf, sizeof(buf), "%.6gi", approx_imag);
+                else
+                    snprintf(buf, sizeof(buf), "%.6g", has_real ? approx_real : 0.0);
+                return buf;
+            }
+
+            static const auto rational_to_string = [](const rational& r, char mode)
+            {
+                std::string s;
+
+                if (mode == 'r')
+                {
+                    s += std::to_string(r.numerator());
+                }
+                
+                if (mode == 'i')
+                {
+                    if (r.numerator() == 1)
+                    {
+                        s += "i";
+                    }
+                    else if (r.numerator() == -1)
+                    {
+                        s += "-i";
+                    }
+                    else
+                    {
+                        s += std::to_string(r.numerator()) + "i";
+                    }
+                }
+
+                if (r.denominator() != 1)
+                {
+                    s += "/" + std::to_string(r.denominator());
+                }
+
+                return s;
+            };
+
+            static const auto irrational_to_string = [](const irrational& ir, char mode)
+            {
+                std::string s;
+
+                bool wrote_intpart = false;
+                if (ir.integer() != rational(0))
+                {
+                    s += rational_to_string(ir.integer(), mode);
+
+                    wrote_intpart = true;
+                }
+                
+                bool wrote_sqrt2part = false;
+                if (ir.sqrt2() != rational(0))
+                {
+                    if (wrote_intpart && ir.sqrt2().numerator() > 0)
+                    {
+                        s += "+";
+                    }
+
+                    if (ir.sqrt2().denominator() != 1)
+                        s += "(";
+
+                    s += rational_to_string(ir.sqrt2(), mode);
+
+                    if (ir.sqrt2().denominator() != 1)
+                        s += ")";
+
+                    // utf8 sqrt symbol
+                    s += "\xe2\x88\x9a";
+
+                    s += "2";
+
+                    wrote_sqrt2part = true;
+                }
+
+                if (!wrote_intpart && !wrote_sqrt2part)
+                {
+                    s += "0";
+                }
+
+                return s;
+            };
+
+            static const auto complex_to_string = [](const irrational& real, const irrational& imag)
+            {
+                std::string s;
+
+                int num_real_terms = int(real.integer() != rational(0)) + int(real.sqrt2() != rational(0));
+                if (num_real_terms > 0)
+                {
+                    if (num_real_terms > 1)
+                        s += "(";
+
+                    s += irrational_to_string(real, 'r');
+
+                    if (num_real_terms > 1)
+                        s += ")";
+                }
+
+                int num_imag_terms = int(imag.integer() != rational(0)) + int(imag.sqrt2() != rational(0));
+                if (num_imag_terms > 0)
+                {
+                    if (num_real_terms > 0)
+                        s += "+";
+
+                    if (num_imag_terms > 1)
+                        s += "(";
+
+                    s += irrational_to_string(imag, 'i');
+
+                    if (num_imag_terms > 1)
+                        s += ")";
+                }
+
+                if (num_real_terms == 0 && num_imag_terms == 0)
+                {
+                    s += "0";
+                }
+
+                return s;
+            };
+
+            std::string s = complex_to_string(real, imag);
+
+            return s;
+        }
+    };
+
+    class unique_table
+    {
+        struct node
+        {
+            uint32_t var;
+            std::array<node_handle,p*p> children;
+            std::array<weight_handle, p*p> weights;
+
+            bool operator==(const node& other) const
+            {
+                return std::tie(var, children, weights) == std::tie(other.var, other.children, other.weights);
+            }
+        };
+
+        // nodes are placed in per-level chunks when the pool is memory-mapped,
+        // so that each level's nodes share pages and can be pinned or paged out together.
+        static const uint32_t chunk_size = 0x1000;
+
+        uint32_t capacity;
+        uint32_t ddutmask;
+
+        node* node_pool;
+        std::unique_ptr<node[]> node_pool_memory;
+
+        uint32_t pool_head;
+        uint32_t num_allocated;
+
+        // zero means no budget beyond the pool capacity
+        uint32_t max_nodes;
+
+        // only used when the pool is memory-mapped
+        mapped_file backing_store;
+        size_t pool_file_offset;
+        int pinned_levels;
+        std::vector<uint32_t> level_next;
+        std::vector<uint32_t> level_end;
+        std::vector<uint32_t> chunk_level;
+        std::vector<bool> chunk_pinned;
+
+        // only used when the pool is in shared memory. the index and the pool are split into shards,
+        // and a node goes into the shard its hash picks, so processes mostly insert into different places.
+        std::atomic<uint32_t>* shard_heads = nullptr;
+        std::atomic<uint32_t>* shared_num_nodes = nullptr;
+        uint32_t shard_size = 0;
+        int shard_bits = 0;
+
+        node* shared_alloc(uint32_t shard)
+        {
+            if (max_nodes != 0 && shared_num_nodes->load(std::memory_order_relaxed) >= max_nodes)
+            {
+                throw budget_exceeded("node budget of " + std::to_string(max_nodes) + " nodes exceeded");
+            }
+
+            uint32_t index = shard_heads[shard].fetch_add(1, std::memory_order_relaxed);
+            if (index >= shard_size)
+            {
+                throw budget_exceeded("node pool shard is full (" + std::to_string(shard_size) + " nodes)");
+            }
+
+            shared_num_nodes->fetch_add(1, std::memory_order_relaxed);
+            return &node_pool[shard * shard_size + index];
+        }
+
+        // the index slots are claimed with compare-and-swap, and never change once set,
+        // so a node is published with all its fields, and two processes can't insert the same node twice.
+        node_handle insert_shared(const node& n, uint32_t key)
+        {
+            std::atomic<uint32_t>* slots = (std::atomic<uint32_t>*)table;
+
+            uint32_t shard = shard_bits == 0 ? 0 : (key * 0x9e3779b1u) >> (32 - shard_bits);
+            uint32_t first_slot = shard * shard_size;
+            uint32_t offset = key & (shard_size - 1);
+
+            node* new_node = nullptr;
+            for (uint32_t probes = 0; probes < shard_size; probes++)
+            {
+                uint32_t h = slots[first_slot + offset].load(std::memory_order_acquire);
+                if (h == invalid_node.value)
+                {
+                    if (!new_node)
+                    {
+                        new_node = shared_alloc(shard);
+                        *new_node = n;
+                    }
+
+                    if (slots[first_slot + offset].compare_exchange_strong(h, to_handle(new_node).value, std::memory_order_acq_rel, std::memory_order_acquire))
+                    {
+                        return to_handle(new_node);
+                    }
+                }
+
+                // the slot was taken, maybe by another process with the same node. a node allocated for a lost race stays unused.
+                if (*to_node(node_handle{ h }) == n)
+                {
+                    return node_handle{ h };
+                }
+
+                offset = (offset + 1) & (shard_size - 1);
+            }
+
+            throw budget_exceeded("node index shard is full (" + std::to_string(shard_size) + " nodes)");
+        }
+
+        uint32_t alloc_slot(uint32_t var)
+        {
+            if (!backing_store.data())
+            {
+                if (pool_head >= capacity)
+                {
+                    throw budget_exceeded("node pool is full (" + std::to_string(capacity) + " nodes)");
+                }
+
+                return pool_head++;
+            }
+
+            if (level_next[var] == level_end[var])
+            {
+                if (capacity - pool_head < chunk_size)
+                {
+                    throw budget_exceeded("node pool is full (" + std::to_string(capacity) + " nodes)");
+                }
+
+                uint32_t chunk = pool_head / chunk_size;
+                level_next[var] = pool_head;
+                level_end[var] = pool_head + chunk_size;
+                pool_head += chunk_size;
+
+                chunk_level.push_back(var);
+                chunk_pinned.push_back((int)var < pinned_levels &&
+                    backing_store.lock(pool_file_offset + size_t(chunk) * chunk_size * sizeof(node), chunk_size * sizeof(node)));
+            }
+
+            return level_next[var]++;
+        }
+
+        node* pool_alloc(uint32_t var)
+        {
+            if (max_nodes != 0 && num_allocated >= max_nodes)
+            {
+                throw budget_exceeded("node budget of " + std::to_string(max_nodes) + " nodes exceeded");
+            }
+
+            uint32_t slot = alloc_slot(var);
+            num_allocated += 1;
+
+            return &node_pool[slot];
+        }
+
+        node_handle* table;
+        std::unique_ptr<node_handle[]> table_memory;
+
+        node* true_node;
+
+        node_handle to_handle(const node* n) const
+        {
+            return node_handle{ uint32_t(n - &node_pool[0]) };
+        }
+
+        const node* to_node(node_handle h) const
+        {
+            return (const node*)&node_pool[h.value];
+        }
+
+    public:
+        static_assert(std::is_trivially_copyable<node>::value, "nodes are copied in and out of shared memory");
+        static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared memory needs lock-free atomics");
+
+        static uint32_t node_bytes()
+        {
+            return sizeof(node);
+        }
+
+        static uint32_t shared_shard_count(uint32_t node_capacity)
+        {
+            uint32_t num_shards = 1;
+            while (num_shards < 64 && node_capacity / (num_shards * 2) >= 0x10000)
+            {
+                num_shards *= 2;
+            }
+            return num_shards;
+        }
+
+        // bytes of shared memory for the shard heads, the index and the pool
+        static size_t shared_bytes(uint32_t node_capacity, uint32_t num_shards)
+        {
+            return (num_shards + 1) * sizeof(uint32_t) + size_t(node_capacity) * (sizeof(node_handle) + sizeof(node));
+        }
+
+        // uses memory, shared_bytes() long, for the index and the pool. the process that created the memory initializes it.
+        void init_shared(uint32_t num_vars, uint32_t node_capacity, uint32_t num_shards, void* memory, bool created)
+        {
+            assert(node_capacity != 0 && (node_capacity & (node_capacity - 1)) == 0);
+            assert(node_capacity % num_shards == 0);
+
+            capacity = node_capacity;
+            ddutmask = capacity - 1;
+            pool_head = 0;
+            num_allocated = 0;
+            max_nodes = 0;
+
+            shard_size = capacity / num_shards;
+            shard_bits = 0;
+            while ((1u << shard_bits) < num_shards)
+            {
+                shard_bits += 1;
+            }
+
+            shard_heads = (std::atomic<uint32_t>*)memory;
+            shared_num_nodes = shard_heads + num_shards;
+            table = (node_handle*)(shared_num_nodes + 1);
+            node_pool = (node*)(table + capacity);
+
+            // the terminal is the first node of the first shard, and isn't in the index
+            true_node = &node_pool[0];
+            if (created)
+            {
+                memset(table, 0xff, size_t(capacity) * sizeof(node_handle));
+
+                true_node->var = num_vars;
+                for (int i = 0; i < p*p; i++)
+                {
+                    true_node->children[i] = to_handle(true_node);
+                    true_node->weights[i] = weight_1_handle;
+                }
+                shard_heads[0].store(1, std::memory_order_relaxed);
+                shared_num_nodes->store(1, std::memory_order_relaxed);
+            }
+        }
+
+        // capacity must be a power of two.
+        // if backing_file is not null, the node pool and the unique index are stored in that file,
+        // and the chunks of the first pinned_levels levels are locked in memory.
+        void init(uint32_t num_vars, uint32_t node_capacity, const char* backing_file, int num_pinned_levels)
+        {
+            assert(node_capacity != 0 && (node_capacity & (node_capacity - 1)) == 0);
+
+            capacity = node_capacity;
+            ddutmask = capacity - 1;
+
+            pool_head = 0;
+            num_allocated = 0;
+            max_nodes = 0;
+
+            if (backing_file)
+            {
+                if (capacity < chunk_size * 2)
+                {
+                    throw std::runtime_error("memory-mapped node pool needs a capacity of at least " + std::to_string(chunk_size * 2) + " nodes");
+                }
+
+                size_t page = mapped_file::page_size();
+                size_t table_bytes = size_t(capacity) * sizeof(node_handle);
+                pool_file_offset = (table_bytes + page - 1) / page * page;
+
+                backing_store.open(backing_file, pool_file_offset + size_t(capacity) * sizeof(node));
+
+                table = (node_handle*)backing_store.data();
+                node_pool = (node*)((char*)backing_store.data() + pool_file_offset);
+
+                pinned_levels = num_pinned_levels;
+                level_next.assign(num_vars + 1, 0);
+                level_end.assign(num_vars + 1, 0);
+                chunk_level.clear();
+                chunk_pinned.clear();
+            }
+            else
+            {
+                node_pool_memory.reset(new node[capacity]);
+                node_pool = node_pool_memory.get();
+
+                table_memory.reset(new node_handle[capacity]);
+                table = table_memory.get();
+            }
+
+            for (uint32_t i = 0; i < capacity; i++)
+            {
+                table[i] = invalid_node;
+            }
+
+            true_node = pool_alloc(num_vars);
+            true_node->var = num_vars;
+            for (int i = 0; i < p*p; i++)
+            {
+                true_node->children[i] = to_handle(true_node);
+                true_node->weights[i] = weight_1_handle;
+            }
+        }
+
+        struct level_residency
+        {
+            uint32_t var;
+            uint32_t num_nodes;
+            size_t mapped_bytes;
+            size_t resident_bytes;
+            bool pinned;
+        };
+
+        // per-level memory residency of a memory-mapped node pool, with one entry per level that has nodes.
+        std::vector<level_residency> get_level_residency() const
+        {
+            std::vector<level_residency> levels;
+
+            if (!backing_store.data())
+            {
+                return levels;
+            }
+
+            for (uint32_t var = 0; var < level_next.size(); var++)
+            {
+                levels.push_back(level_residency{ var, 0, 0, 0, (int)var < pinned_levels });
+            }
+
+            size_t chunk_bytes = chunk_size * sizeof(node);
+            for (size_t chunk = 0; chunk < chunk_level.size(); chunk++)
+            {
+                level_residency& level = levels[chunk_level[chunk]];
+                level.mapped_bytes += chunk_bytes;
+                level.resident_bytes += backing_store.resident_bytes(pool_file_offset + chunk * chunk_bytes, chunk_bytes);
+                level.pinned = level.pinned && chunk_pinned[chunk];
+            }
+
+            for (uint32_t var = 0; var < level_next.size(); var++)
+            {
+                // nodes in all full chunks plus the used part of the current chunk
+                uint32_t num_chunks = uint32_t(levels[var].mapped_bytes / chunk_bytes);
+                if (num_chunks != 0)
+                {
+                    levels[var].num_nodes = (num_chunks - 1) * chunk_size + (chunk_size - (level_end[var] - level_next[var]));
+                }
+            }
+
+            levels.erase(std::remove_if(begin(levels), end(levels), [](const level_residency& level) { return level.mapped_bytes == 0; }), end(levels));
+
+            return levels;
+        }
+
+        node_handle get_true() const
+        {
+            return to_handle(true_node);
+        }
+
+        void set_max_nodes(uint32_t max)
+        {
+            max_nodes = max;
+        }
+
+        // in shared memory, the nodes of all processes
+        uint32_t num_nodes() const
+        {
+            return shared_num_nodes ? shared_num_nodes->load(std::memory_order_relaxed) : num_allocated;
+        }
+
+        uint32_t node_capacity() const
+        {
+            return capacity;
+        }
+
+        memory_usage pool_memory() const
+        {
+            memory_usage m = {};
+            m.entries = num_nodes();
+            m.capacity = capacity;
+            m.used_bytes = size_t(shared_num_nodes ? num_nodes() : pool_head) * sizeof(node);
+            m.capacity_bytes = size_t(capacity) * sizeof(node);
+            return m;
+        }
+
+        memory_usage index_memory() const
+        {
+            // the index is allocated and initialized up front
+            memory_usage m = {};
+            m.entries = num_nodes();
+            m.capacity = capacity;
+            m.used_bytes = size_t(capacity) * sizeof(node_handle);
+            m.capacity_bytes = size_t(capacity) * sizeof(node_handle);
+            return m;
+        }
+
+        int get_var(node_handle h) const
+        {
+            return to_node(h)->var;
+        }
+
+        void get_children(node_handle h, node_handle children[p*p]) const
+        {
+            const node* n = to_node(h);
+            for (int i = 0; i < p*p; i++)
+            {
+                children[i] = n->children[i];
+            }
+        }
+
+        node_handle get_child(node_handle h, int i) const
+        {
+            return to_node(h)->children[i];
+        }
+
+        void get_weights(node_handle h, weight_handle weights[p*p]) const
+        {
+            const node* n = to_node(h);
+            for (int i = 0; i < p*p; i++)
+            {
+                weights[i] = n->weights[i];
+            }
+        }
+
+        weight_handle get_weight(node_handle h, int i) const
+        {
+            return to_node(h)->weights[i];
+        }
+
+        node_handle insert(uint32_t var, const node_handle children[p*p], const weight_handle weights[p*p])
+        {
+            node n;
+            n.var = var;
+            for (int i = 0; i < p*p; i++)
+            {
+                n.children[i] = children[i];
+                n.weights[i] = weights[i];
+            }
+
+            uint32_t key = var;
+            for (int i = 0; i < p*p; i++)
+            {
+                key += children[i].value + weights[i].value;
+            }
+
+            if (shard_heads)
+            {
+                return insert_shared(n, key);
+            }
+
+            key = key & ddutmask;
+
+            while (table[key] != invalid_node)
+            {
+                const node* curr = to_node(table[key]);
+                if (*curr == n)
+                {
+                    return to_handle(curr);
+                }
+                key = (key + 1) & ddutmask;
+            }
+
+            node* new_node = pool_alloc(var);
+            *new_node = n;
+
+            node_handle handle = to_handle(new_node);
+            table[key] = handle;
+            return handle;
+        }
+    };
+
+    class computed_table
+    {
+        struct cache_entry
+        {
+            edge e0;
+            edge e1;
+            edge_op op;
+            edge result;
+        };
+
+        static const uint32_t ctsize = 1024;
+        static_assert((ctsize & (ctsize - 1)) == 0, "ctsize must be a power of two");
+
+        static const uint32_t ctmask = ctsize - 1;
+
+        std::vector<cache_entry> cache;
+
+        static uint32_t hash(const edge& e0, const edge& e1, edge_op op)
+        {
+            return (e0.v.value + e1.v.value + e0.w.value + e1.w.value + op) & ctmask;
+        }
+
+    public:
+        computed_table()
+            : cache(ctsize, cache_entry{ edge(), edge(), (edge_op)0, edge() })
+        { }
+
+        edge find(const edge& e0, const edge& e1, edge_op op) const
+        {
+            uint32_t key = hash(e0, e1, op);
+
+            const cache_entry& entry = cache[key];
+            if (entry.e0 == e0 && entry.e1 == e1 && entry.op == op)
+                return entry.result;
+            else
+                return edge(invalid_weight, invalid_node);
+        }
+
+        void insert(const edge& e0, const edge& e1, edge_op op, const edge& r)
+        {
+            uint32_t key = hash(e0, e1, op);
+            cache[key] = cache_entry{ e0, e1, op, r };
+        }
+
+        memory_usage memory() const
+        {
+            memory_usage m = {};
+            for (const cache_entry& entry : cache)
+            {
+                m.entries += entry.e0.v != invalid_node;
+            }
+            m.capacity = cache.size();
+            m.used_bytes = cache.size() * sizeof(cache_entry);
+            m.capacity_bytes = cache.size() * sizeof(cache_entry);
+            return m;
+        }
+    };
+
+    class unique_weights
+    {
+        std::vector<weight> weights;
+
+        // the indices of the weights, by the bucket of their value. see bucket_key().
+        std::unordered_multimap<uint64_t, uint32_t> buckets;
+
+        // zero means unlimited
+        uint32_t max_weights;
+
+        // only used when the weights are in shared memory.
+        // the index is open-addressed by bucket key, and its slots hold a weight's index plus one, or zero if they're empty.
+        // slots are only written under the lock, after their weight, so a weight found through the index is complete.
+        weight* shared_weights = nullptr;
+        std::atomic<uint32_t>* shared_index = nullptr;
+        std::atomic<uint32_t>* shared_num_weights = nullptr;
+        std::atomic<uint32_t>* shared_lock = nullptr;
+        uint32_t shared_capacity = 0;
+        uint32_t shared_index_size = 0;
+
+        static const uint32_t not_found = UINT32_MAX;
+
+        // buckets are much wider than the tolerance, so the weights near a value are usually in its own bucket alone.
+        static constexpr double bucket_width = 1024 * weight::tolerance;
+
+        // a value's bucket along one axis. values too large for a bucket, and NaN, are in the outermost buckets.
+        static int64_t bucket_coordinate(double x)
+        {
+            const double limit = 4611686018427387904.0; // 2^62
+            double k = std::floor(x / bucket_width);
+            if (!(k > -limit))
+                return -int64_t(limit);
+            if (k > limit)
+                return int64_t(limit);
+            return int64_t(k);
+        }
+
+        static uint64_t bucket_key(int64_t real_coordinate, int64_t imag_coordinate)
+        {
+            return uint64_t(real_coordinate) * 0x9e3779b97f4a7c15ull ^ uint64_t(imag_coordinate);
+        }
+
+        static uint64_t bucket_key(const weight& w)
+        {
+            return bucket_key(bucket_coordinate(w.real_value()), bucket_coordinate(w.imag_value()));
+        }
+
+        // calls visit with the bucket keys of every bucket that can hold a weight within the tolerance of w.
+        // the margin is twice the tolerance, so rounding in x +- margin can't miss a bucket.
+        template<class Visitor>
+        static void for_each_neighbour_bucket(const weight& w, Visitor visit)
+        {
+            const double margin = 2 * weight::tolerance;
+            double re = w.real_value(), im = w.imag_value();
+            int64_t first_real = bucket_coordinate(re - margin), last_real = bucket_coordinate(re + margin);
+            int64_t first_imag = bucket_coordinate(im - margin), last_imag = bucket_coordinate(im + margin);
+            for (int64_t r = first_real; r <= last_real; r++)
+            {
+                for (int64_t i = first_imag; i <= last_imag; i++)
+                {
+                    visit(bucket_key(r, i));
+                }
+            }
+        }
+
+        // the first weight equal to w, like a scan of all the weights would find
+        uint32_t find(const weight& w) const
+        {
+            uint32_t found = not_found;
+            for_each_neighbour_bucket(w, [&](uint64_t key)
+            {
+                auto range = buckets.equal_range(key);
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    if (it->second < found && weights[it->second] == w)
+                    {
+                        found = it->second;
+                    }
+                }
+            });
+            return found;
+        }
+
+        uint32_t first_index_slot(uint64_t key) const
+        {
+            return uint32_t((key ^ (key >> 32)) * 0x9e3779b1u) & (shared_index_size - 1);
+        }
+
+        uint32_t find_shared(const weight& w) const
+        {
+            uint32_t found = not_found;
+            for_each_neighbour_bucket(w, [&](uint64_t key)
+            {
+                for (uint32_t slot = first_index_slot(key); ; slot = (slot + 1) & (shared_index_size - 1))
+                {
+                    uint32_t h = shared_index[slot].load(std::memory_order_acquire);
+                    if (h == 0)
+                    {
+                        break;
+                    }
+
+                    if (h - 1 < found && shared_weights[h - 1] == w)
+                    {
+                        found = h - 1;
+                    }
+                }
+            });
+            return found;
+        }
+
+        // weights are looked up without the lock, and only added under it,
+        // so two processes can't add the same weight twice.
+        weight_handle insert_shared(const weight& w)
+        {
+            uint32_t found = find_shared(w);
+            if (found != not_found)
+            {
+                return weight_handle{ found };
+            }
+
+            while (shared_lock->exchange(1, std::memory_order_acquire) != 0)
+            {
+                std::this_thread::yield();
+            }
+
+            // another process may have added it since
+            found = find_shared(w);
+            uint32_t count = shared_num_weights->load(std::memory_order_relaxed);
+            bool full = count >= shared_capacity || (max_weights != 0 && count >= max_weights);
+            if (found == not_found && !full)
+            {
+                shared_weights[count] = w;
+                shared_num_weights->store(count + 1, std::memory_order_release);
+
+                uint32_t slot = first_index_slot(bucket_key(w));
+                while (shared_index[slot].load(std::memory_order_relaxed) != 0)
+                {
+                    slot = (slot + 1) & (shared_index_size - 1);
+                }
+                shared_index[slot].store(count + 1, std::memory_order_release);
+
+                found = count;
+            }
+
+            shared_lock->store(0, std::memory_order_release);
+
+            if (found == not_found)
+            {
+                throw budget_exceeded(count >= shared_capacity ?
+                    "shared weight table is full (" + std::to_string(shared_capacity) + " weights)" :
+                    "weight budget of " + std::to_string(max_weights) + " weights exceeded");
+            }
+
+            return weight_handle{ found };
+        }
+
+        // at most half full, so probes stay short
+        static uint32_t shared_index_slots(uint32_t capacity)
+        {
+            uint32_t size = 1;
+            while (size < 2 * capacity)
+            {
+                size *= 2;
+            }
+            return size;
+        }
+
+    public:
+        static_assert(std::is_trivially_copyable<weight>::value, "weights are copied in and out of shared memory");
+
+        unique_weights()
+            : max_weights(0)
+        {
+            insert(weight::zero());
+            insert(weight::one());
+        }
+
+        // bytes of shared memory for capacity weights
+        static size_t shared_bytes(uint32_t capacity)
+        {
+            return size_t(capacity) * sizeof(weight) + size_t(shared_index_slots(capacity)) * sizeof(uint32_t) + 2 * sizeof(uint32_t);
+        }
+
+        // uses memory, shared_bytes() long, for the weights. the process that created the memory adds zero and one.
+        void init_shared(uint32_t capacity, void* memory, bool created)
+        {
+            shared_weights = (weight*)memory;
+            shared_capacity = capacity;
+            shared_index_size = shared_index_slots(capacity);
+            shared_index = (std::atomic<uint32_t>*)(shared_weights + capacity);
+            shared_num_weights = shared_index + shared_index_size;
+            shared_lock = shared_num_weights + 1;
+
+            if (created)
+            {
+                insert_shared(weight::zero());
+                insert_shared(weight::one());
+            }
+        }
+
+        weight_handle insert(const weight& w)
+        {
+            if (shared_weights)
+            {
+                return insert_shared(w);
+            }
+
+            uint32_t found = find(w);
+            if (found != not_found)
+            {
+                return weight_handle{ found };
+            }
+
+            if (max_weights != 0 && weights.size() >= max_weights)
+            {
+                throw budget_exceeded("weight budget of " + std::to_string(max_weights) + " weights exceeded");
+            }
+
+            weights.push_back(w);
+            buckets.emplace(bucket_key(w), uint32_t(weights.size() - 1));
+            return weight_handle{ uint32_t(weights.size() - 1) };
+        }
+
+        weight get_weight(weight_handle w) const
+        {
+            return shared_weights ? shared_weights[w.value] : weights[w.value];
+        }
+
+        void set_max_weights(uint32_t max)
+        {
+            max_weights = max;
+        }
+
+        // in shared memory, the weights of all processes
+        uint32_t num_weights() const
+        {
+            return shared_weights ? shared_num_weights->load(std::memory_order_relaxed) : uint32_t(weights.size());
+        }
+
+        memory_usage memory() const
+        {
+            if (shared_weights)
+            {
+                memory_usage m = {};
+                m.entries = num_weights();
+                m.capacity = shared_capacity;
+                m.used_bytes = m.entries * sizeof(weight) + size_t(shared_index_size) * sizeof(uint32_t);
+                m.capacity_bytes = size_t(shared_capacity) * sizeof(weight) + size_t(shared_index_size) * sizeof(uint32_t);
+                return m;
+            }
+
+            // each bucket entry is a node of the key, the index and a next pointer, plus a pointer per bucket
+            size_t bucket_bytes = buckets.size() * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(void*)) + buckets.bucket_count() * sizeof(void*);
+
+            memory_usage m = {};
+            m.entries = weights.size();
+            m.capacity = weights.capacity();
+            m.used_bytes = weights.capacity() * sizeof(weight) + bucket_bytes;
+            m.capacity_bytes = weights.capacity() * sizeof(weight) + bucket_bytes;
+            return m;
+        }
+    };
+
+    class computed_weights
+    {
+        struct cache_entry
+        {
+            weight_handle w0;
+            weight_handle w1;
+            weight_op op;
+            weight_handle result;
+        };
+
+        static const uint32_t ctsize = 1024;
+        static_assert((ctsize & (ctsize - 1)) == 0, "ctsize must be a power of two");
+
+        static const uint32_t ctmask = ctsize - 1;
+
+        std::vector<cache_entry> cache;
+
+        static uint32_t hash(weight_handle w0, weight_handle w1, weight_op op)
+        {
+            return (w0.value + w1.value + op) & ctmask;
+        }
+
+    public:
+        computed_weights()
+            : cache(ctsize, cache_entry{ invalid_weight, invalid_weight, (weight_op)0, invalid_weight })
+        { }
+
+        weight_handle find(weight_handle w0, weight_handle w1, weight_op op) const
+        {
+            uint32_t key = hash(w0, w1, op);
+
+            const cache_entry& entry = cache[key];
+            if (entry.w0 == w0 && entry.w1 == w1 && entry.op == op)
+                return entry.result;
+            else
+                return invalid_weight;
+        }
+
+        void insert(weight_handle w0, weight_handle w1, weight_op op, weight_handle r)
+        {
+            uint32_t key = hash(w0, w1, op);
+            cache[key] = cache_entry{ w0, w1, op, r };
+        }
+
+        memory_usage memory() const
+        {
+            memory_usage m = {};
+            for (const cache_entry& entry : cache)
+            {
+                m.entries += entry.w0 != invalid_weight;
+            }
+            m.capacity = cache.size();
+            m.used_bytes = cache.size() * sizeof(cache_entry);
+            m.capacity_bytes = cache.size() * sizeof(cache_entry);
+            return m;
+        }
+    };
+
+    unique_table uniquetb;
+    computed_table computedtb;
+
+    unique_weights uniquewt;
+    computed_weights computedwt;
+
+    node_handle true_node;
+
+    memory_report memory_peaks = {};
+
+    // the start of a shared memory segment, followed by the weights, then the node shards, index and pool.
+    // the process that creates the segment fills in the header last, by setting ready.
+    struct shared_header
+    {
+        uint32_t magic;
+        uint32_t num_vars;
+        uint32_t node_capacity;
+        uint32_t weight_capacity;
+        uint32_t num_shards;
+
+        // builds with a different node or weight layout can't share a segment
+        uint32_t node_bytes;
+        uint32_t weight_bytes;
+
+        std::atomic<uint32_t> ready;
+    };
+
+    static const uint32_t shared_magic = 0x444d4d51;
+    static const uint32_t shared_weight_capacity = 0x100000;
+
+    mapped_file shared_memory;
+
+    void init_shared(uint32_t num_vars, uint32_t node_capacity, const std::string& name)
+    {
+        uint32_t num_shards = unique_table::shared_shard_count(node_capacity);
+
+        size_t weights_offset = (sizeof(shared_header) + 63) / 64 * 64;
+        size_t nodes_offset = (weights_offset + unique_weights::shared_bytes(shared_weight_capacity) + 63) / 64 * 64;
+        size_t size = nodes_offset + unique_table::shared_bytes(node_capacity, num_shards);
+
+        bool created = shared_memory.open_shared(name.c_str(), size);
+        char* base = (char*)shared_memory.data();
+        shared_header* header = (shared_header*)base;
+
+        if (!created)
+        {
+            for (int attempt = 0; header->ready.load(std::memory_order_acquire) == 0; attempt++)
+            {
+                if (attempt == 10000)
+                {
+                    throw std::runtime_error("shared memory " + name + " was never initialized");
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            if (header->magic != shared_magic || header->num_vars != num_vars || header->node_capacity != node_capacity ||
+                header->weight_capacity != shared_weight_capacity || header->num_shards != num_shards ||
+                header->node_bytes != unique_table::node_bytes() || header->weight_bytes != sizeof(weight))
+            {
+                throw std::runtime_error("shared memory " + name + " holds a diagram with a different number of variables or node capacity");
+            }
+        }
+
+        uniquewt.init_shared(shared_weight_capacity, base + weights_offset, created);
+        uniquetb.init_shared(num_vars, node_capacity, num_shards, base + nodes_offset, created);
+
+        if (created)
+        {
+            header->magic = shared_magic;
+            header->num_vars = num_vars;
+            header->node_capacity = node_capacity;
+            header->weight_capacity = shared_weight_capacity;
+            header->num_shards = num_shards;
+            header->node_bytes = unique_table::node_bytes();
+            header->weight_bytes = sizeof(weight);
+            header->ready.store(1, std::memory_order_release);
+        }
+    }
+
+public:
+    struct storage_options
+    {
+        // maximum number of nodes. must be a power of two.
+        uint32_t node_capacity = 0x100000;
+
+        // if set, the node pool and unique index live in this memory-mapped file instead of RAM,
+        // which lets the operating system page out the parts of the diagram that aren't in use.
+        std::string backing_file;
+
+        // levels [0, pinned_levels) are locked in memory when using a backing file.
+        // the top levels are visited by every operation, so they are the hottest.
+        int pinned_levels = 0;
+
+        // if set, the node pool, unique index and weights live in the shared memory segment of this name.
+        // processes on one host that use the same segment and number of variables build one diagram together,
+        // and the same node or weight has the same handle in all of them.
+        std::string shared_memory;
+    };
+
+    using level_residency = unique_table::level_residency;
+
+    explicit qmdd(uint32_t num_vars)
+        : qmdd(num_vars, storage_options())
+    { }
+
+    qmdd(uint32_t num_vars, const storage_options& storage)
+    {
+        if (!storage.shared_memory.empty())
+        {
+            if (!storage.backing_file.empty())
+            {
+                throw std::logic_error("the node pool can't be both in a file and in shared memory");
+            }
+            init_shared(num_vars, storage.node_capacity, storage.shared_memory);
+        }
+        else
+        {
+            uniquetb.init(num_vars, storage.node_capacity, storage.backing_file.empty() ? nullptr : storage.backing_file.c_str(), storage.pinned_levels);
+        }
+
+        true_node = uniquetb.get_true();
+    }
+
+    // empty unless the node pool is memory-mapped
+    std::vector<level_residency> get_level_residency() const
+    {
+        return uniquetb.get_level_residency();
+    }
+
+    node_handle get_true() const
+    {
+        return true_node;
+    }
+
+    // limits the number of nodes and weights that can be allocated.
+    // allocations beyond the budget throw budget_exceeded. zero means unlimited.
+    void set_budget(uint32_t max_nodes, uint32_t max_weights)
+    {
+        uniquetb.set_max_nodes(max_nodes);
+        uniquewt.set_max_weights(max_weights);
+    }
+
+    uint32_t get_num_nodes() const
+    {
+        return uniquetb.num_nodes();
+    }
+
+    uint32_t get_node_capacity() const
+    {
+        return uniquetb.node_capacity();
+    }
+
+    uint32_t get_num_weights() const
+    {
+        return uniquewt.num_weights();
+    }
+
+    size_t get_bytes_used() const
+    {
+        return uniquetb.pool_memory().used_bytes + uniquetb.index_memory().used_bytes +
+            uniquewt.memory().used_bytes + computedtb.memory().used_bytes + computedwt.memory().used_bytes;
+    }
+
+    // updates the peak memory usage. peaks are only as precise as the sampling.
+    void sample_memory()
+    {
+        memory_usage current[memory_subsystem_count] = {
+            uniquetb.pool_memory(),
+            uniquetb.index_memory(),
+            uniquewt.memory(),
+            computedtb.memory(),
+            computedwt.memory()
+        };
+
+        size_t total = 0;
+        for (int i = 0; i < memory_subsystem_count; i++)
+        {
+            memory_usage& peak = memory_peaks.subsystems[i];
+            peak.peak_entries = std::max(peak.peak_entries, current[i].entries);
+            peak.peak_used_bytes = std::max(peak.peak_used_bytes, current[i].used_bytes);
+            total += current[i].used_bytes;
+        }
+        memory_peaks.peak_total_used_bytes = std::max(memory_peaks.peak_total_used_bytes, total);
+    }
+
+    memory_report get_memory_report()
+    {
+        sample_memory();
+
+        memory_report report = {};
+        report.subsystems[memory_node_pool] = uniquetb.pool_memory();
+        report.subsystems[memory_unique_table] = uniquetb.index_memory();
+        report.subsystems[memory_unique_weights] = uniquewt.memory();
+        report.subsystems[memory_computed_table] = computedtb.memory();
+        report.subsystems[memory_computed_weights] = computedwt.memory();
+
+        for (int i = 0; i < memory_subsystem_count; i++)
+        {
+            report.subsystems[i].peak_entries = memory_peaks.subsystems[i].peak_entries;
+            report.subsystems[i].peak_used_bytes = memory_peaks.subsystems[i].peak_used_bytes;
+            report.total_used_bytes += report.subsystems[i].used_bytes;
+        }
+        report.peak_total_used_bytes = memory_peaks.peak_total_used_bytes;
+
+        return report;
+    }
+
+    // number of distinct nodes reachable from root, including the terminal.
+    // nodes that aren't reachable from any root still in use are garbage.
+    uint32_t count_live_nodes(const edge& root) const
+    {
+        struct node_hasher
+        {
+            size_t operator()(node_handle n) const
+            {
+                return n.value;
+            }
+        };
+
+        std::unordered_set<node_handle, node_hasher> visited;
+        std::vector<node_handle> stack = { root.v };
+        while (!stack.empty())
+        {
+            node_handle n = stack.back();
+            stack.pop_back();
+
+            if (!visited.insert(n).second || n == true_node)
+                continue;
+
+            for (int i = 0; i < p*p; i++)
+            {
+                stack.push_back(uniquetb.get_child(n, i));
+            }
+        }
+
+        return uint32_t(visited.size());
+    }
+
+    int get_var(node_handle h) const
+    {
+        return uniquetb.get_var(h);
+    }
+
+    void get_children(node_handle h, node_handle children[4]) const
+    {
+        return uniquetb.get_children(h, children);
+    }
+
+    void get_weights(node_handle h, weight_handle weights[4]) const
+    {
+        return uniquetb.get_weights(h, weights);
+    }
+
+    node_handle make_node(uint32_t var, const node_handle children[4], const weight_handle weights[4])
+    {
+        // enforce no-redundancy constraint of QMDD
+        bool redundant = true;
+        for (int i = 0; i < p*p - 1; i++)
+        {
+            if (children[i] != children[i + 1] ||
+                weights[i] != weights[i + 1])
+            {
+                redundant = false;
+                break;
+            }
+        }
+        if (redundant)
+        {
+            return children[0];
+        }
+
+        // enforce uniqueness constraint of QMDD
+        return uniquetb.insert(var, children, weights);
+    }
+
+    weight_handle get_weight_i_handle()
+    {
+        weight weight_i = weight::i();
+        return uniquewt.insert(weight_i);
+    }
+
+    weight_handle get_weight_sq2_handle()
+    {
+        weight weight_sq2 = weight::sq2();
+        return uniquewt.insert(weight_sq2);
+    }
+
+    // a weight given as floating-point numbers. it's the exact weight instead if there's one within the tolerance already.
+    weight_handle get_approximate_weight_handle(double real_part, double imag_part)
+    {
+        return uniquewt.insert(weight::approximate(real_part, imag_part));
+    }
+
+    weight_handle apply(weight_handle w0, weight_handle w1, weight_op op)
+    {
+        weight_handle found = computedwt.find(w0, w1, op);
+        if (found != invalid_weight)
+        {
+            return found;
+        }
+
+        weight new_weight;
+        if (op == weight_op_add)
+        {
+            new_weight = uniquewt.get_weight(w0) + uniquewt.get_weight(w1);
+        }
+        else if (op == weight_op_sub)
+        {
+            new_weight = uniquewt.get_weight(w0) - uniquewt.get_weight(w1);
+        }
+        else if (op == weight_op_mul)
+        {
+            new_weight = uniquewt.get_weight(w0) * uniquewt.get_weight(w1);
+        }
+        else if (op == weight_op_div)
+        {
+            new_weight = uniquewt.get_weight(w0) / uniquewt.get_weight(w1);
+        }
+        else
+        {
+            assert(!"unimplemented op");
+            return invalid_weight;
+        }
+
+        weight_handle w = uniquewt.insert(new_weight);
+
+        computedwt.insert(w0, w1, op, w);
+
+        return w;
+    }
+
+    edge apply(const edge& e0, const edge& e1, edge_op op)
+    {
+        // helper to make the code better match the pseudo-code
+        struct apply_helper
+        {
+            qmdd* const dd;
+
+            weight_handle w(const edge& e)
+            {
+                return e.w; 
+            }
+
+            node_handle v(const edge& e)
+            {
+                return e.v;
+            }
+
+            int x(const edge& e)
+            { 
+                return dd->get_var(e.v); 
+            }
+
+            edge Ei(const edge& e, int i)
+            {
+                return edge(dd->uniquetb.get_weight(e.v, i), dd->uniquetb.get_child(e.v, i));
+            }
+
+            bool term(const edge& e)
+            { 
+                return e.v == dd->get_true();
+            }
+
+            weight_handle normalize(weight_handle children[p*p])
+            {
+                for (int i = 0; i < p*p; i++)
+                {
+                    if (children[i] != weight_0_handle)
+                    {
+                        weight_handle edge_weight = children[i];
+
+                        // normalize this child
+                        children[i] = weight_1_handle;
+
+                        // normalize the other children
+                        for (int j = i + 1; j < p*p; j++)
+                        {
+                            if (children[j] != weight_0_handle)
+                            {
+                                children[j] = dd->apply(children[j], edge_weight, weight_op_div);
+                            }
+                        }
+
+                        return edge_weight;
+                    }
+                }
+
+                // all weights were 0
+                return weight_0_handle;
+            }
+
+            edge add(const edge& e0, const edge& e1)
+            {
+                if (term(e0))
+                {
+                    // addition with 0 always returns other input
+                    if (w(e0) == weight_0_handle)
+                        return e1;
+                    else if (term(e1))
+                        return edge(dd->apply(w(e0), w(e1), weight_op_add), dd->get_true());
+                }
+
+                // enforce variable order of e0 < e1
+                if (x(e0) > x(e1))
+                    return add(e1, e0);
+
+                // recursively add the p*p quadrants
+                node_handle z_children[p*p];
+                weight_handle z_weights[p*p];
+                for (int i = 0; i < p*p; i++)
+                {
+                    edge q0 = edge(dd->apply(w(e0), w(Ei(e0, i)), weight_op_mul), v(Ei(e0, i)));
+
+                    edge q1;
+                    if (x(e0) == x(e1))
+                        q1 = edge(dd->apply(w(e1), w(Ei(e1, i)), weight_op_mul), v(Ei(e1, i)));
+                    else
+                        q1 = e1;
+
+                    edge zi = dd->apply(q0, q1, edge_op_add);
+                    z_children[i] = zi.v;
+                    z_weights[i] = zi.w;
+                }
+
+                // normalize weights
+                weight_handle new_weight = normalize(z_weights);
+
+                // make the new node
+                node_handle new_node = dd->make_node(x(e0), z_children, z_weights);
+
+                return edge(new_weight, new_node);
+            }
+
+            edge mul(const edge& e0, const edge& e1)
+            {
+                // multiplication with "1" terminal as base case
+                if (term(e0))
+                {
+                    // multiplication with 0 always returns 0
+                    if (w(e0) == weight_0_handle)
+                        return e0;
+                    else if (w(e0) == weight_1_handle)
+                        return e1; // avoid multiplication for the case of multiplying by 1
+                    else
+                        return edge(dd->apply(w(e0), w(e1), weight_op_mul), v(e1));
+                }
+
+                // enforce variable order of e0 < e1
+                if (x(e0) > x(e1))
+                    return add(e1, e0);
+
+                // recursively multiply the p*p quadrants
+                node_handle z_children[p*p];
+                weight_handle z_weights[p*p];
+                for (int i = 0; i < p * p; i += p)
+                {
+                    for (int j = 0; j < p; j++)
+                    {
+                        edge zij = edge(weight_0_handle, dd->get_true());
+                        for (int k = 0; k < p; k++)
+                        {
+                            edge q0 = edge(dd->apply(w(e0), w(Ei(e0, i + k)), weight_op_mul), v(Ei(e0, i + k)));
+
+                            edge q1;
+                            if (x(e0) == x(e1))
+                                q1 = edge(dd->apply(w(e1), w(Ei(e1, j + p*k)), weight_op_mul), v(Ei(e1, j + p*k)));
+                            else
+                                q1 = e1;
+
+                            edge q0q1 = dd->apply(q0, q1, edge_op_mul);
+                            zij = dd->apply(zij, q0q1, edge_op_add);
+                        }
+                        z_children[i + j] = zij.v;
+                        z_weights[i + j] = zij.w;
+                    }
+                }
+
+                // normalize weights
+                weight_handle new_weight = normalize(z_weights);
+
+                node_handle new_node = dd->make_node(x(e0), z_children, z_weights);
+
+                return edge(new_weight, new_node);
+            }
 
             edge kro(const edge& e0, const edge& e1)
             {
-                // kronecker with the "1" terminal as a base case
-                if (term(e0))
+                // kronecker with the "1" terminal as a base case
+                if (term(e0))
+                {
+                    // kronecker with 0 always gives 0
+                    if (w(e0) == weight_0_handle)
+                        return e0;
+                    else if (w(e0) == weight_1_handle)
+                        return e1; // avoid multiplication for the case of multiplying by 1
+                    else
+                        return edge(dd->apply(w(e0), w(e1), weight_op_mul), v(e1));
+                }
+                
+                // simplifying assumption to avoid having to determine which variable is the top one
+                assert(x(e0) < x(e1));
+
+                // recursively kronecker
+                node_handle z_children[p*p];
+                weight_handle z_weights[p*p];
+                for (int i = 0; i < p*p; i++)
+                {
+                    edge zi = dd->apply(Ei(e0, i), e1, edge_op_kro);
+                    z_children[i] = zi.v;
+                    z_weights[i] = zi.w;
+                }
+
+                // normalize weights
+                weight_handle new_weight = normalize(z_weights);
+                new_weight = dd->apply(new_weight, w(e0), weight_op_mul);
+
+                // make the new node
+                node_handle new_node = dd->make_node(x(e0), z_children, z_weights);
+
+                return edge(new_weight, new_node);
+            }
+        };
+
+        edge found = computedtb.find(e0, e1, op);
+        if (found.v != invalid_node)
+        {
+            return found;
+        }
+
+        apply_helper helper{ this };
+
+        edge new_edge;
+
+        if (op == edge_op_add)
+        {
+            new_edge = helper.add(e0, e1);
+        }
+        else if (op == edge_op_mul)
+        {
+            new_edge = helper.mul(e0, e1);
+        }
+        else if (op == edge_op_kro)
+        {
+            new_edge = helper.kro(e0, e1);
+        }
+        else
+        {
+            assert(!"unimplemented op");
+            return edge(invalid_weight, invalid_node);
+        }
+
+        computedtb.insert(e0, e1, op, new_edge);
+
+        return new_edge;
+    }
+
+    std::string to_string(weight_handle w) const
+    {
+        return uniquewt.get_weight(w).to_string();
+    }
+
+    std::complex<double> to_complex(weight_handle w) const
+    {
+        const weight& value = uniquewt.get_weight(w);
+        return std::complex<double>(value.real_value(), value.imag_value());
+    }
+
+    // a diagram copied out of a qmdd, so it can be moved to another qmdd or written to a file.
+    // node index 0 is the terminal, other nodes are stored children-first.
+    struct exported_dd
+    {
+        struct node_record
+        {
+            int var;
+            uint32_t children[p*p];
+            uint32_t weights[p*p];
+        };
+
+        int num_vars = 0;
+
+        // weight::num_components ints per weight
+        std::vector<int> weight_components;
+        uint32_t num_weights = 0;
+
+        // excludes the terminal
+        std::vector<node_record> nodes;
+
+        uint32_t root_weight = 0;
+        uint32_t root_node = 0;
+    };
+
+    exported_dd export_dd(const edge& root) const
+    {
+        struct handle_hasher
+        {
+            size_t operator()(uint32_t h) const
+            {
+                return h;
+            }
+        };
+
+        std::unordered_map<uint32_t, uint32_t, handle_hasher> node_ids;
+        std::unordered_map<uint32_t, uint32_t, handle_hasher> weight_ids;
+        std::vector<node_handle> nodes;
+
+        exported_dd exported;
+        exported.num_vars = uniquetb.get_var(true_node);
+
+        auto add_weight = [&](weight_handle w)
+        {
+            auto inserted = weight_ids.emplace(w.value, exported.num_weights);
+            if (inserted.second)
+            {
+                int c[weight::num_components];
+                uniquewt.get_weight(w).to_components(c);
+                exported.weight_components.insert(end(exported.weight_components), c, c + weight::num_components);
+                exported.num_weights += 1;
+            }
+            return inserted.first->second;
+        };
+
+        node_ids.emplace(true_node.value, 0);
+
+        // post-order traversal so children are always stored before their parents
+        std::vector<std::pair<node_handle, bool>> stack = { { root.v, false } };
+        while (!stack.empty())
+        {
+            node_handle n = stack.back().first;
+            bool children_done = stack.back().second;
+            stack.pop_back();
+
+            if (node_ids.find(n.value) != end(node_ids))
+                continue;
+
+            if (children_done)
+            {
+                node_ids.emplace(n.value, uint32_t(nodes.size() + 1));
+                nodes.push_back(n);
+                continue;
+            }
+
+            stack.push_back({ n, true });
+            for (int i = 0; i < p*p; i++)
+            {
+                node_handle child = uniquetb.get_child(n, i);
+                if (node_ids.find(child.value) == end(node_ids))
+                    stack.push_back({ child, false });
+            }
+        }
+
+        exported.root_weight = add_weight(root.w);
+        exported.root_node = node_ids[root.v.value];
+
+        exported.nodes.resize(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            exported_dd::node_record& record = exported.nodes[i];
+            record.var = uniquetb.get_var(nodes[i]);
+            for (int j = 0; j < p*p; j++)
+            {
+                record.children[j] = node_ids[uniquetb.get_child(nodes[i], j).value];
+                record.weights[j] = add_weight(uniquetb.get_weight(nodes[i], j));
+            }
+        }
+
+        return exported;
+    }
+
+    // rebuilds a diagram exported from any qmdd with the same number of variables, and returns its root.
+    edge import_dd(const exported_dd& exported)
+    {
+        auto expect = [](bool ok)
+        {
+            if (!ok)
+            {
+                throw std::runtime_error("malformed qmdd data");
+            }
+        };
+
+        int num_vars = uniquetb.get_var(true_node);
+        if (exported.num_vars != num_vars)
+        {
+            throw std::runtime_error("qmdd data has " + std::to_string(exported.num_vars) + " variables, expected " + std::to_string(num_vars));
+        }
+
+        expect(exported.weight_components.size() == size_t(exported.num_weights) * weight::num_components);
+
+        std::vector<weight_handle> weights(exported.num_weights);
+        for (uint32_t i = 0; i < exported.num_weights; i++)
+        {
+            const int* c = &exported.weight_components[size_t(i) * weight::num_components];
+            for (int j = 1; j < weight::num_components; j += 2)
+            {
+                // either all denominators are positive, or all are zero for an approximate weight
+                expect(c[1] == 0 ? c[j] == 0 : c[j] > 0);
+            }
+            weights[i] = uniquewt.insert(weight::from_components(c));
+        }
+
+        std::vector<node_handle> nodes(exported.nodes.size() + 1);
+        nodes[0] = true_node;
+        for (uint32_t i = 1; i < nodes.size(); i++)
+        {
+            const exported_dd::node_record& record = exported.nodes[i - 1];
+            expect(record.var >= 0 && record.var < num_vars);
+
+            node_handle children[p*p];
+            weight_handle child_weights[p*p];
+            for (int j = 0; j < p*p; j++)
+            {
+                expect(record.children[j] < i && record.weights[j] < exported.num_weights);
+                children[j] = nodes[record.children[j]];
+                child_weights[j] = weights[record.weights[j]];
+            }
+            nodes[i] = make_node(record.var, children, child_weights);
+        }
+
+        expect(exported.root_weight < exported.num_weights && exported.root_node < nodes.size());
+
+        return edge(weights[exported.root_weight], nodes[exported.root_node]);
+    }
+
+    // copies the diagram under root from src, which can be another qmdd, and returns its root in this one.
+    // source variable v becomes variable var_offset + v, or var_map[v] if var_map isn't empty. the variables must keep their order.
+    // the source terminal becomes the terminal, so a diagram over fewer variables lands as a block for kronecker products.
+    // every node and distinct weight is translated once, so the copy takes time linear in the size of the diagram.
+    edge import_dd(const qmdd& src, const edge& root, int var_offset = 0, const std::vector<int>& var_map = std::vector<int>())
+    {
+        int num_vars = uniquetb.get_var(true_node);
+        int src_num_vars = src.uniquetb.get_var(src.true_node);
+
+        if (!var_map.empty() && var_map.size() != size_t(src_num_vars))
+        {
+            throw std::logic_error("variable map has " + std::to_string(var_map.size()) + " variables, expected " + std::to_string(src_num_vars));
+        }
+
+        std::vector<int> target_var(src_num_vars);
+        for (int v = 0; v < src_num_vars; v++)
+        {
+            target_var[v] = var_map.empty() ? var_offset + v : var_map[v];
+            if (target_var[v] < 0 || target_var[v] >= num_vars || (v > 0 && target_var[v] <= target_var[v - 1]))
+            {
+                throw std::logic_error("variable " + std::to_string(v) + " can't be imported as variable " + std::to_string(target_var[v]));
+            }
+        }
+
+        struct handle_hasher
+        {
+            size_t operator()(uint32_t h) const
+            {
+                return h;
+            }
+        };
+
+        std::unordered_map<uint32_t, node_handle, handle_hasher> nodes;
+        std::unordered_map<uint32_t, weight_handle, handle_hasher> weights;
+
+        auto import_weight = [&](weight_handle w)
+        {
+            auto found = weights.find(w.value);
+            if (found != end(weights))
+                return found->second;
+
+            weight_handle imported = uniquewt.insert(src.uniquewt.get_weight(w));
+            weights.emplace(w.value, imported);
+            return imported;
+        };
+
+        nodes.emplace(src.true_node.value, true_node);
+
+        // post-order traversal so children are always made before their parents
+        std::vector<std::pair<node_handle, bool>> stack = { { root.v, false } };
+        while (!stack.empty())
+        {
+            node_handle n = stack.back().first;
+            bool children_done = stack.back().second;
+            stack.pop_back();
+
+            if (nodes.find(n.value) != end(nodes))
+                continue;
+
+            if (children_done)
+            {
+                node_handle children[p*p];
+                weight_handle child_weights[p*p];
+                for (int i = 0; i < p*p; i++)
+                {
+                    children[i] = nodes[src.uniquetb.get_child(n, i).value];
+                    child_weights[i] = import_weight(src.uniquetb.get_weight(n, i));
+                }
+                nodes.emplace(n.value, make_node(target_var[src.uniquetb.get_var(n)], children, child_weights));
+                continue;
+            }
+
+            stack.push_back({ n, true });
+            for (int i = 0; i < p*p; i++)
+            {
+                node_handle child = src.uniquetb.get_child(n, i);
+                if (nodes.find(child.value) == end(nodes))
+                    stack.push_back({ child, false });
+            }
+        }
+
+        return edge(import_weight(root.w), nodes[root.v.value]);
+    }
+
+    // writes the diagram reachable from root in a compact text format:
+    //   qmdd <num vars>
+    //   w <weight count>, then one line of weight components per weight
+    //   n <node count>, then one line per node: var, then child and weight indices per quadrant
+    //   r <root weight index> <root node index>
+    // node index 0 is the terminal, other nodes are written children-first.
+    void serialize(FILE* f, const edge& root) const
+    {
+        exported_dd exported = export_dd(root);
+
+        fprintf(f, "qmdd %d\n", exported.num_vars);
+
+        fprintf(f, "w %u\n", exported.num_weights);
+        for (uint32_t i = 0; i < exported.num_weights; i++)
+        {
+            const int* c = &exported.weight_components[size_t(i) * weight::num_components];
+            for (int j = 0; j < weight::num_components; j++)
+            {
+                fprintf(f, j == 0 ? "%d" : " %d", c[j]);
+            }
+            fprintf(f, "\n");
+        }
+
+        fprintf(f, "n %u\n", uint32_t(exported.nodes.size()));
+        for (const exported_dd::node_record& record : exported.nodes)
+        {
+            fprintf(f, "%d", record.var);
+            for (int i = 0; i < p*p; i++)
+            {
+                fprintf(f, " %u %u", record.children[i], record.weights[i]);
+            }
+            fprintf(f, "\n");
+        }
+
+        fprintf(f, "r %u %u\n", exported.root_weight, exported.root_node);
+    }
+
+    // reads a diagram written by serialize() into this qmdd and returns its root.
+    edge deserialize(FILE* f)
+    {
+        auto expect = [](bool ok)
+        {
+            if (!ok)
+            {
+                throw std::runtime_error("malformed qmdd data");
+            }
+        };
+
+        exported_dd exported;
+
+        expect(fscanf(f, " qmdd %d", &exported.num_vars) == 1);
+
+        expect(fscanf(f, " w %u", &exported.num_weights) == 1);
+        exported.weight_components.resize(size_t(exported.num_weights) * weight::num_components);
+        for (int& c : exported.weight_components)
+        {
+            expect(fscanf(f, "%d", &c) == 1);
+        }
+
+        uint32_t num_nodes;
+        expect(fscanf(f, " n %u", &num_nodes) == 1);
+        exported.nodes.resize(num_nodes);
+        for (exported_dd::node_record& record : exported.nodes)
+        {
+            expect(fscanf(f, "%d", &record.var) == 1);
+            for (int j = 0; j < p*p; j++)
+            {
+                expect(fscanf(f, "%u %u", &record.children[j], &record.weights[j]) == 2);
+            }
+        }
+
+        expect(fscanf(f, " r %u %u", &exported.root_weight, &exported.root_node) == 2);
+
+        return import_dd(exported);
+    }
+};
+
+struct dd_shape
+{
+    // per variable level
+    std::vector<uint32_t> level_nodes;
+    std::vector<uint32_t> level_weights;
+
+    // counts exclude the terminal
+    uint32_t num_nodes;
+
+    // number of nodes the diagram would have as a tree, ie. without any sharing
+    double tree_nodes;
+
+    // tree_nodes / num_nodes
+    double sharing_factor;
+
+    // average number of nonzero edges pointing to each node, including the root edge
+    double average_fan_in;
+};
+
+dd_shape analyze_shape(const qmdd& dd, const qmdd::edge& root)
+{
+    static const int p = qmdd::p;
+
+    qmdd::node_handle true_node = dd.get_true();
+    int num_vars = dd.get_var(true_node);
+
+    dd_shape shape;
+    shape.level_nodes.assign(num_vars, 0);
+    shape.level_weights.assign(num_vars, 0);
+    shape.num_nodes = 0;
+    shape.tree_nodes = 0.0;
+
+    struct handle_hasher
+    {
+        size_t operator()(uint32_t h) const
+        {
+            return h;
+        }
+    };
+
+    // number of paths from the root to each node
+    std::unordered_map<uint32_t, double, handle_hasher> paths;
+
+    // visiting the levels top-down is a topological order, since children are always on lower levels
+    std::vector<std::vector<qmdd::node_handle>> levels(num_vars);
+    std::vector<std::unordered_set<uint32_t, handle_hasher>> level_weight_sets(num_vars);
+
+    uint32_t num_in_edges = 0;
+
+    if (root.v != true_node && root.w != qmdd::weight_0_handle)
+    {
+        paths[root.v.value] = 1.0;
+        levels[dd.get_var(root.v)].push_back(root.v);
+        num_in_edges += 1;
+    }
+
+    for (int var = 0; var < num_vars; var++)
+    {
+        for (qmdd::node_handle n : levels[var])
+        {
+            double n_paths = paths[n.value];
+
+            shape.level_nodes[var] += 1;
+            shape.num_nodes += 1;
+            shape.tree_nodes += n_paths;
+
+            qmdd::node_handle children[p * p];
+            dd.get_children(n, children);
+
+            qmdd::weight_handle weights[p * p];
+            dd.get_weights(n, weights);
+
+            for (int i = 0; i < p * p; i++)
+            {
+                if (weights[i] == qmdd::weight_0_handle)
+                    continue;
+
+                level_weight_sets[var].insert(weights[i].value);
+
+                if (children[i] == true_node)
+                    continue;
+
+                num_in_edges += 1;
+
+                auto inserted = paths.emplace(children[i].value, 0.0);
+                if (inserted.second)
+                {
+                    levels[dd.get_var(children[i])].push_back(children[i]);
+                }
+                inserted.first->second += n_paths;
+            }
+        }
+
+        shape.level_weights[var] = uint32_t(level_weight_sets[var].size());
+    }
+
+    shape.sharing_factor = shape.num_nodes == 0 ? 1.0 : shape.tree_nodes / shape.num_nodes;
+    shape.average_fan_in = shape.num_nodes == 0 ? 0.0 : double(num_in_edges) / shape.num_nodes;
+
+    return shape;
+}
+
+// writes the shape as a single line of JSON
+void write_shape_json(FILE* f, const program_spec& spec, const dd_shape& shape, int num_gates)
+{
+    fprintf(f, "{\"gates\":%d,\"nodes\":%u,\"tree_nodes\":%.17g,\"sharing_factor\":%.6g,\"average_fan_in\":%.6g,\"levels\":[",
+        num_gates, shape.num_nodes, shape.tree_nodes, shape.sharing_factor, shape.average_fan_in);
+
+    for (size_t var = 0; var < shape.level_nodes.size(); var++)
+    {
+        fprintf(f, "%s{\"var\":\"", var == 0 ? "" : ",");
+
+        // variable names can't contain commas, but can contain anything else
+        for (char c : spec.variable_names[var])
+        {
+            if (c == '"' || c == '\\')
+                fprintf(f, "\\%c", c);
+            else if ((unsigned char)c < 0x20)
+                fprintf(f, "\\u%04x", c);
+            else
+                fputc(c, f);
+        }
+
+        fprintf(f, "\",\"nodes\":%u,\"weights\":%u}", shape.level_nodes[var], shape.level_weights[var]);
+    }
+
+    fprintf(f, "]}\n");
+}
+
+struct decode_options
+{
+    // resource budgets. zero means unlimited.
+    uint32_t max_nodes = 0;
+    uint32_t max_weights = 0;
+    size_t max_bytes = 0;
+    double max_seconds = 0.0;
+
+    // if set, a checkpoint of the decoding progress is periodically written to this file.
+    // a checkpoint is written whenever either interval has elapsed. zero disables an interval.
+    std::string checkpoint_file;
+    double checkpoint_seconds = 0.0;
+    int checkpoint_gates = 0;
+
+    // continue from the checkpoint file if it exists
+    bool resume = false;
+
+    // if set, the shape of the product is written to this file as a line of JSON between gates
+    std::string shape_trace_file;
+
+    // restricts the product to the constant input values given by .c, and ignores the garbage outputs
+    // (variables missing from .o). this keeps only the part of the unitary that is observable.
+    bool reduce_ancillas = false;
+
+    // count the nodes reachable from the product between gates, for decode_report::peak_live_nodes
+    bool track_peak_live_nodes = false;
+};
+
+struct decode_report
+{
+    // false if decoding stopped early because a budget was exceeded
+    bool completed;
+    std::string stop_reason;
+
+    // index of the gate being decoded when decoding stopped, and its offset in the gate stream.
+    // if decoding completed, these point one past the last gate.
+    int gate_index;
+    int gate_offset;
+
+    // index of the gate decoding resumed from, or -1 if decoding started from the beginning
+    int resumed_gate_index;
+
+    uint32_t num_nodes;
+    uint32_t num_weights;
+    size_t bytes_used;
+    double seconds;
+
+    // memory use per subsystem, with peaks sampled between gates
+    qmdd::memory_report memory;
+
+    // nodes reachable from the resulting root. the other allocated nodes are garbage.
+    uint32_t live_nodes;
+
+    // the most nodes reachable from the product between two gates, if decode_options::track_peak_live_nodes is set
+    uint32_t peak_live_nodes;
+};
+
+// used to check that a checkpoint belongs to the circuit being decoded, with the same options
+uint64_t checkpoint_fingerprint(const program_spec& spec, const decode_options& options)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto add = [&hash](int x)
+    {
+        hash = (hash ^ uint32_t(x)) * 0x100000001b3ull;
+    };
+
+    for (int x : spec.gate_stream)
+    {
+        add(x);
+    }
+
+    // the reduction changes the product, so it must match too
+    if (options.reduce_ancillas)
+    {
+        add(-1);
+        for (int var_id = 0; var_id < spec.num_variables; var_id++)
+        {
+            add(spec.variable_constant_input[var_id]);
+            add(spec.variable_output_list_index[var_id] == -1);
+        }
+    }
+
+    return hash;
+}
+
+// checkpoint format:
+//   checkpoint <variable count> <gate stream size> <fingerprint>
+//   gate <gate index> <gate stream offset>
+// followed by the product of all gates before that gate, as written by qmdd::serialize().
+void write_checkpoint(const program_spec& spec, uint64_t fingerprint, const qmdd& dd, const qmdd::edge& root, int gate_index, int gate_offset, const std::string& fn)
+{
+    // write to a temporary file first so a crash while writing can't destroy the previous checkpoint
+    std::string tmpfn = fn + ".tmp";
+
+    FILE* f = fopen(tmpfn.c_str(), "w");
+
+    if (!f)
+    {
+        throw std::runtime_error("failed to open " + tmpfn);
+    }
+
+    fprintf(f, "checkpoint %d %d %016llx\n", spec.num_variables, (int)spec.gate_stream.size(), (unsigned long long)fingerprint);
+    fprintf(f, "gate %d %d\n", gate_index, gate_offset);
+
+    dd.serialize(f, root);
+
+    bool ok = fflush(f) == 0 && !ferror(f);
+    fclose(f);
+
+    if (!ok)
+    {
+        throw std::runtime_error("failed to write " + tmpfn);
+    }
+
+    if (std::rename(tmpfn.c_str(), fn.c_str()) != 0)
+    {
+        // rename doesn't replace existing files on all platforms
+        std::remove(fn.c_str());
+        if (std::rename(tmpfn.c_str(), fn.c_str()) != 0)
+        {
+            throw std::runtime_error("failed to rename " + tmpfn + " to " + fn);
+        }
+    }
+}
+
+// returns false if the checkpoint file doesn't exist
+bool read_checkpoint(const program_spec& spec, uint64_t expected_fingerprint, qmdd& dd, qmdd::edge* root_out, int* gate_index_out, int* gate_offset_out, const std::string& fn)
+{
+    FILE* f = fopen(fn.c_str(), "r");
+
+    if (!f)
+    {
+        return false;
+    }
+
+    try
+    {
+        int num_variables, gate_stream_size, gate_index, gate_offset;
+        unsigned long long fingerprint;
+        if (fscanf(f, " checkpoint %d %d %llx", &num_variables, &gate_stream_size, &fingerprint) != 3 ||
+            fscanf(f, " gate %d %d", &gate_index, &gate_offset) != 2)
+        {
+            throw std::runtime_error("malformed checkpoint header");
+        }
+
+        if (num_variables != spec.num_variables ||
+            gate_stream_size != (int)spec.gate_stream.size() ||
+            fingerprint != expected_fingerprint)
+        {
+            throw std::runtime_error("checkpoint does not match the input circuit");
+        }
+
+        if (gate_offset < 0 || gate_offset > gate_stream_size || gate_index < 0)
+        {
+            throw std::runtime_error("malformed checkpoint header");
+        }
+
+        *root_out = dd.deserialize(f);
+        *gate_index_out = gate_index;
+        *gate_offset_out = gate_offset;
+    }
+    catch (const std::exception& e)
+    {
+        fclose(f);
+        throw std::runtime_error(fn + ": " + e.what());
+    }
+
+    fclose(f);
+    return true;
+}
+
+// builds the QMDDs of single gates.
+// the weights of the gate matrices are created in the qmdd the builder is bound to.
+class gate_builder
+{
+public:
+    using node_handle = qmdd::node_handle;
+    using weight_handle = qmdd::weight_handle;
+    using edge = qmdd::edge;
+
+    static const int p = qmdd::p;
+
+private:
+    qmdd& dd;
+    int num_variables;
+
+    node_handle identity_children[p * p];
+    weight_handle identity_weights[p * p];
+    weight_handle not_weights[p * p];
+    weight_handle if_false_weights[p * p];
+    weight_handle if_true_weights[p * p];
+    weight_handle y_weights[p * p];
+    weight_handle z_weights[p * p];
+    weight_handle sqrtnot_weights[p * p];
+    weight_handle inv_sqrtnot_weights[p * p];
+    weight_handle hadamard_weights[p * p];
+    weight_handle rotate_pi_by_4_weights[p * p];
+    weight_handle inv_rotate_pi_by_4_weights[p * p];
+    weight_handle rotate_pi_by_2_weights[p * p];
+    weight_handle inv_rotate_pi_by_2_weights[p * p];
+
+    // identitySubtree[var] is the identity over the variables [var, num_variables)
+    std::vector<edge> identitySubtree;
+
+    // gates are built over the variables [block_first_var, block_end_var), with the terminal below block_end_var.
+    // blockIdentity[var] is the identity over the variables [var, block_end_var).
+    int block_first_var;
+    int block_end_var;
+    std::vector<edge> blockIdentity;
+
+public:
+    explicit gate_builder(qmdd& dd)
+        : dd(dd)
+    {
+        static const weight_handle weight_0_handle = qmdd::weight_0_handle;
+        static const weight_handle weight_1_handle = qmdd::weight_1_handle;
+
+        node_handle true_node = dd.get_true();
+        num_variables = dd.get_var(true_node);
+
+        for (int i = 0; i < p; i++)
+        {
+            for (int j = 0; j < p; j++)
+            {
+                identity_children[i * p + j] = true_node;
+
+                if (i == j)
+                    identity_weights[i * p + j] = weight_1_handle;
+                else
+                    identity_weights[i * p + j] = weight_0_handle;
+
+                if (i == p - 1 - j)
+                    not_weights[i * p + j] = weight_1_handle;
+                else
+                    not_weights[i * p + j] = weight_0_handle;
+            }
+        }
+
+        for (int i = 0; i < p * p; i++)
+        {
+            if (i == 0)
+                if_false_weights[i] = weight_1_handle;
+            else
+                if_false_weights[i] = weight_0_handle;
+        }
+
+        for (int i = 0; i < p * p; i++)
+        {
+            if (i == p * p - 1)
+                if_true_weights[i] = weight_1_handle;
+            else
+                if_true_weights[i] = weight_0_handle;
+        }
+
+        if (p == 2)
+        {
+            y_weights[0] = weight_0_handle;
+            y_weights[1] = dd.apply(weight_0_handle, dd.get_weight_i_handle(), qmdd::weight_op_sub);
+            y_weights[2] = dd.get_weight_i_handle();
+            y_weights[3] = weight_0_handle;
+        }
+
+        if (p == 2)
+        {
+            z_weights[0] = weight_1_handle;
+            z_weights[1] = weight_0_handle;
+            z_weights[2] = weight_0_handle;
+            z_weights[3] = dd.apply(weight_0_handle, weight_1_handle, qmdd::weight_op_sub);
+        }
+
+        if (p == 2)
+        {
+            weight_handle weight_2_handle = dd.apply(weight_1_handle, weight_1_handle, qmdd::weight_op_add);
+
+            weight_handle one_add_i_by_2 = dd.apply(dd.apply(weight_1_handle, dd.get_weight_i_handle(), qmdd::weight_op_add), weight_2_handle, qmdd::weight_op_div);
+            weight_handle one_sub_i_by_2 = dd.apply(dd.apply(weight_1_handle, dd.get_weight_i_handle(), qmdd::weight_op_sub), weight_2_handle, qmdd::weight_op_div);
+
+            sqrtnot_weights[0] = one_add_i_by_2;
+            sqrtnot_weights[1] = one_sub_i_by_2;
+            sqrtnot_weights[2] = one_sub_i_by_2;
+            sqrtnot_weights[3] = one_add_i_by_2;
+
+            inv_sqrtnot_weights[0] = one_sub_i_by_2;
+            inv_sqrtnot_weights[1] = one_add_i_by_2;
+            inv_sqrtnot_weights[2] = one_add_i_by_2;
+            inv_sqrtnot_weights[3] = one_sub_i_by_2;
+        }
+
+        if (p == 2)
+        {
+            weight_handle one_by_sq2 = dd.apply(weight_1_handle, dd.get_weight_sq2_handle(), qmdd::weight_op_div);
+
+            hadamard_weights[0] = one_by_sq2;
+            hadamard_weights[1] = one_by_sq2;
+            hadamard_weights[2] = one_by_sq2;
+            hadamard_weights[3] = dd.apply(weight_0_handle, one_by_sq2, qmdd::weight_op_sub);
+        }
+
+        if (p == 2)
+        {
+            weight_handle one_by_sq2 = dd.apply(weight_1_handle, dd.get_weight_sq2_handle(), qmdd::weight_op_div);
+            weight_handle i_by_sq2 = dd.apply(dd.get_weight_i_handle(), dd.get_weight_sq2_handle(), qmdd::weight_op_div);
+
+            rotate_pi_by_4_weights[0] = weight_1_handle;
+            rotate_pi_by_4_weights[1] = weight_0_handle;
+            rotate_pi_by_4_weights[2] = weight_0_handle;
+            rotate_pi_by_4_weights[3] = dd.apply(one_by_sq2, i_by_sq2, qmdd::weight_op_add);
+
+            inv_rotate_pi_by_4_weights[0] = weight_1_handle;
+            inv_rotate_pi_by_4_weights[1] = weight_0_handle;
+            inv_rotate_pi_by_4_weights[2] = weight_0_handle;
+            inv_rotate_pi_by_4_weights[3] = dd.apply(one_by_sq2, i_by_sq2, qmdd::weight_op_sub);
+        }
+
+        if (p == 2)
+        {
+            rotate_pi_by_2_weights[0] = weight_1_handle;
+            rotate_pi_by_2_weights[1] = weight_0_handle;
+            rotate_pi_by_2_weights[2] = weight_0_handle;
+            rotate_pi_by_2_weights[3] = dd.get_weight_i_handle();
+
+            inv_rotate_pi_by_2_weights[0] = weight_1_handle;
+            inv_rotate_pi_by_2_weights[1] = weight_0_handle;
+            inv_rotate_pi_by_2_weights[2] = weight_0_handle;
+            inv_rotate_pi_by_2_weights[3] = dd.apply(weight_0_handle, dd.get_weight_i_handle(), qmdd::weight_op_sub);
+        }
+
+        // initialize with p^n by p^n identity
+        identitySubtree.resize(num_variables + 1);
+        identitySubtree[num_variables] = edge(weight_1_handle, true_node);
+        for (int var_id = num_variables - 1; var_id >= 0; var_id--)
+        {
+            identitySubtree[var_id] = dd.apply(make_level(var_id, identity_weights), identitySubtree[var_id + 1], qmdd::edge_op_kro);
+        }
+
+        block_first_var = 0;
+        block_end_var = num_variables;
+        blockIdentity = identitySubtree;
+    }
+
+    gate_builder(const gate_builder&) = delete;
+    gate_builder& operator=(const gate_builder&) = delete;
+
+    int get_num_variables() const
+    {
+        return num_variables;
+    }
+
+    const weight_handle* get_identity_weights() const
+    {
+        return identity_weights;
+    }
+
+    // the identity over the variables [var, num_variables)
+    edge identity(int var = 0) const
+    {
+        return identitySubtree[var];
+    }
+
+    // a single node of var whose quadrants are the given weights.
+    // it's normalized like the nodes apply makes, with its first nonzero weight moved to the edge,
+    // so gates that only differ by a factor (y and -y, or z and iz) share one node.
+    edge make_level(int var, const weight_handle weights[p * p])
+    {
+        int first = 0;
+        while (first < p * p && weights[first] == qmdd::weight_0_handle)
+        {
+            first++;
+        }
+        if (first == p * p)
+        {
+            return edge(qmdd::weight_0_handle, dd.get_true());
+        }
+
+        weight_handle factor = weights[first];
+        weight_handle normalized[p * p];
+        for (int i = 0; i < p * p; i++)
+        {
+            if (weights[i] == qmdd::weight_0_handle)
+                normalized[i] = weights[i];
+            else
+                normalized[i] = dd.apply(weights[i], factor, qmdd::weight_op_div);
+        }
+        return edge(factor, dd.make_node(var, identity_children, normalized));
+    }
+
+    // the 2x2 matrix of a single-target gate
+    const weight_handle* get_gate_weights(gate_opcode opcode) const
+    {
+        const weight_handle* gate_weights;
+        if (opcode == gate_opcode::toffoli)
+        {
+            gate_weights = not_weights;
+        }
+        else if (opcode == gate_opcode::pauli_y)
+        {
+            if (p != 2)
+            {
+                assert(!"y gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = y_weights;
+        }
+        else if (opcode == gate_opcode::pauli_z)
+        {
+            if (p != 2)
+            {
+                assert(!"z gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = z_weights;
+        }
+        else if (opcode == gate_opcode::sqrtnot)
+        {
+            if (p != 2)
+            {
+                assert(!"v gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = sqrtnot_weights;
+        }
+        else if (opcode == gate_opcode::inv_sqrtnot)
+        {
+            if (p != 2)
+            {
+                assert(!"v\' gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = inv_sqrtnot_weights;
+        }
+        else if (opcode == gate_opcode::hadamard)
+        {
+            if (p != 2)
+            {
+                assert(!"hadamard gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = hadamard_weights;
+        }
+        else if (opcode == gate_opcode::rotate_pi_by_4)
+        {
+            if (p != 2)
+            {
+                assert(!"q gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = rotate_pi_by_4_weights;
+        }
+        else if (opcode == gate_opcode::inv_rotate_pi_by_4)
+        {
+            if (p != 2)
+            {
+                assert(!"q\' gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = inv_rotate_pi_by_4_weights;
+        }
+        else if (opcode == gate_opcode::rotate_pi_by_2)
+        {
+            if (p != 2)
+            {
+                assert(!"s gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = rotate_pi_by_2_weights;
+        }
+        else if (opcode == gate_opcode::inv_rotate_pi_by_2)
+        {
+            if (p != 2)
+            {
+                assert(!"s\' gates not allowed outside of 2-valued logic");
+            }
+            gate_weights = inv_rotate_pi_by_2_weights;
+        }
+        else
+        {
+            throw std::logic_error("unknown gate opcode");
+        }
+
+        return gate_weights;
+    }
+
+    // the 2x2 matrix of a rotate_z, rotate_y or phase gate by angle radians.
+    // the weights are approximate, unless they're within the tolerance of an exact weight.
+    void get_rotation_weights(gate_opcode opcode, double angle, weight_handle gate_weights[p * p])
+    {
+        if (!std::isfinite(angle))
+        {
+            throw std::runtime_error("angle isn't finite");
+        }
+
+        double c = std::cos(angle / 2), s = std::sin(angle / 2);
+
+        if (opcode == gate_opcode::rotate_z)
+        {
+            // e^(-i angle/2) 0
+            // 0              e^(i angle/2)
+            gate_weights[0] = dd.get_approximate_weight_handle(c, -s);
+            gate_weights[1] = qmdd::weight_0_handle;
+            gate_weights[2] = qmdd::weight_0_handle;
+            gate_weights[3] = dd.get_approximate_weight_handle(c, s);
+        }
+        else if (opcode == gate_opcode::rotate_y)
+        {
+            // cos(angle/2) -sin(angle/2)
+            // sin(angle/2)  cos(angle/2)
+            gate_weights[0] = dd.get_approximate_weight_handle(c, 0.0);
+            gate_weights[1] = dd.get_approximate_weight_handle(-s, 0.0);
+            gate_weights[2] = dd.get_approximate_weight_handle(s, 0.0);
+            gate_weights[3] = gate_weights[0];
+        }
+        else if (opcode == gate_opcode::phase)
+        {
+            // 1 0
+            // 0 e^(i angle)
+            gate_weights[0] = qmdd::weight_1_handle;
+            gate_weights[1] = qmdd::weight_0_handle;
+            gate_weights[2] = qmdd::weight_0_handle;
+            gate_weights[3] = dd.get_approximate_weight_handle(std::cos(angle), std::sin(angle));
+        }
+        else
+        {
+            throw std::logic_error("not a rotation gate opcode");
+        }
+    }
+
+    // the matrix of a gate whose last parameter is the target and whose other parameters are controls.
+    edge build(gate_opcode opcode, const int* first_param, const int* last_param)
+    {
+        return build_controlled(get_gate_weights(opcode), first_param, last_param);
+    }
+
+    // the matrix of the 2x2 gate_weights on the last parameter, controlled by the other parameters.
+    edge build_controlled(const weight_handle* gate_weights, const int* first_param, const int* last_param)
+    {
+        static const weight_handle weight_0_handle = qmdd::weight_0_handle;
+        static const weight_handle weight_1_handle = qmdd::weight_1_handle;
+
+        node_handle true_node = dd.get_true();
+
+        assert(last_param - first_param >= 1);
+
+        int target_var_id = *(last_param - 1);
+        const int* next_control_var_id = last_param - 2;
+
+        edge active_gate = edge(weight_1_handle, true_node);
+        edge inactive_gate = edge(weight_0_handle, true_node);
+
+        for (int var_id = block_end_var - 1; var_id >= block_first_var; var_id--)
+        {
+            bool is_control = false;
+
+            // the quadrant where the control is active, and the one where it isn't
+            const weight_handle* on_weights = if_true_weights;
+            const weight_handle* off_weights = if_false_weights;
+
+            if (next_control_var_id >= first_param && operand_var_id(*next_control_var_id) == var_id)
+            {
+                is_control = true;
+                if (is_negated_control(*next_control_var_id))
+                {
+                    std::swap(on_weights, off_weights);
+                }
+                next_control_var_id -= 1;
+            }
+
+            if (var_id > target_var_id) // variables below the target
+            {
+                if (is_control)
+                {
+                    active_gate = dd.apply(make_level(var_id, on_weights), active_gate, qmdd::edge_op_kro);
+
+                    inactive_gate = dd.apply(
+                        dd.apply(make_level(var_id, off_weights), blockIdentity[var_id + 1], qmdd::edge_op_kro),
+                        dd.apply(make_level(var_id, on_weights), inactive_gate, qmdd::edge_op_kro),
+                        qmdd::edge_op_add);
+                }
+                else
+                {
+                    active_gate = dd.apply(make_level(var_id, identity_weights), active_gate, qmdd::edge_op_kro);
+                    inactive_gate = dd.apply(make_level(var_id, identity_weights), inactive_gate, qmdd::edge_op_kro);
+                }
+            }
+            else if (var_id == target_var_id) // the target variable
+            {
+                active_gate = dd.apply(
+                    dd.apply(make_level(var_id, identity_weights), inactive_gate, qmdd::edge_op_kro),
+                    dd.apply(make_level(var_id, gate_weights), active_gate, qmdd::edge_op_kro),
+                    qmdd::edge_op_add);
+            }
+            else if (var_id < target_var_id) // variables above the target
+            {
+                if (is_control)
+                {
+                    active_gate = dd.apply(
+                        dd.apply(make_level(var_id, off_weights), blockIdentity[var_id + 1], qmdd::edge_op_kro),
+                        dd.apply(make_level(var_id, on_weights), active_gate, qmdd::edge_op_kro),
+                        qmdd::edge_op_add);
+                }
+                else
+                {
+                    active_gate = dd.apply(make_level(var_id, identity_weights), active_gate, qmdd::edge_op_kro);
+                }
+            }
+        }
+
+        return active_gate;
+    }
+
+    // the matrix of a multi_target gate, from its operands.
+    // built bottom-up as active + inactive, where active has the controls on and the base gates on the targets,
+    // and inactive has at least one control off and the identity everywhere else.
+    edge build_multi_target(const int* first_operand, const int* last_operand)
+    {
+        static const weight_handle weight_0_handle = qmdd::weight_0_handle;
+        static const weight_handle weight_1_handle = qmdd::weight_1_handle;
+
+        node_handle true_node = dd.get_true();
+
+        int num_controls = first_operand[0];
+        const int* first_control = first_operand + 1;
+        const int* first_target = first_control + num_controls;
+        const int* next_control = first_target - 1;
+        const int* next_target = last_operand - 2;
+
+        assert(last_operand - first_target >= 2);
+
+        edge active_gate = edge(weight_1_handle, true_node);
+        edge inactive_gate = edge(weight_0_handle, true_node);
+
+        for (int var_id = block_end_var - 1; var_id >= block_first_var; var_id--)
+        {
+            if (next_control >= first_control && operand_var_id(*next_control) == var_id)
+            {
+                const weight_handle* on_weights = if_true_weights;
+                const weight_handle* off_weights = if_false_weights;
+                if (is_negated_control(*next_control))
+                {
+                    std::swap(on_weights, off_weights);
+                }
+                next_control -= 1;
+
+                inactive_gate = dd.apply(
+                    dd.apply(make_level(var_id, off_weights), blockIdentity[var_id + 1], qmdd::edge_op_kro),
+                    dd.apply(make_level(var_id, on_weights), inactive_gate, qmdd::edge_op_kro),
+                    qmdd::edge_op_add);
+                active_gate = dd.apply(make_level(var_id, on_weights), active_gate, qmdd::edge_op_kro);
+            }
+            else if (next_target >= first_target && next_target[1] == var_id)
+            {
+                const weight_handle* gate_weights = get_gate_weights((gate_opcode)next_target[0]);
+                next_target -= 2;
+
+                active_gate = dd.apply(make_level(var_id, gate_weights), active_gate, qmdd::edge_op_kro);
+                inactive_gate = dd.apply(make_level(var_id, identity_weights), inactive_gate, qmdd::edge_op_kro);
+            }
+            else
+            {
+                active_gate = dd.apply(make_level(var_id, identity_weights), active_gate, qmdd::edge_op_kro);
+                inactive_gate = dd.apply(make_level(var_id, identity_weights), inactive_gate, qmdd::edge_op_kro);
+            }
+        }
+
+        return dd.apply(active_gate, inactive_gate, qmdd::edge_op_add);
+    }
+
+    // the matrix of a whole instruction of a gate stream, including micro-coded gates.
+    edge build_instruction(const int* instr);
+
+    // the matrix of an instruction over only the variables [first_var, end_var), which must include every variable it acts on.
+    // the terminal is right below end_var, so the result can be composed with the levels below it by a kronecker product.
+    edge build_block(const int* instr, int first_var, int end_var)
+    {
+        block_first_var = first_var;
+        block_end_var = end_var;
+        blockIdentity[end_var] = edge(qmdd::weight_1_handle, dd.get_true());
+        for (int var_id = end_var - 1; var_id >= first_var; var_id--)
+        {
+            blockIdentity[var_id] = dd.apply(make_level(var_id, identity_weights), blockIdentity[var_id + 1], qmdd::edge_op_kro);
+        }
+
+        edge block;
+        try
+        {
+            block = build_instruction(instr);
+        }
+        catch (...)
+        {
+            block_first_var = 0;
+            block_end_var = num_variables;
+            blockIdentity = identitySubtree;
+            throw;
+        }
+
+        block_first_var = 0;
+        block_end_var = num_variables;
+        blockIdentity = identitySubtree;
+
+        return block;
+    }
+
+    struct placed_block
+    {
+        int first_var;
+        int end_var;
+        edge matrix;
+    };
+
+    // the kronecker product of matrices over disjoint ranges of variables, in variable order, with identity levels between them.
+    // each matrix is over the variables [first_var, end_var), with the terminal below end_var, as build_block() makes them.
+    edge compose_layer(const std::vector<placed_block>& blocks)
+    {
+        // the blocks are composed from the last one up
+        edge layer = edge(qmdd::weight_1_handle, dd.get_true());
+        int end_var = num_variables;
+        for (auto block = blocks.rbegin(); block != blocks.rend(); ++block)
+        {
+            assert(block->end_var <= end_var);
+
+            for (int var_id = end_var - 1; var_id >= block->end_var; var_id--)
+            {
+                layer = dd.apply(make_level(var_id, identity_weights), layer, qmdd::edge_op_kro);
+            }
+
+            layer = dd.apply(block->matrix, layer, qmdd::edge_op_kro);
+            end_var = block->first_var;
+        }
+
+        for (int var_id = end_var - 1; var_id >= 0; var_id--)
+        {
+            layer = dd.apply(make_level(var_id, identity_weights), layer, qmdd::edge_op_kro);
+        }
+
+        return layer;
+    }
+
+    // the matrix of a layer instruction: the kronecker product of the blocks of its gates, with identity levels between them.
+    edge build_layer(const int* first_param, const int* last_param)
+    {
+        std::vector<placed_block> blocks;
+        for (const int* inner = first_param; inner < last_param; inner += 2 + inner[1])
+        {
+            int first_var, last_var;
+            get_instruction_span(inner, &first_var, &last_var);
+            blocks.push_back(placed_block{ first_var, last_var + 1, build_block(inner, first_var, last_var + 1) });
+        }
+
+        return compose_layer(blocks);
+    }
+};
+
+// appends the toffolis that implement a fredkin gate with the given parameters.
+// the last two parameters are swapped, the others are controls in variable order.
+void append_fredkin_microcode(const int* first_param, const int* last_param, std::vector<int>* microcode)
+{
+    assert(last_param - first_param >= 2);
+
+    int swap_b_var_id = *(last_param - 1);
+    int swap_a_var_id = *(last_param - 2);
+    int num_controls = (int)(last_param - first_param) - 2;
+
+    microcode->push_back((int)gate_opcode::toffoli);
+    microcode->push_back(2);
+    microcode->push_back(swap_b_var_id);
+    microcode->push_back(swap_a_var_id);
+
+    microcode->push_back((int)gate_opcode::toffoli);
+    microcode->push_back(2 + num_controls);
+    size_t first_control_i = microcode->size();
+    for (int control_idx = 0; control_idx < num_controls; control_idx++)
+    {
+        microcode->push_back(first_param[control_idx]);
+    }
+    microcode->push_back(swap_a_var_id);
+
+    // swap_a becomes a control, which can be anywhere among the others
+    std::sort(microcode->begin() + first_control_i, microcode->end(), operand_var_less);
+
+    microcode->push_back(swap_b_var_id);
+
+    microcode->push_back((int)gate_opcode::toffoli);
+    microcode->push_back(2);
+    microcode->push_back(swap_b_var_id);
+    microcode->push_back(swap_a_var_id);
+}
+
+// appends the toffolis that implement a peres gate with the given parameters, in the order they're applied.
+// the last parameter t and the one before it b are targets, the others are controls c in variable order.
+// a peres gate flips t if c and b are all true, then flips b if c are all true. the inverse does it the other way around.
+void append_peres_microcode(const int* first_param, const int* last_param, bool inverse, std::vector<int>* microcode)
+{
+    assert(last_param - first_param >= 3);
+
+    int t_var_id = *(last_param - 1);
+    int b_var_id = *(last_param - 2);
+    int num_controls = (int)(last_param - first_param) - 2;
+
+    std::vector<int> flip_t;
+    flip_t.push_back((int)gate_opcode::toffoli);
+    flip_t.push_back(2 + num_controls);
+    flip_t.insert(end(flip_t), first_param, first_param + num_controls);
+    flip_t.push_back(b_var_id);
+    std::sort(flip_t.begin() + 2, flip_t.end(), operand_var_less);
+    flip_t.push_back(t_var_id);
+
+    std::vector<int> flip_b;
+    flip_b.push_back((int)gate_opcode::toffoli);
+    flip_b.push_back(1 + num_controls);
+    flip_b.insert(end(flip_b), first_param, first_param + num_controls);
+    flip_b.push_back(b_var_id);
+
+    const std::vector<int>& first = inverse ? flip_b : flip_t;
+    const std::vector<int>& second = inverse ? flip_t : flip_b;
+    microcode->insert(microcode->end(), begin(first), end(first));
+    microcode->insert(microcode->end(), begin(second), end(second));
+}
+
+gate_builder::edge gate_builder::build_instruction(const int* instr)
+{
+    gate_opcode opcode = (gate_opcode)instr[0];
+    const int* first_param = instr + 2;
+    const int* last_param = first_param + instr[1];
+
+    std::vector<int> microcode;
+    if (opcode == gate_opcode::fredkin)
+    {
+        append_fredkin_microcode(first_param, last_param, &microcode);
+    }
+    else if (opcode == gate_opcode::peres || opcode == gate_opcode::inv_peres)
+    {
+        append_peres_microcode(first_param, last_param, opcode == gate_opcode::inv_peres, &microcode);
+    }
+    else if (opcode == gate_opcode::multi_target)
+    {
+        return build_multi_target(first_param, last_param);
+    }
+    else if (opcode == gate_opcode::layer)
+    {
+        return build_layer(first_param, last_param);
+    }
+    else if (opcode == gate_opcode::diagonal_batch || opcode == gate_opcode::sequence)
+    {
+        // the product of a diagonal batch stays diagonal, so the multiplies only recurse into diagonal quadrants
+        edge product = blockIdentity[block_first_var];
+        for (const int* batched = first_param; batched < last_param; batched += 2 + batched[1])
+        {
+            product = dd.apply(build_instruction(batched), product, qmdd::edge_op_mul);
+        }
+        return product;
+    }
+    else if (has_angle_operand(opcode))
+    {
+        weight_handle gate_weights[p * p];
+        get_rotation_weights(opcode, angle_operand(first_param), gate_weights);
+        return build_controlled(gate_weights, first_param + angle_operand_count, last_param);
+    }
+    else
+    {
+        return build(opcode, first_param, last_param);
+    }
+
+    edge product = blockIdentity[block_first_var];
+    for (size_t offset = 0; offset < microcode.size(); offset += 2 + microcode[offset + 1])
+    {
+        const int* micro_first_param = &microcode[offset + 2];
+        edge gate = build((gate_opcode)microcode[offset], micro_first_param, micro_first_param + microcode[offset + 1]);
+        product = dd.apply(gate, product, qmdd::edge_op_mul);
+    }
+
+    return product;
+}
+
+#ifdef SHOW_INSTRS
+const char* gate_name(gate_opcode opcode)
+{
+    return
+        opcode == gate_opcode::toffoli ? "t" :
+        opcode == gate_opcode::fredkin ? "f" :
+        opcode == gate_opcode::pauli_y ? "y" :
+        opcode == gate_opcode::pauli_z ? "z" :
+        opcode == gate_opcode::sqrtnot ? "v" :
+        opcode == gate_opcode::inv_sqrtnot ? "v\'" :
+        opcode == gate_opcode::hadamard ? "h" :
+        opcode == gate_opcode::rotate_pi_by_4 ? "q" :
+        opcode == gate_opcode::inv_rotate_pi_by_4 ? "q\'" :
+        opcode == gate_opcode::rotate_pi_by_2 ? "s" :
+        opcode == gate_opcode::inv_rotate_pi_by_2 ? "s\'" :
+        opcode == gate_opcode::peres ? "p" :
+        opcode == gate_opcode::inv_peres ? "p\'" :
+        opcode == gate_opcode::multi_target ? "m" :
+        opcode == gate_opcode::rotate_z ? "rz" :
+        opcode == gate_opcode::rotate_y ? "ry" :
+        opcode == gate_opcode::phase ? "ph" :
+        "?";
+}
+
+void print_operand(const program_spec& spec, int operand)
+{
+    printf("%s%s", is_negated_control(operand) ? "-" : "", spec.variable_names[operand_var_id(operand)].c_str());
+}
+
+void print_gate(const program_spec& spec, const int* instr, bool is_microcode)
+{
+    gate_opcode opcode = (gate_opcode)instr[0];
+    int param_count = instr[1];
+    const int* first_param = instr + 2;
+    const int* last_param = first_param + param_count;
+
+    if (is_microcode)
+    {
+        printf("(microcode) ");
+    }
+
+    if (opcode == gate_opcode::diagonal_batch || opcode == gate_opcode::layer || opcode == gate_opcode::sequence)
+    {
+        for (const int* batched = first_param; batched < last_param; batched += 2 + batched[1])
+        {
+            printf(opcode == gate_opcode::layer ? "(layer) " : opcode == gate_opcode::sequence ? "(block) " : "(batched) ");
+            print_gate(spec, batched, false);
+        }
+        return;
+    }
+
+    if (opcode == gate_opcode::multi_target)
+    {
+        // printed as "m<controls>,<targets> controls: gate target, gate target, ..."
+        int num_controls = first_param[0];
+        const int* first_target = first_param + 1 + num_controls;
+        printf("m%d,%d ", num_controls, (int)(last_param - first_target) / 2);
+        for (const int* control = first_param + 1; control < first_target; control++)
+        {
+            if (control != first_param + 1)
+            {
+                printf(",");
+            }
+            print_operand(spec, *control);
+        }
+        printf(":");
+        for (const int* target = first_target; target < last_param; target += 2)
+        {
+            printf(target == first_target ? " %s " : ", %s ", gate_name((gate_opcode)target[0]));
+            print_operand(spec, target[1]);
+        }
+        printf("\n");
+        return;
+    }
+
+    if (has_angle_operand(opcode))
+    {
+        // printed as "rz<operand count>(<angle>) controls,target"
+        printf("%s%d(%g) ", gate_name(opcode), param_count - angle_operand_count, angle_operand(first_param));
+        first_param += angle_operand_count;
+    }
+    else
+    {
+        printf("%s%d ", gate_name(opcode), param_count);
+    }
+    for (const int* param = first_param; param < last_param; param++)
+    {
+        if (param != first_param)
+        {
+            printf(",");
+        }
+        print_operand(spec, *param);
+    }
+    printf("\n");
+}
+#endif
+
+// supplies the top-level instructions of a gate stream to decode.
+class gate_source
+{
+public:
+    virtual ~gate_source() = default;
+
+    // the next instruction, in the encoding of program_spec::gate_stream, or NULL after the last one.
+    // the instruction stays valid until the next call.
+    virtual const int* next_gate() = 0;
+
+    // the position in the gate stream of the instruction that next_gate() returns next.
+    virtual int offset() const = 0;
+
+    // continues from the instruction at the given position of the gate stream.
+    virtual void seek(int)
+    {
+        throw std::logic_error("gate source can't seek");
+    }
+
+    // if the matrix of the last instruction was already built, copies it into dd.
+    virtual bool take_prebuilt(qmdd&, qmdd::edge*)
+    {
+        return false;
+    }
+
+    // the number of gates of the program that the last instruction stands for.
+    virtual int last_gate_count() const
+    {
+        return 1;
+    }
+
+    // called when the reader won't read any more gates, so a next_gate() blocked on another thread can return.
+    virtual void stop()
+    { }
+
+    // called before next_gate() with the product of the gates read so far.
+    virtual void observe_product(qmdd&, const qmdd::edge&)
+    { }
+};
+
+// reads the gates of a parsed program
+class spec_gate_source : public gate_source
+{
+    const program_spec& spec;
+    int curr_offset = 0;
+
+public:
+    explicit spec_gate_source(const program_spec& spec)
+        : spec(spec)
+    { }
+
+    const int* next_gate() override
+    {
+        if (curr_offset == (int)spec.gate_stream.size())
+        {
+            return NULL;
+        }
+
+        const int* instr = &spec.gate_stream[curr_offset];
+        curr_offset += 2 + instr[1];
+        return instr;
+    }
+
+    int offset() const override
+    {
+        return curr_offset;
+    }
+
+    void seek(int offset) override
+    {
+        assert(offset >= 0 && offset <= (int)spec.gate_stream.size());
+        curr_offset = offset;
+    }
+};
+
+// reads ahead of upstream to group runs of consecutive instructions into one instruction,
+// so that each run is applied with a single multiply.
+class grouping_gate_source : public gate_source
+{
+    gate_source& upstream;
+
+    // the instruction read ahead of the run that was returned last
+    std::vector<int> pending;
+    int pending_offset = 0;
+    int pending_gate_count = 0;
+    bool has_pending = false;
+
+    std::vector<int> grouped;
+    int run_gate_count = 0;
+
+protected:
+    // the instructions of the current run, one after another
+    std::vector<int> run;
+    int run_length = 0;
+
+    // whether a run can start with instr
+    virtual bool starts_run(const int* instr) const = 0;
+
+    // whether instr can be added to the current run
+    virtual bool extends_run(const int* instr) const = 0;
+
+    // writes the instruction for a run of more than one instruction
+    virtual void group_run(std::vector<int>* grouped) const = 0;
+
+public:
+    explicit grouping_gate_source(gate_source& upstream)
+        : upstream(upstream)
+    { }
+
+    const int* next_gate() override
+    {
+        if (!has_pending)
+        {
+            pending_offset = upstream.offset();
+            const int* instr = upstream.next_gate();
+            if (!instr)
+            {
+                return NULL;
+            }
+            pending.assign(instr, instr + 2 + instr[1]);
+            pending_gate_count = upstream.last_gate_count();
+        }
+
+        has_pending = false;
+        run.swap(pending);
+        run_length = 1;
+        run_gate_count = pending_gate_count;
+
+        if (!starts_run(run.data()))
+        {
+            return run.data();
+        }
+
+        for (;;)
+        {
+            int next_offset = upstream.offset();
+            const int* instr = upstream.next_gate();
+            if (!instr)
+            {
+                break;
+            }
+
+            if (!extends_run(instr))
+            {
+                pending.assign(instr, instr + 2 + instr[1]);
+                pending_offset = next_offset;
+                pending_gate_count = upstream.last_gate_count();
+                has_pending = true;
+                break;
+            }
+
+            run.insert(run.end(), instr, instr + 2 + instr[1]);
+            run_length += 1;
+            run_gate_count += upstream.last_gate_count();
+        }
+
+        if (run_length == 1)
+        {
+            return run.data();
+        }
+
+        grouped.clear();
+        group_run(&grouped);
+        return grouped.data();
+    }
+
+    int offset() const override
+    {
+        return has_pending ? pending_offset : upstream.offset();
+    }
+
+    void seek(int offset) override
+    {
+        has_pending = false;
+        upstream.seek(offset);
+    }
+
+    int last_gate_count() const override
+    {
+        return run_gate_count;
+    }
+
+    void stop() override
+    {
+        upstream.stop();
+    }
+};
+
+// groups runs of consecutive gates that have the same controls and different targets into one multi_target gate.
+// gates with their own microcode and rotations are passed through as they are.
+class fusing_gate_source : public grouping_gate_source
+{
+    bool starts_run(const int* instr) const override
+    {
+        gate_opcode opcode = (gate_opcode)instr[0];
+        return opcode != gate_opcode::fredkin &&
+            opcode != gate_opcode::peres &&
+            opcode != gate_opcode::inv_peres &&
+            opcode != gate_opcode::multi_target &&
+            !has_angle_operand(opcode);
+    }
+
+    // whether instr has the controls of the run and a target that isn't in the run yet
+    bool extends_run(const int* instr) const override
+    {
+        if (!starts_run(instr) || instr[1] != run[1])
+        {
+            return false;
+        }
+
+        int num_controls = run[1] - 1;
+        if (!std::equal(instr + 2, instr + 2 + num_controls, run.begin() + 2))
+        {
+            return false;
+        }
+
+        // every gate of the run has the size of the first one
+        int target = instr[2 + num_controls];
+        for (size_t i = 2 + num_controls; i < run.size(); i += 2 + run[1])
+        {
+            if (run[i] == target)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void group_run(std::vector<int>* fused) const override
+    {
+        int num_controls = run[1] - 1;
+        int gate_size = 2 + run[1];
+
+        std::vector<std::pair<int, int>> targets;
+        for (size_t i = 0; i < run.size(); i += gate_size)
+        {
+            targets.emplace_back(operand_var_id(run[i + 2 + num_controls]), run[i]);
+        }
+        std::sort(targets.begin(), targets.end());
+
+        fused->push_back((int)gate_opcode::multi_target);
+        fused->push_back(1 + num_controls + 2 * (int)targets.size());
+        fused->push_back(num_controls);
+        fused->insert(fused->end(), run.begin() + 2, run.begin() + 2 + num_controls);
+        for (const std::pair<int, int>& target : targets)
+        {
+            fused->push_back(target.second);
+            fused->push_back(target.first);
+        }
+    }
+
+public:
+    using grouping_gate_source::grouping_gate_source;
+};
+
+// groups runs of consecutive diagonal gates into one diagonal_batch instruction.
+// diagonal gates commute, and their product only has diagonal quadrants, so it's cheap to build.
+class diagonal_batching_gate_source : public grouping_gate_source
+{
+    static bool is_diagonal(gate_opcode opcode)
+    {
+        return opcode == gate_opcode::pauli_z ||
+            opcode == gate_opcode::rotate_pi_by_4 ||
+            opcode == gate_opcode::inv_rotate_pi_by_4 ||
+            opcode == gate_opcode::rotate_pi_by_2 ||
+            opcode == gate_opcode::inv_rotate_pi_by_2 ||
+            opcode == gate_opcode::rotate_z ||
+            opcode == gate_opcode::phase;
+    }
+
+    bool starts_run(const int* instr) const override
+    {
+        gate_opcode opcode = (gate_opcode)instr[0];
+        if (opcode != gate_opcode::multi_target)
+        {
+            return is_diagonal(opcode);
+        }
+
+        // a multi_target gate is diagonal if all its base gates are
+        const int* first_target = instr + 3 + instr[2];
+        for (const int* target = first_target; target < instr + 2 + instr[1]; target += 2)
+        {
+            if (!is_diagonal((gate_opcode)target[0]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool extends_run(const int* instr) const override
+    {
+        return starts_run(instr);
+    }
+
+    void group_run(std::vector<int>* batch) const override
+    {
+        batch->push_back((int)gate_opcode::diagonal_batch);
+        batch->push_back((int)run.size());
+        batch->insert(batch->end(), run.begin(), run.end());
+    }
+
+public:
+    using grouping_gate_source::grouping_gate_source;
+};
+
+// schedules gates into ASAP layers. each gate goes into the first layer after the last gate that overlaps its span of variables,
+// and each layer is applied with a single multiply. gates only move past gates on other variables, so the product is the same.
+// at most window gates are held at once. a gate whose layer was already returned goes into the next layer instead.
+// gates are reordered, so the offsets aren't positions in the gate stream and can't be used for checkpoints.
+class layering_gate_source : public gate_source
+{
+    struct pending_layer
+    {
+        // the first variable of each gate, and the gate
+        std::vector<std::pair<int, std::vector<int>>> gates;
+        int gate_count = 0;
+    };
+
+    gate_source& upstream;
+    int window;
+
+    // layers.front() is layer number first_layer
+    std::deque<pending_layer> layers;
+    int64_t first_layer = 0;
+    int num_buffered = 0;
+    bool upstream_done = false;
+
+    // the layer of the last gate over each variable
+    std::vector<int64_t> last_layer;
+
+    std::vector<int> current;
+    int current_gate_count = 0;
+
+public:
+    layering_gate_source(gate_source& upstream, int num_variables, int window)
+        : upstream(upstream), window(window), last_layer(num_variables, -1)
+    {
+        assert(window >= 1);
+    }
+
+    const int* next_gate() override
+    {
+        while (!upstream_done && num_buffered < window)
+        {
+            const int* instr = upstream.next_gate();
+            if (!instr)
+            {
+                upstream_done = true;
+                break;
+            }
+
+            int first_var, last_var;
+            get_instruction_span(instr, &first_var, &last_var);
+
+            int64_t layer_number = first_layer;
+            for (int var_id = first_var; var_id <= last_var; var_id++)
+            {
+                layer_number = std::max(layer_number, last_layer[var_id] + 1);
+            }
+            for (int var_id = first_var; var_id <= last_var; var_id++)
+            {
+                last_layer[var_id] = layer_number;
+            }
+
+            while ((int64_t)layers.size() <= layer_number - first_layer)
+            {
+                layers.emplace_back();
+            }
+
+            pending_layer& layer = layers[size_t(layer_number - first_layer)];
+            layer.gates.emplace_back(first_var, std::vector<int>(instr, instr + 2 + instr[1]));
+            layer.gate_count += upstream.last_gate_count();
+            num_buffered += 1;
+        }
+
+        if (layers.empty())
+        {
+            return NULL;
+        }
+
+        pending_layer layer = std::move(layers.front());
+        layers.pop_front();
+        first_layer += 1;
+        num_buffered -= (int)layer.gates.size();
+        current_gate_count = layer.gate_count;
+
+        if (layer.gates.size() == 1)
+        {
+            current.swap(layer.gates[0].second);
+            return current.data();
+        }
+
+        std::sort(layer.gates.begin(), layer.gates.end(), [](const std::pair<int, std::vector<int>>& a, const std::pair<int, std::vector<int>>& b)
+        {
+            return a.first < b.first;
+        });
+
+        current.clear();
+        current.push_back((int)gate_opcode::layer);
+        current.push_back(0);
+        for (const std::pair<int, std::vector<int>>& gate : layer.gates)
+        {
+            current.insert(current.end(), gate.second.begin(), gate.second.end());
+        }
+        current[1] = (int)current.size() - 2;
+
+        return current.data();
+    }
+
+    int offset() const override
+    {
+        return upstream.offset();
+    }
+
+    int last_gate_count() const override
+    {
+        return current_gate_count;
+    }
+
+    void stop() override
+    {
+        upstream.stop();
+    }
+};
+
+// picks the order of commuting gates to keep the product small.
+// a gate depends on every earlier gate it doesn't commute with, which makes a DAG over the gates held at once.
+// two gates commute if every variable they share is a control or a diagonal target in both.
+// of the gates whose dependencies were all returned, the first few in stream order are each multiplied into the product,
+// and the one that gives the fewest live nodes is returned. ties go to the earliest gate, so with one gate ready this is stream order.
+// gates are reordered, so the offsets aren't positions in the gate stream and can't be used for checkpoints.
+class scheduling_gate_source : public gate_source
+{
+    struct scheduled_gate
+    {
+        std::vector<int> instr;
+        int gate_count;
+
+        // the variables the gate acts on, with true for the ones it acts on diagonally
+        std::vector<std::pair<int, bool>> actions;
+
+        // number of earlier gates it depends on that weren't returned yet, and the later gates that depend on it
+        int num_dependencies = 0;
+        std::vector<uint64_t> dependents;
+    };
+
+    gate_source& upstream;
+    int window;
+    int num_candidates;
+
+    // gates by number in stream order. gates.front() is gate number first_gate, returned gates are null.
+    std::deque<std::unique_ptr<scheduled_gate>> gates;
+    uint64_t first_gate = 0;
+    int num_buffered = 0;
+    bool upstream_done = false;
+
+    std::unique_ptr<gate_builder> builder;
+    qmdd* product_dd = NULL;
+    qmdd::edge product;
+
+    std::unique_ptr<scheduled_gate> current;
+    qmdd::edge current_gate;
+    bool current_built = false;
+
+    static bool is_diagonal(gate_opcode opcode)
+    {
+        return opcode == gate_opcode::pauli_z ||
+            opcode == gate_opcode::rotate_pi_by_4 ||
+            opcode == gate_opcode::inv_rotate_pi_by_4 ||
+            opcode == gate_opcode::rotate_pi_by_2 ||
+            opcode == gate_opcode::inv_rotate_pi_by_2 ||
+            opcode == gate_opcode::rotate_z ||
+            opcode == gate_opcode::phase;
+    }
+
+    static void get_actions(const int* instr, std::vector<std::pair<int, bool>>* actions)
+    {
+        gate_opcode opcode = (gate_opcode)instr[0];
+        const int* first_param = instr + 2;
+        const int* last_param = first_param + instr[1];
+
+        if (opcode == gate_opcode::diagonal_batch)
+        {
+            for (const int* inner = first_param; inner < last_param; inner += 2 + inner[1])
+            {
+                get_actions(inner, actions);
+            }
+            for (std::pair<int, bool>& action : *actions)
+            {
+                action.second = true;
+            }
+        }
+        else if (opcode == gate_opcode::layer)
+        {
+            for (const int* inner = first_param; inner < last_param; inner += 2 + inner[1])
+            {
+                get_actions(inner, actions);
+            }
+        }
+        else if (opcode == gate_opcode::multi_target)
+        {
+            const int* first_target = first_param + 1 + first_param[0];
+            for (const int* control = first_param + 1; control < first_target; control++)
+            {
+                actions->emplace_back(operand_var_id(*control), true);
+            }
+            for (const int* target = first_target; target < last_param; target += 2)
+            {
+                actions->emplace_back(target[1], is_diagonal((gate_opcode)target[0]));
+            }
+        }
+        else
+        {
+            if (has_angle_operand(opcode))
+            {
+                first_param += angle_operand_count;
+            }
+
+            int num_targets = opcode == gate_opcode::fredkin || opcode == gate_opcode::peres || opcode == gate_opcode::inv_peres ? 2 : 1;
+            for (const int* param = first_param; param < last_param; param++)
+            {
+                bool is_control = param < last_param - num_targets;
+                actions->emplace_back(operand_var_id(*param), is_control || is_diagonal(opcode));
+            }
+        }
+    }
+
+    static bool commutes(const scheduled_gate& gate0, const scheduled_gate& gate1)
+    {
+        for (const std::pair<int, bool>& action0 : gate0.actions)
+        {
+            for (const std::pair<int, bool>& action1 : gate1.actions)
+            {
+                if (action0.first == action1.first && !(action0.second && action1.second))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void fill()
+    {
+        while (!upstream_done && num_buffered < window)
+        {
+            const int* instr = upstream.next_gate();
+            if (!instr)
+            {
+                upstream_done = true;
+                break;
+            }
+
+            std::unique_ptr<scheduled_gate> gate(new scheduled_gate);
+            gate->instr.assign(instr, instr + 2 + instr[1]);
+            gate->gate_count = upstream.last_gate_count();
+            get_actions(instr, &gate->actions);
+
+            uint64_t number = first_gate + gates.size();
+            for (std::unique_ptr<scheduled_gate>& earlier : gates)
+            {
+                if (earlier && !commutes(*earlier, *gate))
+                {
+                    earlier->dependents.push_back(number);
+                    gate->num_dependencies += 1;
+                }
+            }
+
+            gates.push_back(std::move(gate));
+            num_buffered += 1;
+        }
+    }
+
+public:
+    // window is the most gates held at once, and num_candidates the most ready gates tried against the product.
+    scheduling_gate_source(gate_source& upstream, int window, int num_candidates)
+        : upstream(upstream), window(window), num_candidates(num_candidates)
+    {
+        assert(window >= 1 && num_candidates >= 1);
+    }
+
+    void observe_product(qmdd& dd, const qmdd::edge& root) override
+    {
+        if (product_dd != &dd)
+        {
+            builder.reset(new gate_builder(dd));
+            product_dd = &dd;
+        }
+        product = root;
+    }
+
+    const int* next_gate() override
+    {
+        fill();
+
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < gates.size() && (int)ready.size() < num_candidates; i++)
+        {
+            if (gates[i] && gates[i]->num_dependencies == 0)
+            {
+                ready.push_back(i);
+            }
+        }
+
+        if (ready.empty())
+        {
+            return NULL;
+        }
+
+        // without the product, or with one ready gate, the gates stay in stream order
+        size_t best = ready[0];
+        current_built = false;
+        if (ready.size() > 1 && product_dd)
+        {
+            uint32_t best_cost = UINT32_MAX;
+            for (size_t i : ready)
+            {
+                qmdd::edge gate = builder->build_instruction(gates[i]->instr.data());
+                uint32_t cost = product_dd->count_live_nodes(product_dd->apply(gate, product, qmdd::edge_op_mul));
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best = i;
+                    current_gate = gate;
+                }
+            }
+            current_built = true;
+        }
+
+        current = std::move(gates[best]);
+        num_buffered -= 1;
+        for (uint64_t dependent : current->dependents)
+        {
+            gates[size_t(dependent - first_gate)]->num_dependencies -= 1;
+        }
+
+        while (!gates.empty() && !gates.front())
+        {
+            gates.pop_front();
+            first_gate += 1;
+        }
+
+        return current->instr.data();
+    }
+
+    int offset() const override
+    {
+        return upstream.offset();
+    }
+
+    bool take_prebuilt(qmdd& dd, qmdd::edge* gate_out) override
+    {
+        // the multiply with the product that picked the gate is still in the computed table
+        if (!current_built || &dd != product_dd)
+        {
+            return false;
+        }
+        *gate_out = current_gate;
+        return true;
+    }
+
+    int last_gate_count() const override
+    {
+        return current->gate_count;
+    }
+
+    void stop() override
+    {
+        upstream.stop();
+    }
+};
+
+// if decoding is stopped by a budget, root_out receives the product of all gates before the stopping gate.
+// spec only needs the gates of the program if checkpoints are used.
+void decode(const program_spec& spec, qmdd& dd, const decode_options& options, gate_source& source, qmdd::edge* root_out, decode_report* report_out)
+{
+    using weight_handle = qmdd::weight_handle;
+    using edge = qmdd::edge;
+
+    static const int p = qmdd::p;
+    static const weight_handle weight_0_handle = qmdd::weight_0_handle;
+    static const weight_handle weight_1_handle = qmdd::weight_1_handle;
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    auto elapsed_seconds = [&start_time]()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    };
+
+    gate_builder builder(dd);
+
+    dd.set_budget(options.max_nodes, options.max_weights);
+
+    edge root = builder.identity();
+
+    // maps every value of a garbage output to 0, merging the rows that only differ in garbage
+    edge discard_garbage = edge(weight_1_handle, dd.get_true());
+
+    if (options.reduce_ancillas)
+    {
+        const weight_handle* identity_weights = builder.get_identity_weights();
+
+        weight_handle discard_weights[p * p];
+        for (int i = 0; i < p * p; i++)
+        {
+            discard_weights[i] = i < p ? weight_1_handle : weight_0_handle;
+        }
+
+        // project the constant inputs onto their values, so only the columns of those values are nonzero.
+        // the zero columns collapse to single edges, which keeps the intermediate products small.
+        root = edge(weight_1_handle, dd.get_true());
+        for (int var_id = spec.num_variables - 1; var_id >= 0; var_id--)
+        {
+            int constant = spec.variable_constant_input[var_id];
+            if (constant >= p)
+            {
+                throw std::runtime_error("constant input value of " + spec.variable_names[var_id] + " is out of range");
+            }
+
+            const weight_handle* input_weights = identity_weights;
+            weight_handle projection_weights[p * p];
+            if (constant != -1)
+            {
+                for (int i = 0; i < p * p; i++)
+                {
+                    projection_weights[i] = i == constant * p + constant ? weight_1_handle : weight_0_handle;
+                }
+                input_weights = projection_weights;
+            }
+
+            root = dd.apply(builder.make_level(var_id, input_weights), root, qmdd::edge_op_kro);
+
+            const weight_handle* output_weights = spec.variable_output_list_index[var_id] == -1 ? discard_weights : identity_weights;
+            discard_garbage = dd.apply(builder.make_level(var_id, output_weights), discard_garbage, qmdd::edge_op_kro);
+        }
+    }
+
+    struct gate_stream_view
+    {
+        const int* stream;
+        int size;
+        int offset;
+    };
+
+    // stack of gate streams to execute.
+    // this is useful to implement "micro-coded" gates.
+    // the bottom of the stack is the current top-level instruction.
+    std::vector<gate_stream_view> gate_streams;
+
+    // storage for microcode
+    std::vector<int> fredkin_microcode;
+
+    // prevents updates to gate_streams from invalidating pointers...
+    auto curr_stream = [&gate_streams]() -> gate_stream_view& { return gate_streams.back(); };
+
+    // the product of all gates before the current top-level gate.
+    // microcoded gates are only complete once their whole microcode has run.
+    edge gate_start_root = root;
+    int gate_index = 0;
+    int gate_offset = source.offset();
+
+    int resumed_gate_index = -1;
+    if (options.resume && !options.checkpoint_file.empty())
+    {
+        int resume_offset;
+        if (read_checkpoint(spec, checkpoint_fingerprint(spec, options), dd, &root, &resumed_gate_index, &resume_offset, options.checkpoint_file))
+        {
+            gate_index = resumed_gate_index;
+            source.seek(resume_offset);
+        }
+    }
+
+    int last_checkpoint_gate_index = gate_index;
+    double last_checkpoint_seconds = elapsed_seconds();
+
+    bool completed = true;
+    std::string stop_reason;
+
+    uint32_t peak_live_nodes = 0;
+
+    FILE* shape_trace = NULL;
+    if (!options.shape_trace_file.empty())
+    {
+        shape_trace = fopen(options.shape_trace_file.c_str(), "w");
+        if (!shape_trace)
+        {
+            throw std::runtime_error("failed to open " + options.shape_trace_file);
+        }
+    }
+
+    try
+    {
+        for (;;)
+        {
+            if (gate_streams.empty())
+            {
+                // between two top-level gates, root is the product of the first gate_index gates.
+                gate_start_root = root;
+                gate_offset = source.offset();
+
+                if (options.track_peak_live_nodes)
+                {
+                    peak_live_nodes = std::max(peak_live_nodes, dd.count_live_nodes(root));
+                }
+
+                source.observe_product(dd, root);
+                const int* instr = source.next_gate();
+                if (!instr)
+                {
+                    break;
+                }
+
+                dd.sample_memory();
+
+                if (shape_trace)
+                {
+                    write_shape_json(shape_trace, spec, analyze_shape(dd, root), gate_index);
+                }
+
+                if (options.max_bytes != 0 && dd.get_bytes_used() > options.max_bytes)
+                {
+                    throw budget_exceeded("memory budget of " + std::to_string(options.max_bytes) + " bytes exceeded");
+                }
+
+                if (options.max_seconds != 0.0 && elapsed_seconds() > options.max_seconds)
+                {
+                    throw budget_exceeded("time budget of " + std::to_string(options.max_seconds) + " seconds exceeded");
+                }
+
+                if (!options.checkpoint_file.empty())
+                {
+                    bool gates_due = options.checkpoint_gates != 0 && gate_index - last_checkpoint_gate_index >= options.checkpoint_gates;
+                    bool seconds_due = options.checkpoint_seconds != 0.0 && elapsed_seconds() - last_checkpoint_seconds >= options.checkpoint_seconds;
+                    if (gates_due || seconds_due)
+                    {
+                        write_checkpoint(spec, checkpoint_fingerprint(spec, options), dd, root, gate_index, gate_offset, options.checkpoint_file);
+                        last_checkpoint_gate_index = gate_index;
+                        last_checkpoint_seconds = elapsed_seconds();
+                    }
+                }
+
+                edge prebuilt_gate;
+                if (source.take_prebuilt(dd, &prebuilt_gate))
+                {
+#ifdef SHOW_INSTRS
+                    print_gate(spec, instr, false);
+#endif
+                    root = dd.apply(prebuilt_gate, root, qmdd::edge_op_mul);
+                    gate_index += source.last_gate_count();
+                    continue;
+                }
+
+                gate_streams.push_back(gate_stream_view{ instr, 2 + instr[1], 0 });
+            }
+
+            if (curr_stream().offset == curr_stream().size)
+            {
+                gate_streams.pop_back();
+                if (gate_streams.empty())
+                {
+                    gate_index += source.last_gate_count();
+                }
+                continue;
+            }
+
+            const int* instr = &curr_stream().stream[curr_stream().offset];
+
+            gate_opcode opcode = (gate_opcode)instr[0];
+            int param_count = instr[1];
+
+            const int* first_param = instr + 2;
+            const int* last_param = first_param + param_count;
+
+            curr_stream().offset += 2 + param_count;
+
+#ifdef SHOW_INSTRS
+            print_gate(spec, instr, gate_streams.size() > 1);
+#endif
+
+            switch (opcode)
+            {
+            case gate_opcode::fredkin:
+            {
+                fredkin_microcode.clear();
+                append_fredkin_microcode(first_param, last_param, &fredkin_microcode);
+
+                gate_streams.push_back(gate_stream_view{ fredkin_microcode.data(), (int)fredkin_microcode.size(), 0 });
+
+                break;
+            }
+            case gate_opcode::peres:
+            case gate_opcode::inv_peres:
+            case gate_opcode::multi_target:
+            case gate_opcode::rotate_z:
+            case gate_opcode::rotate_y:
+            case gate_opcode::phase:
+            case gate_opcode::diagonal_batch:
+            case gate_opcode::layer:
+            case gate_opcode::sequence:
+            {
+                // fused gates are built into one matrix, so they only take one multiply with root
+                root = dd.apply(builder.build_instruction(instr), root, qmdd::edge_op_mul);
+
+                break;
+            }
+            default:
+                root = dd.apply(builder.build(opcode, first_param, last_param), root, qmdd::edge_op_mul);
+                break;
+            }
+        }
+
+        if (options.reduce_ancillas)
+        {
+            gate_start_root = root;
+            root = dd.apply(discard_garbage, root, qmdd::edge_op_mul);
+        }
+
+        if (shape_trace)
+        {
+            write_shape_json(shape_trace, spec, analyze_shape(dd, root), gate_index);
+        }
+    }
+    catch (const budget_exceeded& e)
+    {
+        completed = false;
+        stop_reason = e.what();
+        root = gate_start_root;
+    }
+
+    if (shape_trace)
+    {
+        fclose(shape_trace);
+    }
+
+    if (root_out) *root_out = root;
+
+    if (report_out)
+    {
+        report_out->completed = completed;
+        report_out->stop_reason = stop_reason;
+        report_out->gate_index = gate_index;
+        report_out->gate_offset = gate_offset;
+        report_out->resumed_gate_index = resumed_gate_index;
+        report_out->num_nodes = dd.get_num_nodes();
+        report_out->num_weights = dd.get_num_weights();
+        report_out->bytes_used = dd.get_bytes_used();
+        report_out->seconds = elapsed_seconds();
+        report_out->memory = dd.get_memory_report();
+        report_out->live_nodes = dd.count_live_nodes(root);
+        report_out->peak_live_nodes = std::max(peak_live_nodes, options.track_peak_live_nodes ? report_out->live_nodes : 0);
+    }
+}
+
+void decode(const program_spec& spec, qmdd& dd, const decode_options& options, qmdd::edge* root_out, decode_report* report_out)
+{
+    spec_gate_source source(spec);
+    decode(spec, dd, options, source, root_out, report_out);
+}
+
+// waits a little longer every time a lock-free wait is retried
+void backoff(int* retries)
+{
+    if (*retries < 64)
+    {
+        std::this_thread::yield();
+    }
+    else
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    *retries += 1;
+}
+
+// a bounded lock-free queue of ints between one producer thread and one consumer thread.
+class spsc_ring
+{
+    std::unique_ptr<int[]> buffer;
+    uint32_t mask;
+
+    // only written by the consumer
+    alignas(64) std::atomic<uint64_t> head;
+
+    // only written by the producer
+    alignas(64) std::atomic<uint64_t> tail;
+
+    alignas(64) std::atomic<bool> closed;
+    std::atomic<bool> abandoned;
+
+public:
+    // capacity must be a power of two
+    explicit spsc_ring(uint32_t capacity)
+        : buffer(new int[capacity]), mask(capacity - 1), head(0), tail(0), closed(false), abandoned(false)
+    {
+        assert(capacity != 0 && (capacity & (capacity - 1)) == 0);
+    }
+
+    uint32_t capacity() const
+    {
+        return mask + 1;
+    }
+
+    // appends count values at once, waiting while the ring is full.
+    // returns false if the consumer abandoned the ring.
+    bool push(const int* values, uint32_t count)
+    {
+        assert(count <= capacity());
+
+        uint64_t t = tail.load(std::memory_order_relaxed);
+
+        int retries = 0;
+        while (t + count - head.load(std::memory_order_acquire) > capacity())
+        {
+            if (abandoned.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            backoff(&retries);
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            buffer[(t + i) & mask] = values[i];
+        }
+
+        tail.store(t + count, std::memory_order_release);
+        return true;
+    }
+
+    // called by the producer after the last push
+    void close()
+    {
+        closed.store(true, std::memory_order_release);
+    }
+
+    // removes count values at once, waiting until they are available.
+    // returns false if the ring was closed before they were pushed.
+    bool pop(int* values, uint32_t count)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+
+        int retries = 0;
+        while (tail.load(std::memory_order_acquire) - h < count)
+        {
+            if (closed.load(std::memory_order_acquire))
+            {
+                // every push happened before the close, so tail is final now
+                if (tail.load(std::memory_order_acquire) - h < count)
+                {
+                    return false;
+                }
+                break;
+            }
+            backoff(&retries);
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            values[i] = buffer[(h + i) & mask];
+        }
+
+        head.store(h + count, std::memory_order_release);
+        return true;
+    }
+
+    // called by the consumer when it stops reading, so the producer doesn't wait for space forever.
+    void abandon()
+    {
+        abandoned.store(true, std::memory_order_release);
+    }
+};
+
+// reads gate instructions pushed to a ring whole, as the parser emits them.
+class ring_gate_source : public gate_source
+{
+    spsc_ring& ring;
+    std::vector<int> instr;
+    int curr_offset = 0;
+
+public:
+    explicit ring_gate_source(spsc_ring& ring)
+        : ring(ring)
+    { }
+
+    const int* next_gate() override
+    {
+        int header[2];
+        if (!ring.pop(header, 2))
+        {
+            return NULL;
+        }
+
+        instr.resize(2 + header[1]);
+        instr[0] = header[0];
+        instr[1] = header[1];
+
+        if (!ring.pop(instr.data() + 2, header[1]))
+        {
+            throw std::logic_error("truncated gate instruction");
+        }
+
+        curr_offset += (int)instr.size();
+        return instr.data();
+    }
+
+    int offset() const override
+    {
+        return curr_offset;
+    }
+
+    void stop() override
+    {
+        // fails the parser's next push, which then closes the ring
+        ring.abandon();
+    }
+};
+
+// builds the matrices of the upcoming gates on worker threads, each with its own qmdd,
+// while the decoding thread multiplies the gates that are already built into the product.
+// the workers take turns reading the upstream source, so the upstream doesn't need to be thread-safe.
+class prebuilding_gate_source : public gate_source
+{
+    struct built_gate
+    {
+        std::vector<int> instr;
+        int gate_count = 1;
+        qmdd::exported_dd gate;
+        bool ready = false;
+    };
+
+    gate_source& upstream;
+    int num_variables;
+
+    // gates are numbered in stream order. gate n is built into slots[n % slots.size()],
+    // so at most slots.size() gates are fetched but not yet taken by the decoder.
+    std::vector<built_gate> slots;
+    uint64_t next_fetch = 0;
+    uint64_t next_take = 0;
+    bool upstream_done = false;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    // guards everything above except upstream
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    // held while reading upstream, which can block
+    std::mutex fetch_mutex;
+
+    built_gate current;
+    int curr_offset;
+
+    std::vector<std::thread> workers;
+
+    void run()
+    {
+        try
+        {
+            qmdd::storage_options storage;
+            storage.node_capacity = 0x10000;
+            while (storage.node_capacity < 0x80000000u && storage.node_capacity < 64u * (uint32_t)num_variables)
+            {
+                storage.node_capacity *= 2;
+            }
+
+            std::unique_ptr<qmdd> local_dd;
+            std::unique_ptr<gate_builder> builder;
+
+            for (;;)
+            {
+                built_gate built;
+                uint64_t seq;
+
+                {
+                    std::lock_guard<std::mutex> fetch_lock(fetch_mutex);
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [this]() { return next_fetch - next_take < slots.size() || stopping; });
+                        if (stopping || upstream_done)
+                        {
+                            break;
+                        }
+                    }
+
+                    const int* instr = upstream.next_gate();
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!instr)
+                    {
+                        upstream_done = true;
+                        changed.notify_all();
+                        break;
+                    }
+
+                    seq = next_fetch++;
+                    built.instr.assign(instr, instr + 2 + instr[1]);
+                    built.gate_count = upstream.last_gate_count();
+                }
+
+                // the built gates are copied out, so the local qmdd is thrown away when it fills up instead of collected.
+                if (!local_dd || local_dd->get_num_nodes() > storage.node_capacity / 2)
+                {
+                    builder.reset();
+                    local_dd.reset(new qmdd(num_variables, storage));
+                    builder.reset(new gate_builder(*local_dd));
+                }
+
+                built.gate = local_dd->export_dd(builder->build_instruction(built.instr.data()));
+                built.ready = true;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                slots[seq % slots.size()] = std::move(built);
+                changed.notify_all();
+            }
+        }
+        catch (const budget_exceeded& e)
+        {
+            // the local qmdd is private to the worker, so running out of it isn't the decoder's budget.
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::make_exception_ptr(std::runtime_error(std::string("gate builder thread: ") + e.what()));
+            changed.notify_all();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+            changed.notify_all();
+        }
+    }
+
+public:
+    // lookahead is the number of gates that can be built ahead of the decoder.
+    prebuilding_gate_source(gate_source& upstream, int num_variables, int num_threads, int lookahead)
+        : upstream(upstream), num_variables(num_variables), slots(std::max(lookahead, num_threads)), curr_offset(upstream.offset())
+    {
+        assert(num_threads >= 1);
+
+        for (int i = 0; i < num_threads; i++)
+        {
+            workers.push_back(std::thread([this]() { run(); }));
+        }
+    }
+
+    ~prebuilding_gate_source()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            changed.notify_all();
+        }
+
+        upstream.stop();
+
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    const int* next_gate() override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        built_gate& slot = slots[next_take % slots.size()];
+        changed.wait(lock, [&]() { return slot.ready || error || (upstream_done && next_take == next_fetch); });
+
+        if (!slot.ready)
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            return NULL;
+        }
+
+        current = std::move(slot);
+        slot.ready = false;
+        next_take += 1;
+        changed.notify_all();
+
+        curr_offset += (int)current.instr.size();
+        return current.instr.data();
+    }
+
+    int offset() const override
+    {
+        return curr_offset;
+    }
+
+    bool take_prebuilt(qmdd& dd, qmdd::edge* gate_out) override
+    {
+        *gate_out = dd.import_dd(current.gate);
+        return true;
+    }
+
+    int last_gate_count() const override
+    {
+        return current.gate_count;
+    }
+};
+
+// splits the gate stream into stages of consecutive gates, and the gates of each stage into blocks over disjoint ranges of variables.
+// a gate joins the blocks its variable span overlaps, and a stage ends when that would make a block wider than max_block_vars.
+// blocks of different stages and the gates of a block keep their stream order, and blocks of the same stage commute.
+// worker threads multiply out the gates of each block in a local qmdd, and the decoder stitches the blocks of a stage
+// together with kronecker products, so the product only takes one multiply per stage.
+// a stage is returned as a layer of sequence instructions. stages end between gates of the stream, so offsets can be used for checkpoints.
+class partitioning_gate_source : public gate_source
+{
+    struct block
+    {
+        int first_var;
+        int last_var;
+
+        // the instructions of the block in stream order
+        std::vector<int> instrs;
+        int num_instrs = 0;
+
+        // the product of the instructions, built by a worker in its own qmdd if there is more than one
+        std::unique_ptr<qmdd> product_dd;
+        qmdd::edge product;
+        bool ready = false;
+    };
+
+    struct stage
+    {
+        // in variable order
+        std::vector<std::shared_ptr<block>> blocks;
+        int num_instrs = 0;
+        int gate_count = 0;
+        int end_offset = 0;
+    };
+
+    // stages are cut after this many instructions, so a long run of narrow gates doesn't hold back the decoder
+    static const int max_stage_instrs = 1024;
+
+    gate_source& upstream;
+    int num_variables;
+    int max_block_vars;
+    int lookahead;
+    uint32_t max_node_capacity;
+
+    // read by the decoding thread only
+    stage open_stage;
+    std::deque<stage> stages;
+    bool upstream_done = false;
+
+    // blocks waiting for a worker
+    std::deque<std::shared_ptr<block>> queued;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    // guards queued, stopping, error and the product and ready flag of the blocks
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    std::vector<std::thread> workers;
+
+    stage current_stage;
+    std::vector<int> current;
+    int curr_offset;
+
+    std::unique_ptr<gate_builder> builder;
+    qmdd* builder_dd = nullptr;
+
+    void run()
+    {
+        try
+        {
+            std::vector<int> sequence;
+
+            for (;;)
+            {
+                std::shared_ptr<block> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [this]() { return !queued.empty() || stopping; });
+                    if (stopping)
+                    {
+                        break;
+                    }
+                    task = std::move(queued.front());
+                    queued.pop_front();
+                }
+
+                sequence.clear();
+                sequence.push_back((int)gate_opcode::sequence);
+                sequence.push_back((int)task->instrs.size());
+                sequence.insert(sequence.end(), task->instrs.begin(), task->instrs.end());
+
+                // each block gets its own qmdd, which the decoder copies the product from and then frees.
+                // they start small, since stages built ahead hold on to theirs.
+                qmdd::storage_options storage;
+                storage.node_capacity = 0x1000;
+                while (storage.node_capacity < max_node_capacity && storage.node_capacity < 16u * (uint32_t)num_variables)
+                {
+                    storage.node_capacity *= 2;
+                }
+
+                std::unique_ptr<qmdd> local_dd;
+                qmdd::edge product;
+                for (;;)
+                {
+                    local_dd.reset(new qmdd(num_variables, storage));
+                    try
+                    {
+                        product = gate_builder(*local_dd).build_block(sequence.data(), task->first_var, task->last_var + 1);
+                        break;
+                    }
+                    catch (const budget_exceeded&)
+                    {
+                        // retry in a bigger qmdd, up to the size of the decoder's
+                        if (storage.node_capacity >= max_node_capacity)
+                        {
+                            throw;
+                        }
+                        storage.node_capacity *= 2;
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                task->product_dd = std::move(local_dd);
+                task->product = product;
+                task->ready = true;
+                changed.notify_all();
+            }
+        }
+        catch (const budget_exceeded& e)
+        {
+            // the local qmdd is private to the worker, so running out of it isn't the decoder's budget.
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::make_exception_ptr(std::runtime_error(std::string("block builder thread: ") + e.what()));
+            changed.notify_all();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+            changed.notify_all();
+        }
+    }
+
+    // moves the open stage to the stages ready to be returned, and queues its blocks for the workers
+    void close_stage(int end_offset)
+    {
+        open_stage.end_offset = end_offset;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::shared_ptr<block>& b : open_stage.blocks)
+        {
+            if (b->num_instrs > 1)
+            {
+                queued.push_back(b);
+            }
+        }
+        changed.notify_all();
+
+        stages.push_back(std::move(open_stage));
+        open_stage = stage();
+    }
+
+    void read_gate()
+    {
+        int instr_offset = upstream.offset();
+        const int* instr = upstream.next_gate();
+        if (!instr)
+        {
+            upstream_done = true;
+            if (open_stage.num_instrs != 0)
+            {
+                close_stage(instr_offset);
+            }
+            return;
+        }
+
+        int first_var, last_var;
+        get_instruction_span(instr, &first_var, &last_var);
+
+        // the blocks are disjoint and sorted, so the ones the gate overlaps are consecutive
+        std::vector<std::shared_ptr<block>>& blocks = open_stage.blocks;
+        auto first_overlap = std::lower_bound(blocks.begin(), blocks.end(), first_var,
+            [](const std::shared_ptr<block>& b, int var_id) { return b->last_var < var_id; });
+        auto last_overlap = first_overlap;
+        while (last_overlap != blocks.end() && (*last_overlap)->first_var <= last_var)
+        {
+            ++last_overlap;
+        }
+
+        int merged_first = first_var;
+        int merged_last = last_var;
+        if (first_overlap != last_overlap)
+        {
+            merged_first = std::min(merged_first, (*first_overlap)->first_var);
+            merged_last = std::max(merged_last, (*(last_overlap - 1))->last_var);
+        }
+
+        if (open_stage.num_instrs != 0 && (merged_last - merged_first + 1 > max_block_vars || open_stage.num_instrs >= max_stage_instrs))
+        {
+            // the gate starts the next stage on its own
+            close_stage(instr_offset);
+            first_overlap = last_overlap = blocks.begin();
+            merged_first = first_var;
+            merged_last = last_var;
+        }
+
+        // the merged blocks commute, so their instructions can go one block after another
+        std::shared_ptr<block> merged = std::make_shared<block>();
+        merged->first_var = merged_first;
+        merged->last_var = merged_last;
+        for (auto b = first_overlap; b != last_overlap; ++b)
+        {
+            merged->instrs.insert(merged->instrs.end(), (*b)->instrs.begin(), (*b)->instrs.end());
+            merged->num_instrs += (*b)->num_instrs;
+        }
+        merged->instrs.insert(merged->instrs.end(), instr, instr + 2 + instr[1]);
+        merged->num_instrs += 1;
+
+        auto position = blocks.erase(first_overlap, last_overlap);
+        blocks.insert(position, std::move(merged));
+
+        open_stage.num_instrs += 1;
+        open_stage.gate_count += upstream.last_gate_count();
+    }
+
+public:
+    // lookahead is the number of stages that can be built ahead of the decoder.
+    // the local qmdds of the workers grow up to max_node_capacity nodes.
+    partitioning_gate_source(gate_source& upstream, int num_variables, int max_block_vars, int num_threads, int lookahead, uint32_t max_node_capacity)
+        : upstream(upstream), num_variables(num_variables), max_block_vars(max_block_vars), lookahead(lookahead), max_node_capacity(max_node_capacity), curr_offset(upstream.offset())
+    {
+        assert(max_block_vars >= 1 && num_threads >= 1 && lookahead >= 1);
+
+        for (int i = 0; i < num_threads; i++)
+        {
+            workers.push_back(std::thread([this]() { run(); }));
+        }
+    }
+
+    ~partitioning_gate_source()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            changed.notify_all();
+        }
+
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    const int* next_gate() override
+    {
+        while (!upstream_done && (int)stages.size() < lookahead)
+        {
+            read_gate();
+        }
+
+        if (stages.empty())
+        {
+            return NULL;
+        }
+
+        current_stage = std::move(stages.front());
+        stages.pop_front();
+        curr_offset = current_stage.end_offset;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (const std::shared_ptr<block>& b : current_stage.blocks)
+            {
+                changed.wait(lock, [&]() { return b->num_instrs == 1 || b->ready || error; });
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
+            }
+        }
+
+        current.clear();
+        if (current_stage.blocks.size() > 1)
+        {
+            current.push_back((int)gate_opcode::layer);
+            current.push_back(0);
+        }
+        for (const std::shared_ptr<block>& b : current_stage.blocks)
+        {
+            if (b->num_instrs > 1)
+            {
+                current.push_back((int)gate_opcode::sequence);
+                current.push_back((int)b->instrs.size());
+            }
+            current.insert(current.end(), b->instrs.begin(), b->instrs.end());
+        }
+        if (current_stage.blocks.size() > 1)
+        {
+            current[1] = (int)current.size() - 2;
+        }
+
+        return current.data();
+    }
+
+    int offset() const override
+    {
+        return curr_offset;
+    }
+
+    void seek(int offset) override
+    {
+        if (open_stage.num_instrs != 0 || !stages.empty())
+        {
+            throw std::logic_error("partitioning gate source can only seek before reading");
+        }
+
+        upstream.seek(offset);
+        upstream_done = false;
+        curr_offset = offset;
+    }
+
+    bool take_prebuilt(qmdd& dd, qmdd::edge* gate_out) override
+    {
+        if (current_stage.blocks.size() == 1 && current_stage.blocks[0]->num_instrs == 1)
+        {
+            return false;
+        }
+
+        if (builder_dd != &dd)
+        {
+            builder.reset(new gate_builder(dd));
+            builder_dd = &dd;
+        }
+
+        // blocks of one gate aren't worth a trip to a worker, so they are built here
+        std::vector<gate_builder::placed_block> placed;
+        for (const std::shared_ptr<block>& b : current_stage.blocks)
+        {
+            qmdd::edge matrix;
+            if (b->num_instrs > 1)
+            {
+                matrix = dd.import_dd(*b->product_dd, b->product);
+                b->product_dd.reset();
+            }
+            else
+            {
+                matrix = builder->build_block(b->instrs.data(), b->first_var, b->last_var + 1);
+            }
+            placed.push_back(gate_builder::placed_block{ b->first_var, b->last_var + 1, matrix });
+        }
+
+        *gate_out = builder->compose_layer(placed);
+        return true;
+    }
+
+    int last_gate_count() const override
+    {
+        return current_stage.gate_count;
+    }
+
+    void stop() override
+    {
+        upstream.stop();
+    }
+};
+
+struct pipeline_options
+{
+    // number of threads that build gate matrices ahead of the decoder. zero builds them on the decoding thread.
+    int build_threads = 0;
+
+    // number of gates that can be built ahead of the decoder
+    int lookahead = 64;
+
+    // group runs of gates with the same controls into multi_target gates
+    bool fuse = true;
+
+    // group runs of diagonal gates into diagonal_batch gates
+    bool batch_diagonal = true;
+
+    // if not zero, schedule gates into layers with this many gates held at once
+    int layer_window = 0;
+
+    // if not zero, reorder commuting gates to keep the product small, with this many gates held at once
+    int schedule_window = 0;
+    int schedule_candidates = 4;
+
+    // if not zero, multiply out blocks of gates at most this many variables wide on partition_threads threads,
+    // and apply the blocks that act on disjoint variables together. lookahead is then the number of stages built ahead.
+    int partition_vars = 0;
+    int partition_threads = 1;
+};
+
+// decodes the gates of source, fused, batched, scheduled, layered and built ahead as configured by pipeline.
+void decode(const program_spec& spec, qmdd& dd, const decode_options& options, const pipeline_options& pipeline, gate_source& source, qmdd::edge* root_out, decode_report* report_out)
+{
+    gate_source* gates = &source;
+
+    std::unique_ptr<fusing_gate_source> fused_gates;
+    if (pipeline.fuse)
+    {
+        fused_gates.reset(new fusing_gate_source(*gates));
+        gates = fused_gates.get();
+    }
+
+    std::unique_ptr<diagonal_batching_gate_source> batched_gates;
+    if (pipeline.batch_diagonal)
+    {
+        batched_gates.reset(new diagonal_batching_gate_source(*gates));
+        gates = batched_gates.get();
+    }
+
+    std::unique_ptr<scheduling_gate_source> scheduled_gates;
+    if (pipeline.schedule_window != 0)
+    {
+        scheduled_gates.reset(new scheduling_gate_source(*gates, pipeline.schedule_window, pipeline.schedule_candidates));
+        gates = scheduled_gates.get();
+    }
+
+    std::unique_ptr<layering_gate_source> layered_gates;
+    if (pipeline.layer_window != 0)
+    {
+        layered_gates.reset(new layering_gate_source(*gates, spec.num_variables, pipeline.layer_window));
+        gates = layered_gates.get();
+    }
+
+    std::unique_ptr<partitioning_gate_source> partitioned_gates;
+    if (pipeline.partition_vars != 0)
+    {
+        partitioned_gates.reset(new partitioning_gate_source(*gates, spec.num_variables, pipeline.partition_vars, pipeline.partition_threads, pipeline.lookahead, dd.get_node_capacity()));
+        gates = partitioned_gates.get();
+    }
+
+    std::unique_ptr<prebuilding_gate_source> built_gates;
+    if (pipeline.build_threads != 0)
+    {
+        built_gates.reset(new prebuilding_gate_source(*gates, spec.num_variables, pipeline.build_threads, pipeline.lookahead));
+        gates = built_gates.get();
+    }
+
+    decode(spec, dd, options, *gates, root_out, report_out);
+}
+
+// parses txt with parse_fn on a separate thread and decodes the gates as soon as they are parsed, instead of after the whole file.
+// dd is created once the header of the program is parsed, since its size depends on the number of variables.
+// returns the program without its gate stream. checkpoints aren't supported, since they need the whole gate stream.
+program_spec parse_and_decode(const char* txt, program_spec (*parse_fn)(const char*, parse_listener*), const qmdd::storage_options& storage, const decode_options& options, const pipeline_options& pipeline,
+    std::unique_ptr<qmdd>* dd_out, qmdd::edge* root_out, decode_report* report_out)
+{
+    if (!options.checkpoint_file.empty())
+    {
+        throw std::logic_error("checkpoints need the whole gate stream");
+    }
+
+    // thrown through the parser when the decoder stops reading early.
+    // doesn't derive from std::exception, so the parser doesn't report it as a syntax error.
+    struct parse_abandoned { };
+
+    class ring_listener : public parse_listener
+    {
+        spsc_ring& ring;
+
+    public:
+        std::promise<program_spec> header;
+        bool has_header = false;
+
+        explicit ring_listener(spsc_ring& ring)
+            : ring(ring)
+        { }
+
+        void on_header(const program_spec& spec) override
+        {
+            header.set_value(spec);
+            has_header = true;
+        }
+
+        void on_gate(const int* instr) override
+        {
+            if (!ring.push(instr, 2 + instr[1]))
+            {
+                throw parse_abandoned();
+            }
+        }
+
+        bool discard_gates() const override
+        {
+            return true;
+        }
+    };
+
+    // fits the biggest instruction the parser accepts
+    spsc_ring ring(0x10000);
+    ring_listener listener(ring);
+    std::future<program_spec> header = listener.header.get_future();
+
+    std::exception_ptr parse_error;
+    std::thread parser([&]()
+    {
+        try
+        {
+            parse_fn(txt, &listener);
+            if (!listener.has_header)
+            {
+                throw std::runtime_error("expected BEGIN");
+            }
+        }
+        catch (const parse_abandoned&)
+        {
+        }
+        catch (...)
+        {
+            parse_error = std::current_exception();
+            if (!listener.has_header)
+            {
+                listener.header.set_exception(parse_error);
+            }
+        }
+
+        ring.close();
+    });
+
+    program_spec spec;
+    try
+    {
+        spec = header.get();
+        dd_out->reset(new qmdd(spec.num_variables, storage));
+
+        ring_gate_source parsed_gates(ring);
+        decode(spec, **dd_out, options, pipeline, parsed_gates, root_out, report_out);
+    }
+    catch (...)
+    {
+        ring.abandon();
+        parser.join();
+        throw;
+    }
+
+    // stops the parser if decoding stopped early
+    ring.abandon();
+    parser.join();
+
+    // a syntax error after BEGIN only shows once the gates before it are decoded
+    if (parse_error)
+    {
+        std::rethrow_exception(parse_error);
+    }
+
+    return spec;
+}
+
+// a stabilizer tableau in the style of CHP: a Clifford circuit is known, up to a global phase,
+// by the Pauli products it maps each X and Z of its inputs to.
+// row j is the image of X on variable j, and row num_variables + j the image of Z on variable j.
+// the tableau is stored by column, one bit per row packed into words, so a gate updates 64 rows per operation.
+class stabilizer_tableau
+{
+    int num_variables;
+    size_t num_words;
+
+    // xs[var] and zs[var] have the X and Z bits of every row on var, signs has a bit per row for a negative sign
+    std::vector<std::vector<uint64_t>> xs;
+    std::vector<std::vector<uint64_t>> zs;
+    std::vector<uint64_t> signs;
+
+    bool get_bit(const std::vector<uint64_t>& bits, int row) const
+    {
+        return (bits[row / 64] >> (row % 64)) & 1;
+    }
+
+    void set_bit(std::vector<uint64_t>& bits, int row, bool value)
+    {
+        bits[row / 64] = (bits[row / 64] & ~(uint64_t(1) << (row % 64))) | (uint64_t(value) << (row % 64));
+    }
+
+public:
+    explicit stabilizer_tableau(int num_variables)
+        : num_variables(num_variables), num_words((2 * size_t(num_variables) + 63) / 64),
+        xs(num_variables, std::vector<uint64_t>(num_words)), zs(num_variables, std::vector<uint64_t>(num_words)), signs(num_words)
+    {
+        for (int var_id = 0; var_id < num_variables; var_id++)
+        {
+            set_bit(xs[var_id], var_id, true);
+            set_bit(zs[var_id], num_variables + var_id, true);
+        }
+    }
+
+    int get_num_variables() const
+    {
+        return num_variables;
+    }
+
+    // the Pauli of a row on a variable: 0 for I, 1 for X, 2 for Z, 3 for Y
+    int get_pauli(int row, int var_id) const
+    {
+        return int(get_bit(xs[var_id], row)) | int(get_bit(zs[var_id], row)) << 1;
+    }
+
+    bool is_negative(int row) const
+    {
+        return get_bit(signs, row);
+    }
+
+    void hadamard(int var_id)
+    {
+        std::vector<uint64_t>& x = xs[var_id];
+        std::vector<uint64_t>& z = zs[var_id];
+        for (size_t i = 0; i < num_words; i++)
+        {
+            signs[i] ^= x[i] & z[i];
+            std::swap(x[i], z[i]);
+        }
+    }
+
+    void phase(int var_id)
+    {
+        std::vector<uint64_t>& x = xs[var_id];
+        std::vector<uint64_t>& z = zs[var_id];
+        for (size_t i = 0; i < num_words; i++)
+        {
+            signs[i] ^= x[i] & z[i];
+            z[i] ^= x[i];
+        }
+    }
+
+    void inv_phase(int var_id)
+    {
+        std::vector<uint64_t>& x = xs[var_id];
+        std::vector<uint64_t>& z = zs[var_id];
+        for (size_t i = 0; i < num_words; i++)
+        {
+            signs[i] ^= x[i] & ~z[i];
+            z[i] ^= x[i];
+        }
+    }
+
+    void pauli_x(int var_id)
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            signs[i] ^= zs[var_id][i];
+        }
+    }
+
+    void pauli_y(int var_id)
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            signs[i] ^= xs[var_id][i] ^ zs[var_id][i];
+        }
+    }
+
+    void pauli_z(int var_id)
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            signs[i] ^= xs[var_id][i];
+        }
+    }
+
+    void cnot(int control, int target)
+    {
+        std::vector<uint64_t>& xc = xs[control];
+        std::vector<uint64_t>& zc = zs[control];
+        std::vector<uint64_t>& xt = xs[target];
+        std::vector<uint64_t>& zt = zs[target];
+        for (size_t i = 0; i < num_words; i++)
+        {
+            signs[i] ^= xc[i] & zt[i] & ~(xt[i] ^ zc[i]);
+            xt[i] ^= xc[i];
+            zc[i] ^= zt[i];
+        }
+    }
+
+    void swap(int var0, int var1)
+    {
+        xs[var0].swap(xs[var1]);
+        zs[var0].swap(zs[var1]);
+    }
+};
+
+// whether a gate is a Clifford gate that stabilizer_tableau can apply
+bool is_clifford_instruction(const int* instr)
+{
+    gate_opcode opcode = (gate_opcode)instr[0];
+    int num_controls = instr[1] - 1;
+
+    switch (opcode)
+    {
+    case gate_opcode::toffoli:
+    case gate_opcode::pauli_y:
+    case gate_opcode::pauli_z:
+        return num_controls <= 1;
+    case gate_opcode::fredkin:
+        // a fredkin gate without controls is a swap of its two targets
+        return instr[1] == 2;
+    case gate_opcode::hadamard:
+    case gate_opcode::sqrtnot:
+    case gate_opcode::inv_sqrtnot:
+    case gate_opcode::rotate_pi_by_2:
+    case gate_opcode::inv_rotate_pi_by_2:
+        return num_controls == 0;
+    default:
+        return false;
+    }
+}
+
+bool is_clifford(const program_spec& spec)
+{
+    for (size_t offset = 0; offset < spec.gate_stream.size(); offset += 2 + spec.gate_stream[offset + 1])
+    {
+        if (!is_clifford_instruction(&spec.gate_stream[offset]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// applies the gates of a program for which is_clifford() holds
+void apply_clifford_gates(const program_spec& spec, stabilizer_tableau* tableau)
+{
+    for (size_t offset = 0; offset < spec.gate_stream.size(); offset += 2 + spec.gate_stream[offset + 1])
+    {
+        const int* instr = &spec.gate_stream[offset];
+        gate_opcode opcode = (gate_opcode)instr[0];
+        const int* first_param = instr + 2;
+        int num_controls = instr[1] - 1;
+        int target = operand_var_id(first_param[num_controls]);
+
+        if (opcode == gate_opcode::fredkin)
+        {
+            tableau->swap(operand_var_id(first_param[0]), operand_var_id(first_param[1]));
+            continue;
+        }
+
+        // a negated control is a control between two not gates
+        int control = num_controls == 0 ? -1 : operand_var_id(first_param[0]);
+        bool negated = num_controls != 0 && is_negated_control(first_param[0]);
+        if (negated)
+        {
+            tableau->pauli_x(control);
+        }
+
+        switch (opcode)
+        {
+        case gate_opcode::toffoli:
+            if (control == -1)
+                tableau->pauli_x(target);
+            else
+                tableau->cnot(control, target);
+            break;
+        case gate_opcode::pauli_y:
+            if (control == -1)
+                tableau->pauli_y(target);
+            else
+            {
+                // controlled y is a controlled not conjugated by a phase gate
+                tableau->inv_phase(target);
+                tableau->cnot(control, target);
+                tableau->phase(target);
+            }
+            break;
+        case gate_opcode::pauli_z:
+            if (control == -1)
+                tableau->pauli_z(target);
+            else
+            {
+                tableau->hadamard(target);
+                tableau->cnot(control, target);
+                tableau->hadamard(target);
+            }
+            break;
+        case gate_opcode::hadamard:
+            tableau->hadamard(target);
+            break;
+        case gate_opcode::sqrtnot:
+        case gate_opcode::inv_sqrtnot:
+            // V is H S H up to a global phase
+            tableau->hadamard(target);
+            if (opcode == gate_opcode::sqrtnot)
+                tableau->phase(target);
+            else
+                tableau->inv_phase(target);
+            tableau->hadamard(target);
+            break;
+        case gate_opcode::rotate_pi_by_2:
+            tableau->phase(target);
+            break;
+        case gate_opcode::inv_rotate_pi_by_2:
+            tableau->inv_phase(target);
+            break;
+        default:
+            throw std::logic_error("not a Clifford gate");
+        }
+
+        if (negated)
+        {
+            tableau->pauli_x(control);
+        }
+    }
+}
+
+// writes each row of the tableau as "X a -> +XIZ", with the Pauli on each variable in variable order.
+void write_tableau(const program_spec& spec, const stabilizer_tableau& tableau, const char* fn)
+{
+    FILE* f = fopen(fn, "w");
+    if (!f)
+    {
+        throw std::runtime_error(std::string("failed to open ") + fn);
+    }
+
+    int n = tableau.get_num_variables();
+    for (int row = 0; row < 2 * n; row++)
+    {
+        fprintf(f, "%c %s -> %c", row < n ? 'X' : 'Z', spec.variable_names[row % n].c_str(), tableau.is_negative(row) ? '-' : '+');
+        for (int var_id = 0; var_id < n; var_id++)
+        {
+            fputc("IXZY"[tableau.get_pauli(row, var_id)], f);
+        }
+        fputc('\n', f);
+    }
+
+    fclose(f);
+}
+
+// a circuit of h, s, s', not, z and controlled not gates with the tableau's effect, in the encoding of program_spec::gate_stream.
+// the tableau is reduced to the identity one variable at a time, and the circuit is the inverse of the gates that did it.
+std::vector<int> synthesize_clifford_circuit(stabilizer_tableau tableau)
+{
+    int n = tableau.get_num_variables();
+
+    std::vector<std::pair<gate_opcode, std::pair<int, int>>> reduction;
+    auto apply = [&](gate_opcode opcode, int var0, int var1)
+    {
+        switch (opcode)
+        {
+        case gate_opcode::hadamard: tableau.hadamard(var0); break;
+        case gate_opcode::rotate_pi_by_2: tableau.phase(var0); break;
+        case gate_opcode::inv_rotate_pi_by_2: tableau.inv_phase(var0); break;
+        case gate_opcode::pauli_z: tableau.pauli_z(var0); break;
+        case gate_opcode::toffoli:
+            if (var1 == -1)
+                tableau.pauli_x(var0);
+            else
+                tableau.cnot(var0, var1);
+            break;
+        default: assert(false); break;
+        }
+        reduction.push_back({ opcode, { var0, var1 } });
+    };
+
+    const int pauli_x = 1, pauli_z = 2, pauli_y = 3;
+
+    for (int j = 0; j < n; j++)
+    {
+        // the rows of the earlier variables are reduced, so these rows are the identity on them.
+        // turn the image of X_j into X on a set of variables, then fold them into variable j.
+        int pivot = -1;
+        for (int var_id = j; var_id < n; var_id++)
+        {
+            int pauli = tableau.get_pauli(j, var_id);
+            if (pauli == pauli_z)
+                apply(gate_opcode::hadamard, var_id, -1);
+            else if (pauli == pauli_y)
+                apply(gate_opcode::inv_rotate_pi_by_2, var_id, -1);
+
+            if (pauli != 0 && pivot == -1)
+                pivot = var_id;
+        }
+        assert(pivot != -1);
+
+        if (pivot != j)
+        {
+            apply(gate_opcode::toffoli, pivot, j);
+            if (tableau.get_pauli(j, pivot) != 0)
+                apply(gate_opcode::toffoli, j, pivot);
+        }
+        for (int var_id = j + 1; var_id < n; var_id++)
+        {
+            if (tableau.get_pauli(j, var_id) == pauli_x)
+                apply(gate_opcode::toffoli, j, var_id);
+        }
+
+        // the image of Z_j anticommutes with X_j, so it's Z or Y on variable j. V, made of h s h, fixes X and turns Y into Z.
+        int z_row = n + j;
+        if (tableau.get_pauli(z_row, j) == pauli_y)
+        {
+            apply(gate_opcode::hadamard, j, -1);
+            apply(gate_opcode::rotate_pi_by_2, j, -1);
+            apply(gate_opcode::hadamard, j, -1);
+        }
+        for (int var_id = j + 1; var_id < n; var_id++)
+        {
+            int pauli = tableau.get_pauli(z_row, var_id);
+            if (pauli == pauli_x)
+                apply(gate_opcode::hadamard, var_id, -1);
+            else if (pauli == pauli_y)
+            {
+                apply(gate_opcode::inv_rotate_pi_by_2, var_id, -1);
+                apply(gate_opcode::hadamard, var_id, -1);
+            }
+            if (pauli != 0)
+                apply(gate_opcode::toffoli, var_id, j);
+        }
+        assert(tableau.get_pauli(j, j) == pauli_x && tableau.get_pauli(z_row, j) == pauli_z);
+    }
+
+    for (int j = 0; j < n; j++)
+    {
+        if (tableau.is_negative(j))
+            apply(gate_opcode::pauli_z, j, -1);
+        if (tableau.is_negative(n + j))
+            apply(gate_opcode::toffoli, j, -1);
+    }
+
+    // the reduction R makes R C the identity, so C is the inverse of R: the inverse gates in reverse order
+    std::vector<int> gate_stream;
+    for (auto gate = reduction.rbegin(); gate != reduction.rend(); ++gate)
+    {
+        gate_opcode opcode = gate->first;
+        if (opcode == gate_opcode::rotate_pi_by_2)
+            opcode = gate_opcode::inv_rotate_pi_by_2;
+        else if (opcode == gate_opcode::inv_rotate_pi_by_2)
+            opcode = gate_opcode::rotate_pi_by_2;
+
+        gate_stream.push_back((int)opcode);
+        if (gate->second.second == -1)
+        {
+            gate_stream.push_back(1);
+            gate_stream.push_back(gate->second.first);
+        }
+        else
+        {
+            gate_stream.push_back(2);
+            gate_stream.push_back(gate->second.first);
+            gate_stream.push_back(gate->second.second);
+        }
+    }
+
+    return gate_stream;
+}
+
+// a sum over paths of a circuit: U|x> = (1/√2)^h Σ_y ω^P(x, y) |f(x, y)>, with ω = e^(iπ/4) and h path variables y.
+// the phase P is a polynomial over ℤ_8 and every output f_i a polynomial over ℤ_2, both in the boolean input and path variables.
+// the input variables are the program's variable ids, and the path variables come after them.
+// polynomials are sums of monomials, which are products of variables. monomials are hash-consed, so they're compared and multiplied by id.
+class path_sum
+{
+public:
+    using monomial = int;
+
+    // a polynomial over ℤ_2, as the set of its monomials in increasing order
+    using boolean_poly = std::vector<monomial>;
+
+    static const monomial constant_monomial = 0;
+
+    enum class result
+    {
+        equivalent,
+        not_equivalent,
+        unknown
+    };
+
+private:
+    struct variables_hasher
+    {
+        size_t operator()(const std::vector<int>& vars) const
+        {
+            size_t h = vars.size();
+            for (int var : vars)
+            {
+                h = h * 0x9E3779B97F4A7C15ull + (size_t)var;
+            }
+            return h;
+        }
+    };
+
+    // the sorted variables of each monomial, by id
+    std::vector<std::vector<int>> monomial_vars;
+    std::unordered_map<std::vector<int>, monomial, variables_hasher> monomial_ids;
+    std::unordered_map<uint64_t, monomial> products;
+
+    int num_inputs;
+    std::vector<bool> path_variable_live;
+
+    // the coefficient of every monomial of the phase polynomial that isn't 0 mod 8
+    std::map<monomial, int> phase;
+    std::vector<boolean_poly> outputs;
+
+    // the sum is scaled by √2 to this power
+    int sqrt2_exponent;
+
+    // path variables that may have become reducible since the last reduction
+    std::vector<int> candidates;
+
+    monomial intern(const std::vector<int>& vars)
+    {
+        auto found = monomial_ids.find(vars);
+        if (found != monomial_ids.end())
+        {
+            return found->second;
+        }
+
+        monomial m = (monomial)monomial_vars.size();
+        monomial_vars.push_back(vars);
+        monomial_ids.emplace(vars, m);
+        return m;
+    }
+
+    monomial variable(int var)
+    {
+        return intern({ var });
+    }
+
+    // variables are boolean, so x x = x and a product is the union of the variables
+    monomial multiply(monomial a, monomial b)
+    {
+        if (a == constant_monomial || a == b)
+            return b;
+        if (b == constant_monomial)
+            return a;
+
+        uint64_t key = ((uint64_t)std::min(a, b) << 32) | (uint64_t)std::max(a, b);
+        auto found = products.find(key);
+        if (found != products.end())
+        {
+            return found->second;
+        }
+
+        const std::vector<int>& a_vars = monomial_vars[a];
+        const std::vector<int>& b_vars = monomial_vars[b];
+        std::vector<int> vars;
+        std::set_union(begin(a_vars), end(a_vars), begin(b_vars), end(b_vars), std::back_inserter(vars));
+
+        monomial product = intern(vars);
+        products.emplace(key, product);
+        return product;
+    }
+
+    bool contains(monomial m, int var) const
+    {
+        const std::vector<int>& vars = monomial_vars[m];
+        return std::binary_search(begin(vars), end(vars), var);
+    }
+
+    monomial without(monomial m, int var)
+    {
+        std::vector<int> vars = monomial_vars[m];
+        vars.erase(std::lower_bound(begin(vars), end(vars), var));
+        return intern(vars);
+    }
+
+    static boolean_poly poly_xor(const boolean_poly& a, const boolean_poly& b)
+    {
+        boolean_poly sum;
+        std::set_symmetric_difference(begin(a), end(a), begin(b), end(b), std::back_inserter(sum));
+        return sum;
+    }
+
+    boolean_poly poly_multiply(const boolean_poly& a, const boolean_poly& b)
+    {
+        boolean_poly terms;
+        for (monomial a_term : a)
+        {
+            for (monomial b_term : b)
+            {
+                terms.push_back(multiply(a_term, b_term));
+            }
+        }
+
+        // terms that appear an even number of times cancel
+        std::sort(begin(terms), end(terms));
+        boolean_poly product;
+        for (size_t i = 0; i < terms.size(); )
+        {
+            size_t j = i;
+            while (j < terms.size() && terms[j] == terms[i])
+                j++;
+            if ((j - i) % 2 == 1)
+                product.push_back(terms[i]);
+            i = j;
+        }
+        return product;
+    }
+
+    void add_phase(monomial m, int coefficient)
+    {
+        int& c = phase[m];
+        c = (c + coefficient) & 7;
+        if (c == 0)
+        {
+            phase.erase(m);
+        }
+    }
+
+    // adds coefficient * p to the phase, with the boolean polynomial p lifted to the integers.
+    // a xor b = a + b - 2 a b, so the sum of the monomials of p lifts to the sum over their nonempty subsets T of (-2)^(|T|-1) times their product.
+    // mod 8 the subsets of more than three monomials vanish, and so do more of them for even coefficients.
+    void add_lifted_phase(const boolean_poly& p, int coefficient)
+    {
+        coefficient &= 7;
+        if (coefficient == 0)
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < p.size(); i++)
+        {
+            add_phase(p[i], coefficient);
+            if ((2 * coefficient) % 8 == 0)
+                continue;
+            for (size_t j = i + 1; j < p.size(); j++)
+            {
+                monomial ij = multiply(p[i], p[j]);
+                add_phase(ij, -2 * coefficient);
+                if ((4 * coefficient) % 8 == 0)
+                    continue;
+                for (size_t k = j + 1; k < p.size(); k++)
+                {
+                    add_phase(multiply(ij, p[k]), 4 * coefficient);
+                }
+            }
+        }
+    }
+
+    // the product of the controls' values, negated ones complemented
+    boolean_poly control_poly(const int* first_control, const int* last_control)
+    {
+        boolean_poly active = { constant_monomial };
+        for (const int* control = first_control; control != last_control; ++control)
+        {
+            boolean_poly value = outputs[operand_var_id(*control)];
+            if (is_negated_control(*control))
+            {
+                value = poly_xor(value, { constant_monomial });
+            }
+            active = poly_multiply(active, value);
+        }
+        return active;
+    }
+
+    void hadamard(int var_id)
+    {
+        // the path variables of the old value may only have been in this output
+        for (monomial m : outputs[var_id])
+        {
+            for (int var : monomial_vars[m])
+            {
+                if (var >= num_inputs)
+                    candidates.push_back(var);
+            }
+        }
+
+        int y = num_inputs + (int)path_variable_live.size();
+        path_variable_live.push_back(true);
+
+        add_lifted_phase(poly_multiply(outputs[var_id], { variable(y) }), 4);
+        outputs[var_id] = { variable(y) };
+        sqrt2_exponent--;
+    }
+
+    // replaces a path variable by a boolean polynomial
+    void substitute(int var, const boolean_poly& value)
+    {
+        std::vector<std::pair<monomial, int>> terms;
+        for (auto term = phase.begin(); term != phase.end(); )
+        {
+            if (contains(term->first, var))
+            {
+                terms.push_back(*term);
+                term = phase.erase(term);
+            }
+            else
+            {
+                ++term;
+            }
+        }
+
+        // a boolean times a monomial lifts to the lifted product, since the monomial is 0 or 1
+        for (const auto& term : terms)
+        {
+            add_lifted_phase(poly_multiply(value, { without(term.first, var) }), term.second);
+        }
+
+        for (boolean_poly& output : outputs)
+        {
+            boolean_poly kept;
+            boolean_poly replaced;
+            for (monomial m : output)
+            {
+                if (contains(m, var))
+                    replaced = poly_xor(replaced, poly_multiply(value, { without(m, var) }));
+                else
+                    kept.push_back(m);
+            }
+            output = poly_xor(kept, replaced);
+        }
+    }
+
+    // sums out path variable y if one of the rules applies:
+    // if y is only in the phase as 2 y + 4 y Q or 6 y + 4 y Q, the sum over y is √2 ω^(1 + 6 Q) or √2 ω^(7 + 2 Q).
+    // if y is only in the phase as 4 y (y' + Q) for another path variable y' not in Q, the sum over y is 2 if y' = Q and 0 otherwise,
+    // so y' is replaced by Q and the sum over y' collapses.
+    bool sum_out(int y)
+    {
+        for (const boolean_poly& output : outputs)
+        {
+            for (monomial m : output)
+            {
+                if (contains(m, y))
+                    return false;
+            }
+        }
+
+        monomial y_monomial = variable(y);
+        int linear_coefficient = 0;
+        boolean_poly q;
+        std::vector<monomial> y_terms;
+        for (const auto& term : phase)
+        {
+            if (!contains(term.first, y))
+                continue;
+
+            y_terms.push_back(term.first);
+            if (term.first == y_monomial)
+                linear_coefficient = term.second;
+            else if (term.second == 4)
+                q.push_back(without(term.first, y));
+            else
+                return false;
+        }
+        std::sort(begin(q), end(q));
+
+        if (linear_coefficient % 2 == 1)
+        {
+            return false;
+        }
+
+        if (linear_coefficient == 2 || linear_coefficient == 6)
+        {
+            for (monomial m : y_terms)
+                phase.erase(m);
+            add_phase(constant_monomial, linear_coefficient == 2 ? 1 : 7);
+            add_lifted_phase(q, linear_coefficient == 2 ? 6 : 2);
+            path_variable_live[y - num_inputs] = false;
+            sqrt2_exponent++;
+            return true;
+        }
+
+        if (linear_coefficient == 4)
+        {
+            q = poly_xor(q, { constant_monomial });
+        }
+
+        if (q.empty())
+        {
+            // y is not in the sum at all
+            for (monomial m : y_terms)
+                phase.erase(m);
+            path_variable_live[y - num_inputs] = false;
+            sqrt2_exponent += 2;
+            return true;
+        }
+
+        // the newest variable is preferred: after a gate and its inverse it's the one the inverse made, which restores the sum before the gate
+        monomial best = -1;
+        for (monomial candidate : q)
+        {
+            const std::vector<int>& vars = monomial_vars[candidate];
+            if (vars.size() != 1 || vars[0] < num_inputs || vars[0] == y || !path_variable_live[vars[0] - num_inputs])
+                continue;
+            if (best != -1 && monomial_vars[best][0] > vars[0])
+                continue;
+
+            bool linear = true;
+            for (monomial m : q)
+            {
+                if (m != candidate && contains(m, vars[0]))
+                    linear = false;
+            }
+            if (linear)
+                best = candidate;
+        }
+
+        if (best != -1)
+        {
+            monomial candidate = best;
+            int y1 = monomial_vars[candidate][0];
+
+            for (monomial m : y_terms)
+                phase.erase(m);
+            boolean_poly value = poly_xor(q, { candidate });
+            path_variable_live[y - num_inputs] = false;
+            path_variable_live[y1 - num_inputs] = false;
+            substitute(y1, value);
+            sqrt2_exponent += 2;
+
+            // the phase terms of the value's variables changed
+            for (monomial m : value)
+            {
+                for (int var : monomial_vars[m])
+                {
+                    if (var >= num_inputs)
+                        candidates.push_back(var);
+                }
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+public:
+    explicit path_sum(int num_inputs)
+        : num_inputs(num_inputs)
+        , sqrt2_exponent(0)
+    {
+        intern({});
+        for (int var_id = 0; var_id < num_inputs; var_id++)
+        {
+            outputs.push_back({ variable(var_id) });
+        }
+    }
+
+    // applies a gate, or its inverse. returns false for gates that aren't Clifford+T, which leave the sum as it was.
+    bool apply(const int* instr, bool inverse)
+    {
+        gate_opcode opcode = (gate_opcode)instr[0];
+        const int* first_param = instr + 2;
+        const int* last_param = first_param + instr[1];
+        int target = operand_var_id(*(last_param - 1));
+
+        std::vector<int> microcode;
+        switch (opcode)
+        {
+        case gate_opcode::toffoli:
+            outputs[target] = poly_xor(outputs[target], control_poly(first_param, last_param - 1));
+            return true;
+        case gate_opcode::pauli_z:
+        case gate_opcode::rotate_pi_by_2:
+        case gate_opcode::inv_rotate_pi_by_2:
+        case gate_opcode::rotate_pi_by_4:
+        case gate_opcode::inv_rotate_pi_by_4:
+        {
+            // the gate multiplies by ω^k when the controls are active and the target is 1
+            int k = opcode == gate_opcode::pauli_z ? 4
+                : opcode == gate_opcode::rotate_pi_by_2 ? 2
+                : opcode == gate_opcode::inv_rotate_pi_by_2 ? 6
+                : opcode == gate_opcode::rotate_pi_by_4 ? 1
+                : 7;
+            add_lifted_phase(poly_multiply(control_poly(first_param, last_param - 1), outputs[target]), inverse ? -k : k);
+            return true;
+        }
+        case gate_opcode::pauli_y:
+        {
+            // Y is i X Z, and self-inverse
+            boolean_poly active = control_poly(first_param, last_param - 1);
+            add_lifted_phase(poly_multiply(active, outputs[target]), 4);
+            outputs[target] = poly_xor(outputs[target], active);
+            add_lifted_phase(active, 2);
+            return true;
+        }
+        case gate_opcode::hadamard:
+        case gate_opcode::sqrtnot:
+        case gate_opcode::inv_sqrtnot:
+            if (instr[1] != 1)
+                return false;
+            hadamard(target);
+            if (opcode != gate_opcode::hadamard)
+            {
+                // V is H S H
+                add_lifted_phase(outputs[target], (opcode == gate_opcode::sqrtnot) != inverse ? 2 : 6);
+                hadamard(target);
+            }
+            return true;
+        case gate_opcode::fredkin:
+            append_fredkin_microcode(first_param, last_param, &microcode);
+            break;
+        case gate_opcode::peres:
+        case gate_opcode::inv_peres:
+            append_peres_microcode(first_param, last_param, opcode == gate_opcode::inv_peres, &microcode);
+            break;
+        default:
+            return false;
+        }
+
+        std::vector<size_t> offsets;
+        for (size_t offset = 0; offset < microcode.size(); offset += 2 + microcode[offset + 1])
+        {
+            offsets.push_back(offset);
+        }
+        if (inverse)
+        {
+            std::reverse(begin(offsets), end(offsets));
+        }
+        for (size_t offset : offsets)
+        {
+            apply(&microcode[offset], inverse);
+        }
+        return true;
+    }
+
+    // the terms of the phase polynomial and of the outputs' polynomials
+    size_t num_terms() const
+    {
+        size_t count = phase.size();
+        for (const boolean_poly& output : outputs)
+            count += output.size();
+        return count;
+    }
+
+    void clear_candidates()
+    {
+        candidates.clear();
+    }
+
+    // applies the reduction rules to the path variables that may have become reducible since the last call or clear_candidates()
+    void reduce_candidates()
+    {
+        while (!candidates.empty())
+        {
+            int y = candidates.back();
+            candidates.pop_back();
+            if (path_variable_live[y - num_inputs])
+            {
+                sum_out(y);
+            }
+        }
+    }
+
+    bool in_outputs(int var) const
+    {
+        for (const boolean_poly& output : outputs)
+        {
+            for (monomial m : output)
+            {
+                if (contains(m, var))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // the sum over a path variable y doesn't change if y is replaced by y xor z for another path variable z.
+    // that adds the coefficients of y in the outputs to those of z, so the outputs can be column reduced in the path variables they're affine in.
+    // all but as many of those as the rank of their coefficients leave the outputs, which lets the rules sum them out.
+    // returns whether any path variable left the outputs.
+    bool eliminate_output_path_variables()
+    {
+        std::vector<bool> usable(path_variable_live);
+        std::vector<int> in_outputs_before;
+        for (const boolean_poly& output : outputs)
+        {
+            for (monomial m : output)
+            {
+                for (int var : monomial_vars[m])
+                {
+                    if (var < num_inputs)
+                        continue;
+                    in_outputs_before.push_back(var);
+                    if (monomial_vars[m].size() != 1)
+                        usable[var - num_inputs] = false;
+                }
+            }
+        }
+
+        // after an output picks its pivot, substitutions clear the other usable variables from it, and later ones keep them cleared
+        std::vector<bool> pivot(path_variable_live.size());
+        for (size_t output_i = 0; output_i < outputs.size(); output_i++)
+        {
+            int pivot_var = -1;
+            std::vector<int> others;
+            for (monomial m : outputs[output_i])
+            {
+                const std::vector<int>& vars = monomial_vars[m];
+                if (vars.size() != 1 || vars[0] < num_inputs || !usable[vars[0] - num_inputs] || pivot[vars[0] - num_inputs])
+                    continue;
+                if (pivot_var == -1)
+                    pivot_var = vars[0];
+                else
+                    others.push_back(vars[0]);
+            }
+            if (pivot_var == -1)
+                continue;
+
+            pivot[pivot_var - num_inputs] = true;
+            for (int other : others)
+            {
+                boolean_poly value = { variable(pivot_var), variable(other) };
+                std::sort(begin(value), end(value));
+                substitute(pivot_var, value);
+            }
+        }
+
+        bool freed = false;
+        for (int var : in_outputs_before)
+        {
+            if (!in_outputs(var))
+            {
+                candidates.push_back(var);
+                freed = true;
+            }
+        }
+        return freed;
+    }
+
+    // applies the reduction rules until none applies
+    void reduce()
+    {
+        candidates.clear();
+
+        bool progress = true;
+        while (progress)
+        {
+            progress = false;
+            for (int y = num_inputs; y < num_inputs + (int)path_variable_live.size(); y++)
+            {
+                if (path_variable_live[y - num_inputs] && sum_out(y))
+                {
+                    progress = true;
+                }
+            }
+
+            if (!progress)
+            {
+                progress = eliminate_output_path_variables();
+                candidates.clear();
+            }
+        }
+    }
+
+    // whether the sum is the identity times ω^k, with k written to global_phase_out.
+    // without path variables the sum is a permutation with phases, and its polynomials are unique, so it's known not to be.
+    result compare_to_identity(int* global_phase_out) const
+    {
+        if (std::find(begin(path_variable_live), end(path_variable_live), true) != end(path_variable_live))
+        {
+            return result::unknown;
+        }
+
+        for (int var_id = 0; var_id < num_inputs; var_id++)
+        {
+            const boolean_poly& output = outputs[var_id];
+            if (output.size() != 1 || monomial_vars[output[0]] != std::vector<int>{ var_id })
+                return result::not_equivalent;
+        }
+
+        if (phase.size() > 1 || (phase.size() == 1 && phase.begin()->first != constant_monomial))
+        {
+            return result::not_equivalent;
+        }
+
+        assert(sqrt2_exponent == 0);
+        *global_phase_out = phase.empty() ? 0 : phase.begin()->second;
+        return result::equivalent;
+    }
+};
+
+// checks whether two Clifford+T programs over the same variables have the same matrix up to a global phase, by reducing the path sum of the first followed by the inverse of the second.
+// returns result::unknown if a program has other gates, its polynomials grow past max_terms terms or the reduction gets stuck.
+path_sum::result compare_path_sums(const program_spec& spec0, const program_spec& spec1, size_t max_terms, int* global_phase_out)
+{
+    path_sum sum(spec0.num_variables);
+
+    // the first program's sum is left as built, and the second's gates are reduced as they're applied.
+    // a gate of the inverse then meets the sum its counterpart left, so equivalent programs cancel gate by gate and the sum stays small.
+    auto apply = [&sum, max_terms](const int* instr, bool inverse)
+    {
+        if (!sum.apply(instr, inverse))
+            return false;
+        if (inverse)
+            sum.reduce_candidates();
+        else
+            sum.clear_candidates();
+        return sum.num_terms() <= max_terms;
+    };
+
+    for (size_t offset = 0; offset < spec0.gate_stream.size(); offset += 2 + spec0.gate_stream[offset + 1])
+    {
+        if (!apply(&spec0.gate_stream[offset], false))
+            return path_sum::result::unknown;
+    }
+
+    std::vector<size_t> offsets;
+    for (size_t offset = 0; offset < spec1.gate_stream.size(); offset += 2 + spec1.gate_stream[offset + 1])
+    {
+        offsets.push_back(offset);
+    }
+    for (auto offset = offsets.rbegin(); offset != offsets.rend(); ++offset)
+    {
+        if (!apply(&spec1.gate_stream[*offset], true))
+            return path_sum::result::unknown;
+    }
+
+    sum.reduce();
+    return sum.compare_to_identity(global_phase_out);
+}
+
+// a tensor network for single entries <x|U|y> of a program's matrix, which are contracted without building the matrix.
+// every wire segment between two gates that change the value of a variable is an index of dimension 2.
+// controls and diagonal targets keep their segment, so those gates share indices with the gates around them instead of adding two.
+// the segments at the input and output are fixed to the bits of y and x, and the tensors are sliced to them before contracting.
+class tensor_network
+{
+public:
+    using amplitude = std::complex<double>;
+
+private:
+    struct tensor
+    {
+        // the most significant index first
+        std::vector<int> indices;
+        std::vector<amplitude> values;
+        bool live = true;
+    };
+
+    std::vector<tensor> tensors;
+
+    // the tensors that use each index
+    std::vector<std::vector<int>> index_users;
+
+    // the value an index is fixed to, or -1
+    std::vector<int> fixed_values;
+
+    std::vector<int> current_index;
+
+    // the product of the tensors that were contracted down to scalars
+    amplitude scalar = 1.0;
+
+    // contractions that would make a tensor with more indices than this throw instead
+    int max_tensor_indices;
+
+    qmdd weights_dd;
+    gate_builder builder;
+
+    int new_index(int fixed_value = -1)
+    {
+        index_users.emplace_back();
+        fixed_values.push_back(fixed_value);
+        return (int)fixed_values.size() - 1;
+    }
+
+    void add_tensor(std::vector<int> indices, std::vector<amplitude> values)
+    {
+        int tensor_id = (int)tensors.size();
+        for (int index : indices)
+        {
+            index_users[index].push_back(tensor_id);
+        }
+        tensors.push_back(tensor{ std::move(indices), std::move(values) });
+    }
+
+    // adds a 2x2 gate on the last operand, controlled by the others.
+    // the tensor's indices are the controls, then the target's new segment unless the gate is diagonal, then its old segment.
+    void add_controlled(const qmdd::weight_handle* gate_weights, const int* first_param, const int* last_param)
+    {
+        int num_controls = (int)(last_param - first_param) - 1;
+        int target = operand_var_id(*(last_param - 1));
+
+        amplitude gate[4];
+        for (int i = 0; i < 4; i++)
+        {
+            gate[i] = weights_dd.to_complex(gate_weights[i]);
+        }
+        bool diagonal = gate[1] == 0.0 && gate[2] == 0.0;
+
+        std::vector<int> indices;
+        for (const int* control = first_param; control != last_param - 1; ++control)
+        {
+            indices.push_back(current_index[operand_var_id(*control)]);
+        }
+        int in_index = current_index[target];
+        if (!diagonal)
+        {
+            current_index[target] = new_index();
+            indices.push_back(current_index[target]);
+        }
+        indices.push_back(in_index);
+
+        std::vector<amplitude> values((size_t)1 << indices.size());
+        for (size_t entry = 0; entry < values.size(); entry++)
+        {
+            bool active = true;
+            for (int control_i = 0; control_i < num_controls; control_i++)
+            {
+                int bit = (int)(entry >> (indices.size() - 1 - control_i)) & 1;
+                if (bit != (is_negated_control(first_param[control_i]) ? 0 : 1))
+                    active = false;
+            }
+
+            int in_bit = (int)entry & 1;
+            int out_bit = diagonal ? in_bit : (int)(entry >> 1) & 1;
+            if (active)
+                values[entry] = gate[out_bit * 2 + in_bit];
+            else
+                values[entry] = out_bit == in_bit ? 1.0 : 0.0;
+        }
+
+        add_tensor(std::move(indices), std::move(values));
+    }
+
+    void add_instruction(const int* instr)
+    {
+        gate_opcode opcode = (gate_opcode)instr[0];
+        const int* first_param = instr + 2;
+        const int* last_param = first_param + instr[1];
+
+        std::vector<int> microcode;
+        if (opcode == gate_opcode::fredkin)
+        {
+            append_fredkin_microcode(first_param, last_param, &microcode);
+        }
+        else if (opcode == gate_opcode::peres || opcode == gate_opcode::inv_peres)
+        {
+            append_peres_microcode(first_param, last_param, opcode == gate_opcode::inv_peres, &microcode);
+        }
+        else if (opcode == gate_opcode::multi_target)
+        {
+            // the base gates don't change the controls, so they can be applied one target at a time
+            int num_controls = first_param[0];
+            const int* first_control = first_param + 1;
+            for (const int* target = first_control + num_controls; target < last_param; target += 2)
+            {
+                std::vector<int> params(first_control, first_control + num_controls);
+                params.push_back(target[1]);
+                add_controlled(builder.get_gate_weights((gate_opcode)target[0]), params.data(), params.data() + params.size());
+            }
+            return;
+        }
+        else if (opcode == gate_opcode::diagonal_batch || opcode == gate_opcode::layer || opcode == gate_opcode::sequence)
+        {
+            for (const int* inner = first_param; inner < last_param; inner += 2 + inner[1])
+            {
+                add_instruction(inner);
+            }
+            return;
+        }
+        else if (has_angle_operand(opcode))
+        {
+            qmdd::weight_handle gate_weights[4];
+            builder.get_rotation_weights(opcode, angle_operand(first_param), gate_weights);
+            add_controlled(gate_weights, first_param + angle_operand_count, last_param);
+            return;
+        }
+        else
+        {
+            add_controlled(builder.get_gate_weights(opcode), first_param, last_param);
+            return;
+        }
+
+        for (size_t offset = 0; offset < microcode.size(); offset += 2 + microcode[offset + 1])
+        {
+            add_instruction(&microcode[offset]);
+        }
+    }
+
+    // the tensor with its indices reordered
+    static tensor transpose(const tensor& t, const std::vector<int>& indices)
+    {
+        int rank = (int)indices.size();
+        std::vector<int> source_shift(rank);
+        for (int i = 0; i < rank; i++)
+        {
+            int source_i = (int)(std::find(begin(t.indices), end(t.indices), indices[i]) - begin(t.indices));
+            source_shift[i] = rank - 1 - source_i;
+        }
+
+        tensor transposed{ indices, std::vector<amplitude>(t.values.size()) };
+        for (size_t entry = 0; entry < t.values.size(); entry++)
+        {
+            size_t source_entry = 0;
+            for (int i = 0; i < rank; i++)
+            {
+                source_entry |= ((entry >> (rank - 1 - i)) & 1) << source_shift[i];
+            }
+            transposed.values[entry] = t.values[source_entry];
+        }
+        return transposed;
+    }
+
+    // fixes the index to a value, dropping it from the tensor
+    void slice(int tensor_id, int index, int value)
+    {
+        tensor& t = tensors[tensor_id];
+        std::vector<int> kept;
+        for (int other : t.indices)
+        {
+            if (other != index)
+                kept.push_back(other);
+        }
+        kept.push_back(index);
+
+        // with the index last, the entries of a value are every other one
+        tensor sliced = transpose(t, kept);
+        t.values.resize(sliced.values.size() / 2);
+        for (size_t entry = 0; entry < t.values.size(); entry++)
+        {
+            t.values[entry] = sliced.values[entry * 2 + value];
+        }
+        kept.pop_back();
+        t.indices = kept;
+    }
+
+    // sums out the indices no other tensor uses. a tensor left without indices is folded into the scalar.
+    void sum_private_indices(int tensor_id)
+    {
+        tensor& t = tensors[tensor_id];
+        std::vector<int> kept, summed;
+        for (int index : t.indices)
+        {
+            if (index_users[index].size() == 1)
+                summed.push_back(index);
+            else
+                kept.push_back(index);
+        }
+
+        if (!summed.empty())
+        {
+            std::vector<int> order = kept;
+            order.insert(end(order), begin(summed), end(summed));
+            tensor reordered = transpose(t, order);
+
+            size_t block = (size_t)1 << summed.size();
+            t.values.assign(reordered.values.size() / block, 0.0);
+            for (size_t entry = 0; entry < t.values.size(); entry++)
+            {
+                for (size_t i = 0; i < block; i++)
+                    t.values[entry] += reordered.values[entry * block + i];
+            }
+            t.indices = kept;
+
+            for (int index : summed)
+                index_users[index].clear();
+        }
+
+        if (t.indices.empty())
+        {
+            scalar *= t.values[0];
+            t.live = false;
+            t.values.clear();
+        }
+    }
+
+    // the indices of the contraction of two tensors: the ones still used by other tensors.
+    std::vector<int> contracted_indices(int a, int b) const
+    {
+        std::vector<int> indices;
+        auto add = [&](const tensor& t)
+        {
+            for (int index : t.indices)
+            {
+                if (std::find(begin(indices), end(indices), index) != end(indices))
+                    continue;
+                const std::vector<int>& users = index_users[index];
+                for (int user : users)
+                {
+                    if (user != a && user != b)
+                    {
+                        indices.push_back(index);
+                        break;
+                    }
+                }
+            }
+        };
+        add(tensors[a]);
+        add(tensors[b]);
+        return indices;
+    }
+
+    // c[h][i][j] += sum over k of a[h][i][k] b[h][k][j], in blocks that stay in the cache
+    static void multiply_blocked(const amplitude* a, const amplitude* b, amplitude* c, size_t batches, size_t rows, size_t inner, size_t cols)
+    {
+        const size_t block = 64;
+        for (size_t h = 0; h < batches; h++)
+        {
+            const amplitude* ah = a + h * rows * inner;
+            const amplitude* bh = b + h * inner * cols;
+            amplitude* ch = c + h * rows * cols;
+            for (size_t i0 = 0; i0 < rows; i0 += block)
+            {
+                size_t i1 = std::min(rows, i0 + block);
+                for (size_t k0 = 0; k0 < inner; k0 += block)
+                {
+                    size_t k1 = std::min(inner, k0 + block);
+                    for (size_t j0 = 0; j0 < cols; j0 += block)
+                    {
+                        size_t j1 = std::min(cols, j0 + block);
+                        for (size_t i = i0; i < i1; i++)
+                        {
+                            for (size_t k = k0; k < k1; k++)
+                            {
+                                amplitude aik = ah[i * inner + k];
+                                if (aik == 0.0)
+                                    continue;
+                                const amplitude* bk = bh + k * cols;
+                                amplitude* ci = ch + i * cols;
+                                for (size_t j = j0; j < j1; j++)
+                                    ci[j] += aik * bk[j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // contracts tensor b into tensor a as a batched matrix product.
+    // indices in both that other tensors still use are the batch, the other shared ones are summed, and the rest are the rows and columns.
+    void contract(int a, int b)
+    {
+        std::vector<int> kept = contracted_indices(a, b);
+        if ((int)kept.size() > max_tensor_indices)
+        {
+            throw std::runtime_error("tensor network contraction needs a tensor of " + std::to_string(kept.size()) + " indices, try --feynman");
+        }
+
+        auto in = [](const std::vector<int>& indices, int index)
+        {
+            return std::find(begin(indices), end(indices), index) != end(indices);
+        };
+
+        const tensor& ta = tensors[a];
+        const tensor& tb = tensors[b];
+        std::vector<int> batch, rows, inner, cols;
+        for (int index : ta.indices)
+        {
+            if (!in(tb.indices, index))
+                rows.push_back(index);
+            else if (in(kept, index))
+                batch.push_back(index);
+            else
+                inner.push_back(index);
+        }
+        for (int index : tb.indices)
+        {
+            if (!in(ta.indices, index))
+                cols.push_back(index);
+        }
+
+        std::vector<int> a_order = batch;
+        a_order.insert(end(a_order), begin(rows), end(rows));
+        a_order.insert(end(a_order), begin(inner), end(inner));
+        std::vector<int> b_order = batch;
+        b_order.insert(end(b_order), begin(inner), end(inner));
+        b_order.insert(end(b_order), begin(cols), end(cols));
+
+        tensor a_matrix = transpose(ta, a_order);
+        tensor b_matrix = transpose(tb, b_order);
+
+        tensor product;
+        product.indices = batch;
+        product.indices.insert(end(product.indices), begin(rows), end(rows));
+        product.indices.insert(end(product.indices), begin(cols), end(cols));
+        product.values.assign((size_t)1 << product.indices.size(), 0.0);
+        multiply_blocked(a_matrix.values.data(), b_matrix.values.data(), product.values.data(),
+            (size_t)1 << batch.size(), (size_t)1 << rows.size(), (size_t)1 << inner.size(), (size_t)1 << cols.size());
+
+        for (int index : tensors[b].indices)
+        {
+            std::vector<int>& users = index_users[index];
+            users.erase(std::find(begin(users), end(users), b));
+            if (!in(users, a))
+                users.push_back(a);
+        }
+        tensors[b].live = false;
+        tensors[b].indices.clear();
+        tensors[b].values.clear();
+
+        tensors[a].indices = std::move(product.indices);
+        tensors[a].values = std::move(product.values);
+        sum_private_indices(a);
+    }
+
+    // how much contracting the two tensors grows the network, in entries
+    int64_t contraction_cost(int a, int b) const
+    {
+        return ((int64_t)1 << contracted_indices(a, b).size()) - ((int64_t)1 << tensors[a].indices.size()) - ((int64_t)1 << tensors[b].indices.size());
+    }
+
+public:
+    // the network of spec's gates between the basis states with the given bits, in variable order
+    tensor_network(const program_spec& spec, const std::vector<int>& output_bits, const std::vector<int>& input_bits, int max_tensor_indices = 24)
+        : max_tensor_indices(max_tensor_indices)
+        , weights_dd(1)
+        , builder(weights_dd)
+    {
+        for (int var_id = 0; var_id < spec.num_variables; var_id++)
+        {
+            current_index.push_back(new_index(input_bits[var_id]));
+        }
+
+        for (size_t offset = 0; offset < spec.gate_stream.size(); offset += 2 + spec.gate_stream[offset + 1])
+        {
+            add_instruction(&spec.gate_stream[offset]);
+        }
+
+        for (int var_id = 0; var_id < spec.num_variables; var_id++)
+        {
+            int& fixed_value = fixed_values[current_index[var_id]];
+            if (fixed_value != -1 && fixed_value != output_bits[var_id])
+            {
+                // no gate changes this variable, so the entry is 0
+                scalar = 0.0;
+            }
+            fixed_value = output_bits[var_id];
+        }
+    }
+
+    // contracts the network to the entry, picking the pair of tensors that grows it the least each time
+    amplitude contract()
+    {
+        if (scalar == 0.0)
+        {
+            return scalar;
+        }
+
+        for (int tensor_id = 0; tensor_id < (int)tensors.size(); tensor_id++)
+        {
+            std::vector<int> fixed;
+            for (int index : tensors[tensor_id].indices)
+            {
+                if (fixed_values[index] != -1)
+                    fixed.push_back(index);
+            }
+            for (int index : fixed)
+            {
+                slice(tensor_id, index, fixed_values[index]);
+                std::vector<int>& users = index_users[index];
+                users.erase(std::find(begin(users), end(users), tensor_id));
+            }
+        }
+        for (int tensor_id = 0; tensor_id < (int)tensors.size(); tensor_id++)
+        {
+            sum_private_indices(tensor_id);
+        }
+
+        // candidate pairs share an index. the costs are from when a pair was queued, and pairs with a dead tensor are skipped.
+        using candidate = std::pair<int64_t, std::pair<int, int>>;
+        std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> queue;
+        auto queue_neighbors = [&](int tensor_id)
+        {
+            for (int index : tensors[tensor_id].indices)
+            {
+                for (int user : index_users[index])
+                {
+                    if (user != tensor_id)
+                        queue.push({ contraction_cost(tensor_id, user), { tensor_id, user } });
+                }
+            }
+        };
+
+        for (int tensor_id = 0; tensor_id < (int)tensors.size(); tensor_id++)
+        {
+            if (tensors[tensor_id].live)
+                queue_neighbors(tensor_id);
+        }
+
+        while (!queue.empty())
+        {
+            int a = queue.top().second.first;
+            int b = queue.top().second.second;
+            queue.pop();
+            if (!tensors[a].live || !tensors[b].live)
+                continue;
+
+            contract(a, b);
+            if (tensors[a].live)
+                queue_neighbors(a);
+        }
+
+        return scalar;
+    }
+};
+
+// the entry <x|U|y> of a program's matrix as a sum over paths, in memory linear in the number of variables.
+// a path is a basis state after every gate. gates whose matrices have one nonzero entry per column, like not, fredkin, y, z, s and q,
+// take a basis state to one basis state times a factor, so they're applied to a bit vector. the others, like h, v and v', branch into both values of their target.
+// the paths are enumerated depth first from y, and split among threads at the first branches.
+class feynman_paths
+{
+public:
+    using amplitude = std::complex<double>;
+
+private:
+    struct step
+    {
+        std::vector<int> controls;
+        int target;
+        amplitude matrix[4];
+        bool branches;
+
+        // whether no later step changes the target, so it has to match x afterwards
+        bool last_change;
+    };
+
+    struct memo_entry
+    {
+        int step_i = -1;
+        std::vector<uint64_t> bits;
+        amplitude suffix_sum;
+    };
+
+    // a path at the point where it was split off for a thread, and the factor it had
+    struct task
+    {
+        int step_i;
+        std::vector<uint64_t> bits;
+        amplitude factor;
+    };
+
+    int num_variables;
+    std::vector<step> steps;
+    std::vector<uint64_t> output_bits;
+    std::vector<uint64_t> input_bits;
+
+    // per thread, the sums over the rest of the paths from some states at branching steps.
+    // a state reached again by another path reuses its sum. the table is direct mapped, so its size is fixed.
+    size_t memo_entries;
+
+    qmdd weights_dd;
+    gate_builder builder;
+
+    static int get_bit(const std::vector<uint64_t>& bits, int var_id)
+    {
+        return (int)(bits[var_id / 64] >> (var_id % 64)) & 1;
+    }
+
+    static void set_bit(std::vector<uint64_t>& bits, int var_id, int value)
+    {
+        bits[var_id / 64] = (bits[var_id / 64] & ~(1ull << (var_id % 64))) | ((uint64_t)value << (var_id % 64));
+    }
+
+    static std::vector<uint64_t> pack(const std::vector<int>& values)
+    {
+        std::vector<uint64_t> bits((values.size() + 63) / 64);
+        for (size_t var_id = 0; var_id < values.size(); var_id++)
+        {
+            set_bit(bits, (int)var_id, values[var_id]);
+        }
+        return bits;
+    }
+
+    void add_controlled(const qmdd::weight_handle* gate_weights, const int* first_param, const int* last_param)
+    {
+        step s;
+        s.controls.assign(first_param, last_param - 1);
+        s.target = operand_var_id(*(last_param - 1));
+        for (int i = 0; i < 4; i++)
+        {
+            s.matrix[i] = weights_dd.to_complex(gate_weights[i]);
+        }
+        bool diagonal = s.matrix[1] == 0.0 && s.matrix[2] == 0.0;
+        bool antidiagonal = s.matrix[0] == 0.0 && s.matrix[3] == 0.0;
+        s.branches = !diagonal && !antidiagonal;
+        s.last_change = false;
+        steps.push_back(s);
+    }
+
+    void add_instruction(const int* instr)
+    {
+        gate_opcode opcode = (gate_opcode)instr[0];
+        const int* first_param = instr + 2;
+        const int* last_param = first_param + instr[1];
+
+        std::vector<int> microcode;
+        if (opcode == gate_opcode::fredkin)
+        {
+            append_fredkin_microcode(first_param, last_param, &microcode);
+        }
+        else if (opcode == gate_opcode::peres || opcode == gate_opcode::inv_peres)
+        {
+            append_peres_microcode(first_param, last_param, opcode == gate_opcode::inv_peres, &microcode);
+        }
+        else if (opcode == gate_opcode::multi_target)
+        {
+            // the base gates don't change the controls, so they can be applied one target at a time
+            int num_controls = first_param[0];
+            const int* first_control = first_param + 1;
+            for (const int* target = first_control + num_controls; target < last_param; target += 2)
+            {
+                std::vector<int> params(first_control, first_control + num_controls);
+                params.push_back(target[1]);
+                add_controlled(builder.get_gate_weights((gate_opcode)target[0]), params.data(), params.data() + params.size());
+            }
+            return;
+        }
+        else if (opcode == gate_opcode::diagonal_batch || opcode == gate_opcode::layer || opcode == gate_opcode::sequence)
+        {
+            for (const int* inner = first_param; inner < last_param; inner += 2 + inner[1])
+            {
+                add_instruction(inner);
+            }
+            return;
+        }
+        else if (has_angle_operand(opcode))
+        {
+            qmdd::weight_handle gate_weights[4];
+            builder.get_rotation_weights(opcode, angle_operand(first_param), gate_weights);
+            add_controlled(gate_weights, first_param + angle_operand_count, last_param);
+            return;
+        }
+        else
+        {
+            add_controlled(builder.get_gate_weights(opcode), first_param, last_param);
+            return;
+        }
+
+        for (size_t offset = 0; offset < microcode.size(); offset += 2 + microcode[offset + 1])
+        {
+            add_instruction(&microcode[offset]);
+        }
+    }
+
+    bool is_active(const step& s, const std::vector<uint64_t>& bits) const
+    {
+        for (int control : s.controls)
+        {
+            if (get_bit(bits, operand_var_id(control)) != (is_negated_control(control) ? 0 : 1))
+                return false;
+        }
+        return true;
+    }
+
+    static size_t hash_state(int step_i, const std::vector<uint64_t>& bits)
+    {
+        size_t h = (size_t)step_i * 0x9E3779B97F4A7C15ull;
+        for (uint64_t word : bits)
+        {
+            h = (h ^ word) * 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+        }
+        return h;
+    }
+
+    // the sum over the paths from the state before step_i to x, of the products of their factors.
+    // with tasks, the paths that reach a branch at split_depth are added to it instead, and count as 0.
+    amplitude sum_suffix(int step_i, std::vector<uint64_t> bits, std::vector<memo_entry>* memo, int split_depth, std::vector<task>* tasks, amplitude factor_so_far) const
+    {
+        amplitude factor = 1.0;
+        for (; step_i < (int)steps.size(); step_i++)
+        {
+            const step& s = steps[step_i];
+            if (!is_active(s, bits))
+                continue;
+
+            int in_bit = get_bit(bits, s.target);
+            if (!s.branches)
+            {
+                int out_bit = s.matrix[in_bit * 2 + in_bit] == 0.0 ? 1 - in_bit : in_bit;
+                factor *= s.matrix[out_bit * 2 + in_bit];
+                set_bit(bits, s.target, out_bit);
+                if (s.last_change && out_bit != get_bit(output_bits, s.target))
+                    return 0.0;
+                continue;
+            }
+
+            if (tasks && split_depth == 0)
+            {
+                tasks->push_back(task{ step_i, bits, factor_so_far * factor });
+                return 0.0;
+            }
+
+            memo_entry* entry = NULL;
+            if (memo)
+            {
+                entry = &(*memo)[hash_state(step_i, bits) % memo->size()];
+                if (entry->step_i == step_i && entry->bits == bits)
+                    return factor * entry->suffix_sum;
+            }
+
+            amplitude suffix_sum = 0.0;
+            for (int out_bit = 0; out_bit < 2; out_bit++)
+            {
+                amplitude m = s.matrix[out_bit * 2 + in_bit];
+                if (m == 0.0 || (s.last_change && out_bit != get_bit(output_bits, s.target)))
+                    continue;
+
+                std::vector<uint64_t> branch_bits = bits;
+                set_bit(branch_bits, s.target, out_bit);
+                suffix_sum += m * sum_suffix(step_i + 1, std::move(branch_bits), memo, split_depth - 1, tasks, factor_so_far * factor * m);
+            }
+
+            if (entry)
+            {
+                entry->step_i = step_i;
+                entry->bits = bits;
+                entry->suffix_sum = suffix_sum;
+            }
+            return factor * suffix_sum;
+        }
+
+        return bits == output_bits ? factor : amplitude(0.0);
+    }
+
+public:
+    // the paths of spec's gates between the basis states with the given bits, in variable order
+    feynman_paths(const program_spec& spec, const std::vector<int>& output_values, const std::vector<int>& input_values, size_t memo_entries = 1 << 14)
+        : num_variables(spec.num_variables)
+        , output_bits(pack(output_values))
+        , input_bits(pack(input_values))
+        , memo_entries(memo_entries)
+        , weights_dd(1)
+        , builder(weights_dd)
+    {
+        for (size_t offset = 0; offset < spec.gate_stream.size(); offset += 2 + spec.gate_stream[offset + 1])
+        {
+            add_instruction(&spec.gate_stream[offset]);
+        }
+
+        std::vector<bool> changed(num_variables);
+        for (auto s = steps.rbegin(); s != steps.rend(); ++s)
+        {
+            if (s->matrix[1] != 0.0 || s->matrix[2] != 0.0)
+            {
+                s->last_change = !changed[s->target];
+                changed[s->target] = true;
+            }
+        }
+    }
+
+    amplitude sum(int num_threads)
+    {
+        // variables that no gate changes have to match already
+        std::vector<bool> changed(num_variables);
+        for (const step& s : steps)
+        {
+            if (s.last_change)
+                changed[s.target] = true;
+        }
+        for (int var_id = 0; var_id < num_variables; var_id++)
+        {
+            if (!changed[var_id] && get_bit(input_bits, var_id) != get_bit(output_bits, var_id))
+                return 0.0;
+        }
+
+        // splitting at the first branches of a path gives up to 2^split_depth tasks, enough for every thread to have a few
+        int split_depth = 0;
+        while (num_threads > 1 && (1 << split_depth) < num_threads * 8 && split_depth < 20)
+        {
+            split_depth++;
+        }
+
+        std::vector<task> tasks;
+        amplitude total = sum_suffix(0, input_bits, NULL, split_depth, &tasks, 1.0);
+
+        std::vector<amplitude> thread_sums(std::max(num_threads, 1));
+        std::atomic<size_t> next_task(0);
+        auto work = [&](int thread_i)
+        {
+            std::vector<memo_entry> memo(memo_entries);
+            for (size_t task_i = next_task++; task_i < tasks.size(); task_i = next_task++)
+            {
+                const task& t = tasks[task_i];
+                thread_sums[thread_i] += t.factor * sum_suffix(t.step_i, t.bits, &memo, -1, NULL, 1.0);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int thread_i = 1; thread_i < num_threads; thread_i++)
+        {
+            threads.emplace_back(work, thread_i);
+        }
+        work(0);
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        for (amplitude thread_sum : thread_sums)
+        {
+            total += thread_sum;
+        }
+        return total;
+    }
+};
+
+void write_dot(
+    const char* title,
+    const program_spec& spec, const qmdd& dd,
+    const qmdd::edge& root,
+    const char* fn)
+{
+    static const int p = qmdd::p;
+
+    FILE* f = fopen(fn, "w");
+
+    if (!f)
+    {
+        throw std::runtime_error(std::string("failed to open ") + fn);
+    }
+
+    fprintf(f, "digraph {\n");
+
+    fprintf(f, "  labelloc=\"t\";\n");
+    fprintf(f, "  label=\"%s\";\n", title);
+    fprintf(f, "  splines=line;\n");
+
+    std::vector<qmdd::node_handle> nodes2add = { root.v };
+
+    qmdd::node_handle true_node = dd.get_true();
+
+    struct node_hasher
+    {
+        auto operator()(qmdd::node_handle n) const
+        {
+            return n.value;
+        }
+    };
+
+    std::unordered_set<qmdd::node_handle, node_hasher> added;
+    added.insert(true_node);
+
+    std::unordered_set<qmdd::node_handle, node_hasher> declared;
+    
+    fprintf(f, "  root [shape=point,width=0.001,height=0.001];\n");
+    fprintf(f, "  root -> n%u [label=\"%s\"];\n", root.v.value, dd.to_string(root.w).c_str());
+
+    if (root.v == true_node)
+    {
+        fprintf(f, "  n%u [label=\"1\",shape=box];\n", true_node.value);
+    }
+    else
+    {
+        fprintf(f, "  n%u [label=\"%s\",shape=circle];\n", root.v.value, spec.variable_names[dd.get_var(root.v)].c_str());
+    }
+
+    declared.insert(root.v);
+
+    while (!nodes2add.empty())
+    {
+        qmdd::node_handle n = nodes2add.back();
+        nodes2add.pop_back();
+
+        if (added.find(n) != end(added))
+            continue;
+
+        qmdd::node_handle children[p * p];
+        dd.get_children(n, children);
+
+        qmdd::weight_handle weights[p * p];
+        dd.get_weights(n, weights);
+
+        for (int child_idx = 0; child_idx < p * p; child_idx++)
+        {
+            qmdd::node_handle child = children[child_idx];
+
+            if (declared.insert(child).second)
+            {
+                if (child == true_node)
                 {
-                    // kronecker with 0 always gives 0
-                    if (w(e0) == weight_0_handle)
-                        return e0;
-                    else if (w(e0) == weight_1_handle)
-                        return e1; // avoid multiplication for the case of multiplying by 1
-                    else
-                        return edge(dd->apply(w(e0), w(e1), weight_op_mul), v(e1));
+                    fprintf(f, "  n%u [label=\"1\",shape=box];\n", child.value);
                 }
-                
-                // simplifying assumption to avoid having to determine which variable is the top one
-                assert(x(e0) < x(e1));
+                else
+                {
+                    fprintf(f, "  n%u [label=\"%s\",shape=circle];\n", child.value, spec.variable_names[dd.get_var(child)].c_str());
+                }
+            }
 
-                // recursively kronecker
-                node_handle z_children[p*p];
-                weight_handle z_weights[p*p];
-                for (int i = 0; i < p*p; i++)
+            if (added.find(child) == end(added))
+                nodes2add.push_back(child);
+        }
+
+        // "invisible" row of nodes for the child weights, then point those invisible nodes to the real nodes.
+        fprintf(f, "  subgraph c%u {\n", n.value);
+        {
+            fprintf(f, "    rank=same;\n");
+            fprintf(f, "    edge[style=invisible,dir=none];\n");
+
+            for (int i = 0; i < p * p; i++)
+            {
+                const char* color = i % 2 == 0 ? "red" : "black";
+
+                if (weights[i] == qmdd::weight_0_handle)
                 {
-                    edge zi = dd->apply(Ei(e0, i), e1, edge_op_kro);
-                    z_children[i] = zi.v;
-                    z_weights[i] = zi.w;
+                    fprintf(f, "    c%u_%d[shape=point,color=%s];\n", n.value, i, color);
+                }
+                else
+                {
+                    fprintf(f, "    c%u_%d[shape=point,width=0.01,height=0.01,color=%s];\n", n.value, i, color);
+                }
+            }
+
+            // used for rank order...
+            fprintf(f, "    c%u_%d[shape=point,width=0,height=0,style=invis];\n", n.value, p*p);
+
+            for (int i = 0; i <= p * p; i++)
+            {
+                if (i == 0)
+                    fprintf(f, "    ");
+                else
+                    fprintf(f, " -> ");
+
+                if (i == p*p / 2)
+                {
+                    // putting the invisible node here make the children more centered
+                    fprintf(f, "c%u_%d", n.value, p*p);
+                }
+                else if (i > p*p / 2)
+                {
+                    fprintf(f, "c%u_%d", n.value, i - 1);
                 }
+                else
+                {
+                    fprintf(f, "c%u_%d", n.value, i);
+                }
+            }
+
+            fprintf(f, ";\n");
+        }
+        fprintf(f, "  }\n");
+
+        for (int i = 0; i < p * p; i++)
+        {
+            const char* color = i % 2 == 0 ? "red" : "black";
+            fprintf(f, "  n%u -> c%u_%d [label=\"%s\", arrowhead=none,color=%s,fontcolor=%s];\n", n.value, n.value, i, dd.to_string(weights[i]).c_str(), color, color);
+        }
+
+        for (int i = 0; i < p * p; i++)
+        {
+            if (weights[i] == qmdd::weight_0_handle)
+            {
+                continue;
+            }
+
+            const char* color = i % 2 == 0 ? "red" : "black";
+            fprintf(f, "  c%u_%d -> n%u [constraint=false,color=%s];\n", n.value, i, children[i].value, color);
+            fprintf(f, "  c%u_%d -> n%u [style=invis];\n", n.value, p*p, children[i].value);
+        }
+
+        added.insert(n);
+    }
+
+    fprintf(f, "}\n");
+
+    fclose(f);
+}
+
+void write_qmdd(const qmdd& dd, const qmdd::edge& root, const char* fn)
+{
+    FILE* f = fopen(fn, "w");
+
+    if (!f)
+    {
+        throw std::runtime_error(std::string("failed to open ") + fn);
+    }
+
+    dd.serialize(f, root);
+
+    fclose(f);
+}
+
+void display_dot(const char* fn)
+{
+    std::string dotcmd = std::string("packages\\Graphviz.2.38.0.2\\dot.exe") + " -Tpng " + fn + " -o " + fn + ".png";
+    if (system(dotcmd.c_str()) == 0)
+    {
+        std::string pngcmd = std::string(fn) + ".png";
+        system(pngcmd.c_str());
+    }
+}
 
-                // normalize weights
-                weight_handle new_weight = normalize(z_weights);
-                new_weight = dd->apply(new_weight, w(e0), weight_op_mul);
+void print_memory_report(const decode_report& report)
+{
+    printf("subsystem              entries       capacity       peak   used KiB  capacity KiB  peak KiB\n");
+    for (int i = 0; i < qmdd::memory_subsystem_count; i++)
+    {
+        const qmdd::memory_usage& m = report.memory.subsystems[i];
+        printf("%-16s %13zu %14zu %10zu %10zu %13zu %9zu\n",
+            qmdd::memory_subsystem_name(i), m.entries, m.capacity, m.peak_entries,
+            m.used_bytes / 1024, m.capacity_bytes / 1024, m.peak_used_bytes / 1024);
+    }
+    printf("total: %zu KiB used, %zu KiB peak\n", report.memory.total_used_bytes / 1024, report.memory.peak_total_used_bytes / 1024);
 
-                // make the new node
-                node_handle new_node = dd->make_node(x(e0), z_children, z_weights);
+    uint32_t allocated = report.num_nodes;
+    printf("live nodes: %u of %u allocated (%.1f%% garbage)\n",
+        report.live_nodes, allocated, allocated == 0 ? 0.0 : 100.0 * (allocated - report.live_nodes) / allocated);
+}
 
-                return edge(new_weight, new_node);
+// whether a program only has gates that permute basis states without changing their phases, so it can be simulated on bits
+bool is_classical_reversible(const program_spec& spec)
+{
+    for (size_t offset = 0; offset < spec.gate_stream.size(); offset += 2 + spec.gate_stream[offset + 1])
+    {
+        const int* instr = &spec.gate_stream[offset];
+        gate_opcode opcode = (gate_opcode)instr[0];
+        if (opcode == gate_opcode::multi_target)
+        {
+            const int* first_target = instr + 3 + instr[2];
+            for (const int* target = first_target; target < instr + 2 + instr[1]; target += 2)
+            {
+                if ((gate_opcode)target[0] != gate_opcode::toffoli)
+                    return false;
             }
-        };
-
-        edge found = computedtb.find(e0, e1, op);
-        if (found.v != invalid_node)
+        }
+        else if (opcode != gate_opcode::toffoli && opcode != gate_opcode::fredkin && opcode != gate_opcode::peres && opcode != gate_opcode::inv_peres)
         {
-            return found;
+            return false;
         }
+    }
+    return true;
+}
 
-        apply_helper helper{ this };
-
-        edge new_edge;
-
-        if (op == edge_op_add)
+// applies a program for which is_classical_reversible() holds to 64 inputs at once, one per bit of each variable's word
+void simulate_bit_parallel(const int* first_instr, const int* last_instr, std::vector<uint64_t>* words)
+{
+    auto active_lanes = [words](const int* first_control, const int* last_control)
+    {
+        uint64_t active = ~0ull;
+        for (const int* control = first_control; control != last_control; ++control)
         {
-            new_edge = helper.add(e0, e1);
+            uint64_t word = (*words)[operand_var_id(*control)];
+            active &= is_negated_control(*control) ? ~word : word;
         }
-        else if (op == edge_op_mul)
+        return active;
+    };
+
+    for (const int* instr = first_instr; instr < last_instr; instr += 2 + instr[1])
+    {
+        gate_opcode opcode = (gate_opcode)instr[0];
+        const int* first_param = instr + 2;
+        const int* last_param = first_param + instr[1];
+
+        std::vector<int> microcode;
+        if (opcode == gate_opcode::toffoli)
         {
-            new_edge = helper.mul(e0, e1);
+            (*words)[operand_var_id(*(last_param - 1))] ^= active_lanes(first_param, last_param - 1);
         }
-        else if (op == edge_op_kro)
+        else if (opcode == gate_opcode::multi_target)
         {
-            new_edge = helper.kro(e0, e1);
+            const int* first_target = first_param + 1 + first_param[0];
+            uint64_t active = active_lanes(first_param + 1, first_target);
+            for (const int* target = first_target; target < last_param; target += 2)
+            {
+                (*words)[target[1]] ^= active;
+            }
         }
         else
         {
-            assert(!"unimplemented op");
-            return edge(invalid_weight, invalid_node);
+            if (opcode == gate_opcode::fredkin)
+                append_fredkin_microcode(first_param, last_param, &microcode);
+            else
+                append_peres_microcode(first_param, last_param, opcode == gate_opcode::inv_peres, &microcode);
+            simulate_bit_parallel(microcode.data(), microcode.data() + microcode.size(), words);
         }
+    }
+}
 
-        computedtb.insert(e0, e1, op, new_edge);
+// the state U|input> of a basis input, as a matrix whose column 0 is the state and whose other columns are 0.
+// the gates multiply a single column, so the products stay the size of the state instead of the matrix.
+// the returned edge has weight 1 and the state's scale is returned separately, since the exact weights of deep circuits overflow.
+qmdd::edge simulate_basis_input(const program_spec& spec, qmdd& dd, gate_builder& builder, const std::vector<int>& input, std::complex<double>* scale)
+{
+    static const int p = qmdd::p;
 
-        return new_edge;
+    qmdd::edge state = qmdd::edge(qmdd::weight_1_handle, dd.get_true());
+    for (int var_id = spec.num_variables - 1; var_id >= 0; var_id--)
+    {
+        qmdd::weight_handle column_weights[p * p];
+        for (int i = 0; i < p * p; i++)
+        {
+            if (i == input[var_id] * p)
+                column_weights[i] = qmdd::weight_1_handle;
+            else
+                column_weights[i] = qmdd::weight_0_handle;
+        }
+        state = dd.apply(builder.make_level(var_id, column_weights), state, qmdd::edge_op_kro);
     }
 
-    std::string to_string(weight_handle w) const
+    for (size_t offset = 0; offset < spec.gate_stream.size(); offset += 2 + spec.gate_stream[offset + 1])
     {
-        return uniquewt.get_weight(w).to_string();
+        state = dd.apply(builder.build_instruction(&spec.gate_stream[offset]), state, qmdd::edge_op_mul);
+        *scale *= dd.to_complex(state.w);
+        state.w = qmdd::weight_1_handle;
     }
+    return state;
+}
+
+struct probe_report
+{
+    bool falsified = false;
+
+    // the input whose outputs differ, or two inputs whose outputs differ by different factors, so the matrices don't differ by a global phase
+    std::vector<std::vector<int>> inputs;
 };
 
-void decode(const program_spec& spec, qmdd& dd, qmdd::edge* root_out)
+// pushes random basis inputs through two programs over the same variables, on several threads, until the outputs of one differ.
+// classical reversible programs are simulated on 64 inputs at once, others as states in a qmdd per thread.
+probe_report probe_random_inputs(const program_spec& spec0, const program_spec& spec1, int num_probes, int num_threads, uint64_t seed)
 {
-    using node_handle = qmdd::node_handle;
-    using weight_handle = qmdd::weight_handle;
-    using edge = qmdd::edge;
+    int n = spec0.num_variables;
+    bool bit_parallel = is_classical_reversible(spec0) && is_classical_reversible(spec1);
+    int num_batches = bit_parallel ? (num_probes + 63) / 64 : num_probes;
 
-    static const int p = qmdd::p;
-    static const weight_handle weight_0_handle = qmdd::weight_0_handle;
-    static const weight_handle weight_1_handle = qmdd::weight_1_handle;
+    probe_report report;
+    std::mutex report_mutex;
+    std::atomic<bool> falsified(false);
 
-    node_handle true_node = dd.get_true();
+    // the factor between the outputs of the first probe, which every other probe has to match
+    bool have_factor = false;
+    std::vector<int> factor_input;
+    std::complex<double> factor;
 
-    node_handle identity_children[p * p];
-    weight_handle identity_weights[p * p];
-    weight_handle not_weights[p * p];
-    for (int i = 0; i < p; i++)
+    auto work = [&](int thread_i)
     {
-        for (int j = 0; j < p; j++)
+        std::mt19937_64 rng(seed + (uint64_t)thread_i);
+        std::unique_ptr<qmdd> dd;
+        std::unique_ptr<gate_builder> builder;
+        if (!bit_parallel)
+        {
+            dd.reset(new qmdd(n));
+            builder.reset(new gate_builder(*dd));
+        }
+
+        for (int batch = thread_i; batch < num_batches && !falsified; batch += num_threads)
         {
-            identity_children[i * p + j] = true_node;
+            if (bit_parallel)
+            {
+                std::vector<uint64_t> inputs(n);
+                for (uint64_t& word : inputs)
+                    word = rng();
+
+                std::vector<uint64_t> outputs[2] = { inputs, inputs };
+                simulate_bit_parallel(spec0.gate_stream.data(), spec0.gate_stream.data() + spec0.gate_stream.size(), &outputs[0]);
+                simulate_bit_parallel(spec1.gate_stream.data(), spec1.gate_stream.data() + spec1.gate_stream.size(), &outputs[1]);
+
+                uint64_t differing = 0;
+                for (int var_id = 0; var_id < n; var_id++)
+                    differing |= outputs[0][var_id] ^ outputs[1][var_id];
+                if (differing == 0)
+                    continue;
 
-            if (i == j)
-                identity_weights[i * p + j] = weight_1_handle;
-            else
-                identity_weights[i * p + j] = weight_0_handle;
+                int lane = 0;
+                while (!((differing >> lane) & 1))
+                    lane++;
+                std::vector<int> input(n);
+                for (int var_id = 0; var_id < n; var_id++)
+                    input[var_id] = (int)(inputs[var_id] >> lane) & 1;
+
+                std::lock_guard<std::mutex> lock(report_mutex);
+                if (!report.falsified)
+                {
+                    report.falsified = true;
+                    report.inputs = { input };
+                }
+                falsified = true;
+                continue;
+            }
+
+            std::vector<int> input(n);
+            for (int& bit : input)
+                bit = (int)(rng() & 1);
+
+            std::complex<double> scales[2] = { 1.0, 1.0 };
+            qmdd::edge states[2] = { simulate_basis_input(spec0, *dd, *builder, input, &scales[0]), simulate_basis_input(spec1, *dd, *builder, input, &scales[1]) };
 
-            if (i == p - 1 - j)
-                not_weights[i * p + j] = weight_1_handle;
+            std::lock_guard<std::mutex> lock(report_mutex);
+            if (report.falsified)
+                break;
+            if (states[0].v != states[1].v)
+            {
+                report.falsified = true;
+                report.inputs = { input };
+            }
             else
-                not_weights[i * p + j] = weight_0_handle;
+            {
+                std::complex<double> probe_factor = scales[0] / scales[1];
+                if (!have_factor)
+                {
+                    have_factor = true;
+                    factor_input = input;
+                    factor = probe_factor;
+                }
+                else if (std::abs(probe_factor - factor) > 1e-9)
+                {
+                    report.falsified = true;
+                    report.inputs = { factor_input, input };
+                }
+            }
+            falsified = report.falsified;
         }
-    }
+    };
 
-    weight_handle zero_weights[p * p];
-    for (int i = 0; i < p * p; i++)
+    std::vector<std::thread> threads;
+    for (int thread_i = 1; thread_i < num_threads; thread_i++)
+    {
+        threads.emplace_back(work, thread_i);
+    }
+    work(0);
+    for (std::thread& thread : threads)
     {
-        zero_weights[i] = weight_0_handle;
+        thread.join();
     }
 
-    weight_handle if_false_weights[p * p];
-    for (int i = 0; i < p * p; i++)
+    return report;
+}
+
+// prints whether two programs have the same matrix up to a global phase, trying random inputs and their path sums before decoding both into one qmdd.
+// returns 0 if they do, 1 if they don't, and 2 if decoding stopped early.
+int check_equivalence(const program_spec& spec0, const program_spec& spec1, const qmdd::storage_options& storage, const decode_options& options, const pipeline_options& pipeline, int num_probes, int num_threads)
+{
+    if (spec0.variable_names != spec1.variable_names)
     {
-        if (i == 0)
-            if_false_weights[i] = weight_1_handle;
-        else
-            if_false_weights[i] = weight_0_handle;
+        throw std::runtime_error("the programs don't have the same variables in the same order");
     }
 
-    weight_handle if_true_weights[p * p];
-    for (int i = 0; i < p * p; i++)
+    // the probes and the path sum compare whole outputs, so they can't ignore the garbage outputs of reduce_ancillas
+    auto bits = [](const std::vector<int>& input)
+    {
+        std::string s;
+        for (int bit : input)
+            s += char('0' + bit);
+        return s;
+    };
+    auto falsified_by_probes = [&]()
     {
-        if (i == p * p - 1)
-            if_true_weights[i] = weight_1_handle;
+        if (options.reduce_ancillas || num_probes == 0)
+            return false;
+
+        probe_report probes = probe_random_inputs(spec0, spec1, num_probes, num_threads, std::random_device()());
+        if (probes.falsified && probes.inputs.size() == 1)
+            printf("probes: not equivalent, the outputs differ for input %s\n", bits(probes.inputs[0]).c_str());
+        else if (probes.falsified)
+            printf("probes: not equivalent, the outputs for inputs %s and %s differ by different factors\n", bits(probes.inputs[0]).c_str(), bits(probes.inputs[1]).c_str());
         else
-            if_true_weights[i] = weight_0_handle;
-    }
+            printf("probes: %d random inputs agree\n", num_probes);
+        return probes.falsified;
+    };
 
-    weight_handle y_weights[p * p];
-    if (p == 2)
+    // bits are cheaper than any sum, but the states of other programs can cost more than a path sum that decides
+    bool classical = is_classical_reversible(spec0) && is_classical_reversible(spec1);
+    if (classical && falsified_by_probes())
+        return 1;
+
+    if (!options.reduce_ancillas)
     {
-        y_weights[0] = weight_0_handle;
-        y_weights[1] = dd.apply(weight_0_handle, dd.get_weight_i_handle(), qmdd::weight_op_sub);
-        y_weights[2] = dd.get_weight_i_handle();
-        y_weights[3] = weight_0_handle;
+        int global_phase;
+        path_sum::result result = compare_path_sums(spec0, spec1, 1 << 20, &global_phase);
+        if (result == path_sum::result::equivalent)
+        {
+            if (global_phase == 0)
+                printf("path sum: equivalent\n");
+            else
+                printf("path sum: equivalent up to a global phase of e^(%di pi/4)\n", global_phase);
+            return 0;
+        }
+        if (result == path_sum::result::not_equivalent)
+        {
+            printf("path sum: not equivalent\n");
+            return 1;
+        }
+        printf("path sum: inconclusive\n");
     }
 
-    weight_handle z_weights[p * p];
-    if (p == 2)
+    if (!classical && falsified_by_probes())
+        return 1;
+
+    // both products are in one qmdd, where equal matrices have equal edges
+    qmdd dd(spec0.num_variables, storage);
+    qmdd::edge roots[2];
+    const program_spec* specs[2] = { &spec0, &spec1 };
+    for (int i = 0; i < 2; i++)
     {
-        z_weights[0] = weight_1_handle;
-        z_weights[1] = weight_0_handle;
-        z_weights[2] = weight_0_handle;
-        z_weights[3] = dd.apply(weight_0_handle, weight_1_handle, qmdd::weight_op_sub);
+        decode_report report;
+        spec_gate_source parsed_gates(*specs[i]);
+        decode(*specs[i], dd, options, pipeline, parsed_gates, &roots[i], &report);
+        if (!report.completed)
+        {
+            printf("budget exceeded: %s\n", report.stop_reason.c_str());
+            return 2;
+        }
     }
 
-    weight_handle sqrtnot_weights[p * p];
-    weight_handle inv_sqrtnot_weights[p * p];
-    if (p == 2)
+    if (roots[0].v == roots[1].v && roots[0].w == roots[1].w)
     {
-        weight_handle weight_2_handle = dd.apply(weight_1_handle, weight_1_handle, qmdd::weight_op_add);
-
-        weight_handle one_add_i_by_2 = dd.apply(dd.apply(weight_1_handle, dd.get_weight_i_handle(), qmdd::weight_op_add), weight_2_handle, qmdd::weight_op_div);
-        weight_handle one_sub_i_by_2 = dd.apply(dd.apply(weight_1_handle, dd.get_weight_i_handle(), qmdd::weight_op_sub), weight_2_handle, qmdd::weight_op_div);
-        
-        sqrtnot_weights[0] = one_add_i_by_2;
-        sqrtnot_weights[1] = one_sub_i_by_2;
-        sqrtnot_weights[2] = one_sub_i_by_2;
-        sqrtnot_weights[3] = one_add_i_by_2;
-
-        inv_sqrtnot_weights[0] = one_sub_i_by_2;
-        inv_sqrtnot_weights[1] = one_add_i_by_2;
-        inv_sqrtnot_weights[2] = one_add_i_by_2;
-        inv_sqrtnot_weights[3] = one_sub_i_by_2;
+        printf("qmdd: equivalent\n");
+        return 0;
     }
-
-    weight_handle hadamard_weights[p * p];
-    if (p == 2)
+    if (roots[0].v == roots[1].v)
     {
-        weight_handle one_by_sq2 = dd.apply(weight_1_handle, dd.get_weight_sq2_handle(), qmdd::weight_op_div);
-
-        hadamard_weights[0] = one_by_sq2;
-        hadamard_weights[1] = one_by_sq2;
-        hadamard_weights[2] = one_by_sq2;
-        hadamard_weights[3] = dd.apply(weight_0_handle, one_by_sq2, qmdd::weight_op_sub);
+        // the matrices are unitary, so a factor between them has modulus 1
+        printf("qmdd: equivalent up to a global phase\n");
+        return 0;
     }
+    printf("qmdd: not equivalent\n");
+    return 1;
+}
 
-    weight_handle rotate_pi_by_4_weights[p * p];
-    weight_handle inv_rotate_pi_by_4_weights[p * p];
-    if (p == 2)
+void print_usage(const char* exe)
+{
+    printf("Usage: %s [options] <input>\n", exe);
+    printf("<input> is a tfc file, an OpenQASM 2.0 file if its name ends in .qasm, or a RevLib file if it ends in .real\n");
+    printf("Options:\n");
+    printf("  --max-nodes <n>      stop decoding once more than n nodes are allocated\n");
+    printf("  --max-weights <n>    stop decoding once more than n weights are allocated\n");
+    printf("  --max-bytes <n>      stop decoding once more than n bytes are in use\n");
+    printf("  --max-seconds <s>    stop decoding after s seconds\n");
+    printf("  --partial <file>     if decoding stops early, write the partial product to file\n");
+    printf("  --checkpoint <file>  periodically save decoding progress to file\n");
+    printf("  --checkpoint-seconds <s>\n");
+    printf("                       seconds between checkpoints (default 60)\n");
+    printf("  --checkpoint-gates <n>\n");
+    printf("                       gates between checkpoints\n");
+    printf("  --resume             continue from the checkpoint file, if it exists\n");
+    printf("  --node-capacity <n>  size of the node pool, rounded up to a power of two\n");
+    printf("  --node-store <file>  keep the node pool in a memory-mapped file instead of RAM\n");
+    printf("  --pin-levels <n>     lock the nodes of the top n levels of the node store in memory\n");
+    printf("  --shared-memory <name>\n");
+    printf("                       keep the diagram in a shared memory segment that other processes can build on\n");
+    printf("  --residency-report   print the per-level memory residency of the node store\n");
+    printf("  --mem-report         print the memory used by each subsystem\n");
+    printf("  --shape <file>       write the per-level shape of the result to file as JSON\n");
+    printf("  --shape-trace <file> write the shape of the product between every gate to file as JSON lines\n");
+    printf("  --reduce-ancillas    restrict inputs to their .c constants and ignore garbage outputs\n");
+    printf("  --pipeline           decode gates while the rest of the input is parsed on another thread\n");
+    printf("  --prebuild           build gate matrices ahead of time on another thread\n");
+    printf("  --build-threads <n>  build gate matrices ahead of time on n threads\n");
+    printf("  --lookahead <n>      number of gates that can be built ahead of time (default 64)\n");
+    printf("  --no-fuse            apply gates that share their controls one at a time instead of together\n");
+    printf("  --no-diagonal-batch  apply runs of diagonal gates one at a time instead of together\n");
+    printf("  --layers             apply gates on disjoint variables in layers, reordering up to 256 gates at once\n");
+    printf("  --layer-window <n>   apply gates in layers, reordering up to n gates at once\n");
+    printf("  --schedule           reorder commuting gates to keep the product small, up to 256 gates at once\n");
+    printf("  --schedule-window <n>\n");
+    printf("                       reorder commuting gates to keep the product small, up to n gates at once\n");
+    printf("  --schedule-candidates <n>\n");
+    printf("                       number of ready gates tried against the product for each pick (default 4)\n");
+    printf("  --compare-order      with --schedule, also decode in stream order and print its peak live nodes\n");
+    printf("  --stabilizer         simulate Clifford circuits with a stabilizer tableau, written to <input>.tableau\n");
+    printf("  --stabilizer-qmdd    like --stabilizer, then also build the qmdd of the tableau\n");
+    printf("  --partition <n>      multiply out blocks of gates at most n variables wide on separate threads\n");
+    printf("  --partition-threads <n>\n");
+    printf("                       number of threads that multiply out blocks (default: one per core)\n");
+    printf("  --equiv <file>       check whether the program in file has the same matrix as the input up to a global phase\n");
+    printf("  --probes <k>         with --equiv, compare the outputs for k random inputs before the qmdds (default 16)\n");
+    printf("  --amplitude <x>,<y>  contract a tensor network for the entry <x|U|y>, with x and y as bits in variable order\n");
+    printf("  --feynman            with --amplitude, sum over the paths through the circuit instead, in little memory\n");
+    printf("  --feynman-threads <n>\n");
+    printf("                       number of threads that sum over paths (default: one per core)\n");
+}
+
+// parses a nonnegative option value of at most max. std::stoull would wrap negative values around.
+unsigned long long parse_limit(const std::string& value, unsigned long long max)
+{
+    if (value.empty() || !std::isdigit((unsigned char)value[0]))
+        throw std::invalid_argument("not a nonnegative integer");
+    size_t end;
+    unsigned long long limit = std::stoull(value, &end);
+    if (end != value.size())
+        throw std::invalid_argument("not a nonnegative integer");
+    if (limit > max)
+        throw std::out_of_range("limit");
+    return limit;
+}
+
+int main(int argc, char* argv[]) try
+{
+    const char* exe = argc == 0 ? "qmdd" : argv[0];
+
+    std::string infilename;
+    decode_options options;
+    std::string partialfilename;
+    qmdd::storage_options storage;
+    bool residency_report = false;
+    bool mem_report = false;
+    std::string shapefilename;
+    pipeline_options pipeline;
+    bool pipelined = false;
+    bool compare_order = false;
+    int partition_threads = 0;
+    bool stabilizer = false;
+    bool stabilizer_qmdd = false;
+    std::string equivfilename;
+    int num_probes = -1;
+    std::string amplitude_bits;
+    bool feynman = false;
+    int feynman_threads = 0;
+
+    for (int arg_i = 1; arg_i < argc; arg_i++)
     {
-        weight_handle one_by_sq2 = dd.apply(weight_1_handle, dd.get_weight_sq2_handle(), qmdd::weight_op_div);
-        weight_handle i_by_sq2 = dd.apply(dd.get_weight_i_handle(), dd.get_weight_sq2_handle(), qmdd::weight_op_div);
+        std::string arg = argv[arg_i];
 
-        rotate_pi_by_4_weights[0] = weight_1_handle;
-        rotate_pi_by_4_weights[1] = weight_0_handle;
-        rotate_pi_by_4_weights[2] = weight_0_handle;
-        rotate_pi_by_4_weights[3] = dd.apply(one_by_sq2, i_by_sq2, qmdd::weight_op_add);
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            if (!infilename.empty())
+            {
+                throw std::runtime_error("more than one input specified");
+            }
 
-        inv_rotate_pi_by_4_weights[0] = weight_1_handle;
-        inv_rotate_pi_by_4_weights[1] = weight_0_handle;
-        inv_rotate_pi_by_4_weights[2] = weight_0_handle;
-        inv_rotate_pi_by_4_weights[3] = dd.apply(one_by_sq2, i_by_sq2, qmdd::weight_op_sub);
-    }
+            infilename = arg;
+            continue;
+        }
 
-    weight_handle rotate_pi_by_2_weights[p * p];
-    weight_handle inv_rotate_pi_by_2_weights[p * p];
-    if (p == 2)
-    {
-        weight_handle one_by_sq2 = dd.apply(weight_1_handle, dd.get_weight_sq2_handle(), qmdd::weight_op_div);
-        weight_handle i_by_sq2 = dd.apply(dd.get_weight_i_handle(), dd.get_weight_sq2_handle(), qmdd::weight_op_div);
+        if (arg == "--resume")
+        {
+            options.resume = true;
+            continue;
+        }
 
-        rotate_pi_by_2_weights[0] = weight_1_handle;
-        rotate_pi_by_2_weights[1] = weight_0_handle;
-        rotate_pi_by_2_weights[2] = weight_0_handle;
-        rotate_pi_by_2_weights[3] = dd.get_weight_i_handle();
+        if (arg == "--residency-report")
+        {
+            residency_report = true;
+            continue;
+        }
 
-        inv_rotate_pi_by_2_weights[0] = weight_1_handle;
-        inv_rotate_pi_by_2_weights[1] = weight_0_handle;
-        inv_rotate_pi_by_2_weights[2] = weight_0_handle;
-        inv_rotate_pi_by_2_weights[3] = dd.apply(weight_0_handle, dd.get_weight_i_handle(), qmdd::weight_op_sub);
-    }
+        if (arg == "--mem-report")
+        {
+            mem_report = true;
+            continue;
+        }
 
-    edge root = edge(weight_1_handle, true_node);
+        if (arg == "--reduce-ancillas")
+        {
+            options.reduce_ancillas = true;
+            continue;
+        }
 
-    // initialize circuit with p^n by p^n identity
-    std::vector<edge> identitySubtree(spec.num_variables + 1);
-    identitySubtree[spec.num_variables] = root;
-    for (int var_id = spec.num_variables - 1; var_id >= 0; var_id--)
-    {
-        root = dd.apply(edge(dd.make_node(var_id, identity_children, identity_weights)), root, qmdd::edge_op_kro);
-        identitySubtree[var_id] = root;
-    }
+        if (arg == "--pipeline")
+        {
+            pipelined = true;
+            continue;
+        }
 
-    struct gate_stream_view
-    {
-        const int* stream;
-        int size;
-        int offset;
-    };
+        if (arg == "--no-fuse")
+        {
+            pipeline.fuse = false;
+            continue;
+        }
 
-    // stack of gate streams to execute.
-    // this is useful to implement "micro-coded" gates.
-    std::vector<gate_stream_view> gate_streams;
-    gate_streams.push_back(gate_stream_view{ spec.gate_stream.data(), (int)spec.gate_stream.size(), 0 });
+        if (arg == "--no-diagonal-batch")
+        {
+            pipeline.batch_diagonal = false;
+            continue;
+        }
 
-    // storage for microcode
-    std::vector<int> fredkin_microcode;
+        if (arg == "--layers")
+        {
+            pipeline.layer_window = std::max(pipeline.layer_window, 256);
+            continue;
+        }
 
-    // prevents updates to gate_streams from invalidating pointers...
-    auto curr_stream = [&gate_streams]() -> gate_stream_view& { return gate_streams.back(); };
+        if (arg == "--schedule")
+        {
+            pipeline.schedule_window = std::max(pipeline.schedule_window, 256);
+            continue;
+        }
 
-    while (!gate_streams.empty())
-    {
-        if (curr_stream().offset == curr_stream().size)
+        if (arg == "--compare-order")
         {
-            gate_streams.pop_back();
+            compare_order = true;
             continue;
         }
 
-        gate_opcode opcode = (gate_opcode)curr_stream().stream[curr_stream().offset];
-        curr_stream().offset++;
+        if (arg == "--stabilizer")
+        {
+            stabilizer = true;
+            continue;
+        }
 
-        int param_count = curr_stream().stream[curr_stream().offset];
-        curr_stream().offset++;
-        
-        const int* first_param = &curr_stream().stream[curr_stream().offset];
-        const int* last_param = &curr_stream().stream[curr_stream().offset] + param_count;
+        if (arg == "--stabilizer-qmdd")
+        {
+            stabilizer = true;
+            stabilizer_qmdd = true;
+            continue;
+        }
 
-        curr_stream().offset += param_count;
+        if (arg == "--feynman")
+        {
+            feynman = true;
+            continue;
+        }
 
-#ifdef SHOW_INSTRS
-        if (&curr_stream() != &gate_streams.front())
+        if (arg == "--prebuild")
         {
-            printf("(microcode) ");
+            pipeline.build_threads = std::max(pipeline.build_threads, 1);
+            continue;
         }
-#endif
 
-        switch (opcode)
+        if (arg_i + 1 >= argc)
         {
-        case gate_opcode::toffoli:
-        case gate_opcode::pauli_y:
-        case gate_opcode::pauli_z:
-        case gate_opcode::sqrtnot:
-        case gate_opcode::inv_sqrtnot:
-        case gate_opcode::hadamard:
-        case gate_opcode::rotate_pi_by_4:
-        case gate_opcode::inv_rotate_pi_by_4:
-        case gate_opcode::rotate_pi_by_2:
-        case gate_opcode::inv_rotate_pi_by_2:
+            throw std::runtime_error("missing value for " + arg);
+        }
+
+        std::string value = argv[++arg_i];
+
+        try
         {
-#ifdef SHOW_INSTRS
-            printf("%s%d ", 
-                opcode == gate_opcode::toffoli ? "t" :
-                opcode == gate_opcode::pauli_y ? "y" :
-                opcode == gate_opcode::pauli_z ? "z" :
-                opcode == gate_opcode::sqrtnot ? "v" :
-                opcode == gate_opcode::inv_sqrtnot ? "v\'" :
-                opcode == gate_opcode::hadamard ? "h" :
-                opcode == gate_opcode::rotate_pi_by_4 ? "q" :
-                opcode == gate_opcode::inv_rotate_pi_by_4 ? "q\'" :
-                opcode == gate_opcode::rotate_pi_by_2 ? "s" :
-                opcode == gate_opcode::inv_rotate_pi_by_2 ? "s\'" :
-                "?",
-                param_count);
-            for (const int* param = first_param; param < last_param; param++)
-            {
-                if (param != first_param)
-                {
-                    printf(",");
-                }
-                printf("%s", spec.variable_names[*param].c_str());
-            }
-            printf("\n");
-#endif
-            const weight_handle* gate_weights;
-            if (opcode == gate_opcode::toffoli)
-            {
-                gate_weights = not_weights;
-            }
-            else if (opcode == gate_opcode::pauli_y)
-            {
-                if (p != 2)
-                {
-                    assert(!"y gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = y_weights;
-            }
-            else if (opcode == gate_opcode::pauli_z)
+            if (arg == "--max-nodes")
+                options.max_nodes = (uint32_t)parse_limit(value, UINT32_MAX);
+            else if (arg == "--max-weights")
+                options.max_weights = (uint32_t)parse_limit(value, UINT32_MAX);
+            else if (arg == "--max-bytes")
+                options.max_bytes = (size_t)parse_limit(value, SIZE_MAX);
+            else if (arg == "--max-seconds")
+                options.max_seconds = std::stod(value);
+            else if (arg == "--partial")
+                partialfilename = value;
+            else if (arg == "--checkpoint")
+                options.checkpoint_file = value;
+            else if (arg == "--checkpoint-seconds")
+                options.checkpoint_seconds = std::stod(value);
+            else if (arg == "--checkpoint-gates")
+                options.checkpoint_gates = std::stoi(value);
+            else if (arg == "--node-capacity")
             {
-                if (p != 2)
-                {
-                    assert(!"z gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = z_weights;
+                unsigned long long capacity = std::stoull(value);
+                if (capacity == 0 || capacity > 0x80000000ull)
+                    throw std::out_of_range("node capacity");
+                storage.node_capacity = 1;
+                while (storage.node_capacity < capacity)
+                    storage.node_capacity *= 2;
             }
-            else if (opcode == gate_opcode::sqrtnot)
+            else if (arg == "--node-store")
+                storage.backing_file = value;
+            else if (arg == "--shared-memory")
+                storage.shared_memory = value;
+            else if (arg == "--pin-levels")
+                storage.pinned_levels = std::stoi(value);
+            else if (arg == "--shape")
+                shapefilename = value;
+            else if (arg == "--equiv")
+                equivfilename = value;
+            else if (arg == "--amplitude")
+                amplitude_bits = value;
+            else if (arg == "--shape-trace")
+                options.shape_trace_file = value;
+            else if (arg == "--build-threads")
             {
-                if (p != 2)
-                {
-                    assert(!"v gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = sqrtnot_weights;
+                pipeline.build_threads = std::stoi(value);
+                if (pipeline.build_threads < 0)
+                    throw std::out_of_range("build threads");
             }
-            else if (opcode == gate_opcode::inv_sqrtnot)
+            else if (arg == "--layer-window")
             {
-                if (p != 2)
-                {
-                    assert(!"v\' gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = inv_sqrtnot_weights;
+                pipeline.layer_window = std::stoi(value);
+                if (pipeline.layer_window < 1)
+                    throw std::out_of_range("layer window");
             }
-            else if (opcode == gate_opcode::hadamard)
+            else if (arg == "--schedule-window")
             {
-                if (p != 2)
-                {
-                    assert(!"hadamard gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = hadamard_weights;
+                pipeline.schedule_window = std::stoi(value);
+                if (pipeline.schedule_window < 1)
+                    throw std::out_of_range("schedule window");
             }
-            else if (opcode == gate_opcode::rotate_pi_by_4)
+            else if (arg == "--partition")
             {
-                if (p != 2)
-                {
-                    assert(!"q gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = rotate_pi_by_4_weights;
+                pipeline.partition_vars = std::stoi(value);
+                if (pipeline.partition_vars < 1)
+                    throw std::out_of_range("partition");
             }
-            else if (opcode == gate_opcode::inv_rotate_pi_by_4)
+            else if (arg == "--partition-threads")
             {
-                if (p != 2)
-                {
-                    assert(!"q\' gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = inv_rotate_pi_by_4_weights;
+                partition_threads = std::stoi(value);
+                if (partition_threads < 1)
+                    throw std::out_of_range("partition threads");
             }
-            else if (opcode == gate_opcode::rotate_pi_by_2)
-            {
-                if (p != 2)
-                {
-                    assert(!"s gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = rotate_pi_by_2_weights;
+            else if (arg == "--probes")
+            {
+                num_probes = std::stoi(value);
+                if (num_probes < 0)
+                    throw std::out_of_range("probes");
             }
-            else if (opcode == gate_opcode::inv_rotate_pi_by_2)
+            else if (arg == "--feynman-threads")
             {
-                if (p != 2)
-                {
-                    assert(!"s\' gates not allowed outside of 2-valued logic");
-                }
-                gate_weights = inv_rotate_pi_by_2_weights;
+                feynman_threads = std::stoi(value);
+                if (feynman_threads < 1)
+                    throw std::out_of_range("feynman threads");
             }
-            else
+            else if (arg == "--schedule-candidates")
             {
-                assert(!"unhandled gate type");
+                pipeline.schedule_candidates = std::stoi(value);
+                if (pipeline.schedule_candidates < 1)
+                    throw std::out_of_range("schedule candidates");
             }
-
-            assert(last_param - first_param >= 1);
-
-            int target_var_id = *(last_param - 1);
-            const int* next_control_var_id = last_param - 2;
-
-            edge active_gate = edge(weight_1_handle, true_node);
-            edge inactive_gate = edge(weight_0_handle, true_node);
-
-            for (int var_id = spec.num_variables - 1; var_id >= 0; var_id--)
+            else if (arg == "--lookahead")
             {
-                bool is_control = false;
-                if (next_control_var_id >= first_param && *next_control_var_id == var_id)
-                {
-                    is_control = true;
-                    next_control_var_id -= 1;
-                }
-
-                if (var_id > target_var_id) // variables below the target
-                {
-                    if (is_control)
-                    {
-                        active_gate = dd.apply(edge(dd.make_node(var_id, identity_children, if_true_weights)), active_gate, qmdd::edge_op_kro);
-
-                        inactive_gate = dd.apply(
-                            dd.apply(edge(dd.make_node(var_id, identity_children, if_false_weights)), identitySubtree[var_id + 1], qmdd::edge_op_kro),
-                            dd.apply(edge(dd.make_node(var_id, identity_children, if_true_weights)), inactive_gate, qmdd::edge_op_kro),
-                            qmdd::edge_op_add);
-                    }
-                    else
-                    {
-                        active_gate = dd.apply(edge(dd.make_node(var_id, identity_children, identity_weights)), active_gate, qmdd::edge_op_kro);
-                        inactive_gate = dd.apply(edge(dd.make_node(var_id, identity_children, identity_weights)), inactive_gate, qmdd::edge_op_kro);
-                    }
-                }
-                else if (var_id == target_var_id) // the target variable
-                {
-                    active_gate = dd.apply(
-                        dd.apply(edge(dd.make_node(var_id, identity_children, identity_weights)), inactive_gate, qmdd::edge_op_kro),
-                        dd.apply(edge(dd.make_node(var_id, identity_children, gate_weights)), active_gate, qmdd::edge_op_kro),
-                        qmdd::edge_op_add);
-                }
-                else if (var_id < target_var_id) // variables above the target
-                {
-                    if (is_control)
-                    {
-                        active_gate = dd.apply(
-                            dd.apply(edge(dd.make_node(var_id, identity_children, if_false_weights)), identitySubtree[var_id + 1], qmdd::edge_op_kro),
-                            dd.apply(edge(dd.make_node(var_id, identity_children, if_true_weights)), active_gate, qmdd::edge_op_kro),
-                            qmdd::edge_op_add);
-                    }
-                    else
-                    {
-                        active_gate = dd.apply(edge(dd.make_node(var_id, identity_children, identity_weights)), active_gate, qmdd::edge_op_kro);
-                    }
-                }
+                pipeline.lookahead = std::stoi(value);
+                if (pipeline.lookahead < 1)
+                    throw std::out_of_range("lookahead");
             }
-
-            root = dd.apply(active_gate, root, qmdd::edge_op_mul);
-
-            break;
+            else
+                throw std::runtime_error("unknown option " + arg);
         }
-        case gate_opcode::fredkin:
+        catch (const std::logic_error&)
         {
-#ifdef SHOW_INSTRS
-            printf("f%d ", param_count);
-            for (const int* param = first_param; param < last_param; param++)
-            {
-                if (param != first_param)
-                {
-                    printf(",");
-                }
-                printf("%s", spec.variable_names[*param].c_str());
-            }
-            printf("\n");
-#endif
+            throw std::runtime_error("invalid value for " + arg + ": " + value);
+        }
+    }
 
-            assert(last_param - first_param >= 2);
+    if (infilename.empty())
+    {
+        print_usage(exe);
+        return 0;
+    }
 
-            int swap_b_var_id = *(last_param - 1);
-            int swap_a_var_id = *(last_param - 2);
-            int num_controls = (int)(last_param - first_param) - 2;
+    if (!storage.shared_memory.empty() && !storage.backing_file.empty())
+    {
+        throw std::runtime_error("--shared-memory can't be used with --node-store");
+    }
 
-            fredkin_microcode.clear();
+    if (residency_report && storage.backing_file.empty())
+    {
+        throw std::runtime_error("--residency-report requires --node-store");
+    }
 
-            fredkin_microcode.push_back((int)gate_opcode::toffoli);
-            fredkin_microcode.push_back(2);
-            fredkin_microcode.push_back(swap_b_var_id);
-            fredkin_microcode.push_back(swap_a_var_id);
+    if (options.resume && options.checkpoint_file.empty())
+    {
+        throw std::runtime_error("--resume requires --checkpoint");
+    }
 
-            fredkin_microcode.push_back((int)gate_opcode::toffoli);
-            fredkin_microcode.push_back(2 + num_controls);
-            for (int control_idx = 0; control_idx < num_controls; control_idx++)
-            {
-                fredkin_microcode.push_back(first_param[control_idx]);
-            }
-            fredkin_microcode.push_back(swap_a_var_id);
-            fredkin_microcode.push_back(swap_b_var_id);
+    if (!options.checkpoint_file.empty() && options.checkpoint_seconds == 0.0 && options.checkpoint_gates == 0)
+    {
+        options.checkpoint_seconds = 60.0;
+    }
 
-            fredkin_microcode.push_back((int)gate_opcode::toffoli);
-            fredkin_microcode.push_back(2);
-            fredkin_microcode.push_back(swap_b_var_id);
-            fredkin_microcode.push_back(swap_a_var_id);
+    if (pipelined && !options.checkpoint_file.empty())
+    {
+        throw std::runtime_error("--checkpoint can't be used with --pipeline");
+    }
 
-            gate_streams.push_back(gate_stream_view{ fredkin_microcode.data(), (int)fredkin_microcode.size(), 0 });
+    if (pipeline.layer_window != 0 && !options.checkpoint_file.empty())
+    {
+        throw std::runtime_error("--checkpoint can't be used with --layers or --layer-window");
+    }
 
-            break;
-        }
-        default:
-            throw std::logic_error("unknown gate opcode");
-        }
+    if (pipeline.schedule_window != 0)
+    {
+        // the scheduler needs to see the product before every gate, so nothing can read gates ahead of it
+        if (!options.checkpoint_file.empty())
+            throw std::runtime_error("--checkpoint can't be used with --schedule");
+        if (pipeline.build_threads != 0 || pipeline.layer_window != 0)
+            throw std::runtime_error("--schedule can't be used with --prebuild, --build-threads or --layers");
+        options.track_peak_live_nodes = true;
     }
 
-    if (root_out) *root_out = root;
-}
+    if (pipeline.partition_vars != 0)
+    {
+        if (pipeline.build_threads != 0 || pipeline.layer_window != 0 || pipeline.schedule_window != 0)
+            throw std::runtime_error("--partition can't be used with --prebuild, --build-threads, --layers or --schedule");
+        pipeline.partition_threads = partition_threads != 0 ? partition_threads : std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    else if (partition_threads != 0)
+    {
+        throw std::runtime_error("--partition-threads requires --partition");
+    }
 
-void write_dot(
-    const char* title,
-    const program_spec& spec, const qmdd& dd,
-    const qmdd::edge& root,
-    const char* fn)
-{
-    static const int p = qmdd::p;
+    if (stabilizer && (pipelined || !options.checkpoint_file.empty()))
+    {
+        throw std::runtime_error("--stabilizer can't be used with --pipeline or --checkpoint");
+    }
 
-    FILE* f = fopen(fn, "w");
+    if (!equivfilename.empty() && (pipelined || stabilizer || compare_order || !options.checkpoint_file.empty()))
+    {
+        throw std::runtime_error("--equiv can't be used with --pipeline, --stabilizer, --compare-order or --checkpoint");
+    }
 
-    if (!f)
+    if (!amplitude_bits.empty() && (pipelined || stabilizer || !equivfilename.empty() || !options.checkpoint_file.empty() || options.reduce_ancillas))
     {
-        throw std::runtime_error(std::string("failed to open ") + fn);
+        throw std::runtime_error("--amplitude can't be used with --pipeline, --stabilizer, --equiv, --checkpoint or --reduce-ancillas");
     }
 
-    fprintf(f, "digraph {\n");
+    if ((feynman || feynman_threads != 0) && amplitude_bits.empty())
+    {
+        throw std::runtime_error("--feynman and --feynman-threads require --amplitude");
+    }
 
-    fprintf(f, "  labelloc=\"t\";\n");
-    fprintf(f, "  label=\"%s\";\n", title);
-    fprintf(f, "  splines=line;\n");
+    if (num_probes != -1 && equivfilename.empty())
+    {
+        throw std::runtime_error("--probes requires --equiv");
+    }
 
-    std::vector<qmdd::node_handle> nodes2add = { root.v };
+    if (compare_order && (pipeline.schedule_window == 0 || pipelined))
+    {
+        throw std::runtime_error("--compare-order requires --schedule, without --pipeline");
+    }
 
-    qmdd::node_handle true_node = dd.get_true();
+    if (pipeline.build_threads != 0 && options.resume)
+    {
+        throw std::runtime_error("--resume can't be used with --prebuild or --build-threads");
+    }
 
-    struct node_hasher
+    auto read_file = [](const std::string& filename)
     {
-        auto operator()(qmdd::node_handle n) const
+        std::ifstream file(filename);
+        if (!file)
         {
-            return n.value;
+            throw std::runtime_error("failed to open " + filename);
         }
+
+        // reads the whole file into a string. Total C++ nonsense, but it works.
+        return std::string(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
     };
 
-    std::unordered_set<qmdd::node_handle, node_hasher> added;
-    added.insert(true_node);
+    auto parser_for = [](const std::string& filename)
+    {
+        auto has_extension = [&filename](const char* ext)
+        {
+            size_t len = strlen(ext);
+            return filename.size() >= len && filename.compare(filename.size() - len, len, ext) == 0;
+        };
 
-    std::unordered_set<qmdd::node_handle, node_hasher> declared;
-    
-    fprintf(f, "  root [shape=point,width=0.001,height=0.001];\n");
-    fprintf(f, "  root -> n%u [label=\"%s\"];\n", root.v.value, dd.to_string(root.w).c_str());
+        program_spec (*parse_fn)(const char*, parse_listener*) = parse;
+        if (has_extension(".qasm"))
+            parse_fn = parse_qasm;
+        else if (has_extension(".real"))
+            parse_fn = parse_real;
+        return parse_fn;
+    };
 
-    if (root.v == true_node)
+    std::string spec_str = read_file(infilename);
+    program_spec (*parse_fn)(const char*, parse_listener*) = parser_for(infilename);
+
+    program_spec spec;
+    std::unique_ptr<qmdd> dd;
+    qmdd::edge root;
+    decode_report report;
+
+    if (pipelined)
     {
-        fprintf(f, "  n%u [label=\"1\",shape=box];\n", true_node.value);
+        try {
+            spec = parse_and_decode(spec_str.c_str(), parse_fn, storage, options, pipeline, &dd, &root, &report);
+        }
+        catch (const std::runtime_error& e) {
+            throw std::runtime_error(infilename + ":" + e.what());
+        }
     }
     else
     {
-        fprintf(f, "  n%u [label=\"%s\",shape=circle];\n", root.v.value, spec.variable_names[dd.get_var(root.v)].c_str());
-    }
-
-    declared.insert(root.v);
-
-    while (!nodes2add.empty())
-    {
-        qmdd::node_handle n = nodes2add.back();
-        nodes2add.pop_back();
-
-        if (added.find(n) != end(added))
-            continue;
-
-        qmdd::node_handle children[p * p];
-        dd.get_children(n, children);
-
-        qmdd::weight_handle weights[p * p];
-        dd.get_weights(n, weights);
+        try {
+            spec = parse_fn(spec_str.c_str(), NULL);
+        }
+        catch (const std::exception& e) {
+            throw std::runtime_error(infilename + ":" + e.what());
+        }
 
-        for (int child_idx = 0; child_idx < p * p; child_idx++)
+        if (!equivfilename.empty())
         {
-            qmdd::node_handle child = children[child_idx];
-
-            if (declared.insert(child).second)
-            {
-                if (child == true_node)
-                {
-                    fprintf(f, "  n%u [label=\"1\",shape=box];\n", child.value);
-                }
-                else
-                {
-                    fprintf(f, "  n%u [label=\"%s\",shape=circle];\n", child.value, spec.variable_names[dd.get_var(child)].c_str());
-                }
+            std::string other_str = read_file(equivfilename);
+            program_spec other;
+            try {
+                other = parser_for(equivfilename)(other_str.c_str(), NULL);
+            }
+            catch (const std::exception& e) {
+                throw std::runtime_error(equivfilename + ":" + e.what());
             }
 
-            if (added.find(child) == end(added))
-                nodes2add.push_back(child);
+            return check_equivalence(spec, other, storage, options, pipeline, num_probes != -1 ? num_probes : 16, std::max(1, (int)std::thread::hardware_concurrency()));
         }
 
-        // "invisible" row of nodes for the child weights, then point those invisible nodes to the real nodes.
-        fprintf(f, "  subgraph c%u {\n", n.value);
+        if (!amplitude_bits.empty())
         {
-            fprintf(f, "    rank=same;\n");
-            fprintf(f, "    edge[style=invisible,dir=none];\n");
-
-            for (int i = 0; i < p * p; i++)
+            size_t comma = amplitude_bits.find(',');
+            std::string bit_strings[2] = { amplitude_bits.substr(0, comma), comma == std::string::npos ? "" : amplitude_bits.substr(comma + 1) };
+            std::vector<int> bits[2];
+            for (int i = 0; i < 2; i++)
             {
-                const char* color = i % 2 == 0 ? "red" : "black";
-
-                if (weights[i] == qmdd::weight_0_handle)
+                if ((int)bit_strings[i].size() != spec.num_variables || bit_strings[i].find_first_not_of("01") != std::string::npos)
                 {
-                    fprintf(f, "    c%u_%d[shape=point,color=%s];\n", n.value, i, color);
-                }
-                else
-                {
-                    fprintf(f, "    c%u_%d[shape=point,width=0.01,height=0.01,color=%s];\n", n.value, i, color);
+                    throw std::runtime_error("--amplitude needs two strings of " + std::to_string(spec.num_variables) + " bits, separated by a comma");
                 }
+                for (char bit : bit_strings[i])
+                    bits[i].push_back(bit - '0');
             }
 
-            // used for rank order...
-            fprintf(f, "    c%u_%d[shape=point,width=0,height=0,style=invis];\n", n.value, p*p);
-
-            for (int i = 0; i <= p * p; i++)
+            std::complex<double> entry;
+            if (feynman)
             {
-                if (i == 0)
-                    fprintf(f, "    ");
-                else
-                    fprintf(f, " -> ");
-
-                if (i == p*p / 2)
-                {
-                    // putting the invisible node here make the children more centered
-                    fprintf(f, "c%u_%d", n.value, p*p);
-                }
-                else if (i > p*p / 2)
-                {
-                    fprintf(f, "c%u_%d", n.value, i - 1);
-                }
-                else
-                {
-                    fprintf(f, "c%u_%d", n.value, i);
-                }
+                feynman_paths paths(spec, bits[0], bits[1]);
+                entry = paths.sum(feynman_threads != 0 ? feynman_threads : std::max(1, (int)std::thread::hardware_concurrency()));
             }
-
-            fprintf(f, ";\n");
+            else
+            {
+                tensor_network network(spec, bits[0], bits[1]);
+                entry = network.contract();
+            }
+            printf("<%s|U|%s> = %.12g%+.12gi\n", bit_strings[0].c_str(), bit_strings[1].c_str(), entry.real(), entry.imag());
+            return 0;
         }
-        fprintf(f, "  }\n");
 
-        for (int i = 0; i < p * p; i++)
+        if (stabilizer && is_clifford(spec))
         {
-            const char* color = i % 2 == 0 ? "red" : "black";
-            fprintf(f, "  n%u -> c%u_%d [label=\"%s\", arrowhead=none,color=%s,fontcolor=%s];\n", n.value, n.value, i, dd.to_string(weights[i]).c_str(), color, color);
-        }
+            stabilizer_tableau tableau(spec.num_variables);
+            apply_clifford_gates(spec, &tableau);
 
-        for (int i = 0; i < p * p; i++)
-        {
-            if (weights[i] == qmdd::weight_0_handle)
+            std::string tableaufilename = infilename + ".tableau";
+            write_tableau(spec, tableau, tableaufilename.c_str());
+            printf("Clifford circuit, tableau written to %s\n", tableaufilename.c_str());
+
+            if (!stabilizer_qmdd)
             {
-                continue;
+                return 0;
             }
 
-            const char* color = i % 2 == 0 ? "red" : "black";
-            fprintf(f, "  c%u_%d -> n%u [constraint=false,color=%s];\n", n.value, i, children[i].value, color);
-            fprintf(f, "  c%u_%d -> n%u [style=invis];\n", n.value, p*p, children[i].value);
+            // a circuit with the same tableau has the same matrix up to a global phase
+            spec.gate_stream = synthesize_clifford_circuit(tableau);
+        }
+        else if (stabilizer)
+        {
+            printf("not a Clifford circuit, decoding it with the qmdd\n");
         }
 
-        added.insert(n);
+        dd.reset(new qmdd(spec.num_variables, storage));
+
+        spec_gate_source parsed_gates(spec);
+        decode(spec, *dd, options, pipeline, parsed_gates, &root, &report);
     }
 
-    fprintf(f, "}\n");
+    if (report.resumed_gate_index != -1)
+    {
+        printf("resumed from checkpoint at gate %d\n", report.resumed_gate_index);
+    }
 
-    fclose(f);
-}
+    if (!storage.shared_memory.empty())
+    {
+        // the handles are the same in every process that uses the segment, so equal roots mean equal matrices
+        printf("shared root: weight %u, node %u\n", root.w.value, root.v.value);
+    }
 
-void display_dot(const char* fn)
-{
-    std::string dotcmd = std::string("packages\\Graphviz.2.38.0.2\\dot.exe") + " -Tpng " + fn + " -o " + fn + ".png";
-    if (system(dotcmd.c_str()) == 0)
+    if (pipeline.schedule_window != 0)
     {
-        std::string pngcmd = std::string(fn) + ".png";
-        system(pngcmd.c_str());
+        std::string stream_order_peak;
+        if (compare_order)
+        {
+            // decodes again in stream order, in memory, only to compare the peaks
+            qmdd::storage_options stream_order_storage = storage;
+            stream_order_storage.backing_file.clear();
+            stream_order_storage.shared_memory.clear();
+            qmdd stream_order_dd(spec.num_variables, stream_order_storage);
+
+            decode_options stream_order_options = options;
+            stream_order_options.shape_trace_file.clear();
+
+            pipeline_options stream_order_pipeline = pipeline;
+            stream_order_pipeline.schedule_window = 0;
+
+            decode_report stream_order_report;
+            spec_gate_source parsed_gates(spec);
+            decode(spec, stream_order_dd, stream_order_options, stream_order_pipeline, parsed_gates, NULL, &stream_order_report);
+
+            stream_order_peak = ", " + std::to_string(stream_order_report.peak_live_nodes) + " in stream order" + (stream_order_report.completed ? "" : " (stopped early)");
+        }
+
+        printf("peak live nodes: %u scheduled%s\n", report.peak_live_nodes, stream_order_peak.c_str());
     }
-}
 
-int main(int argc, char* argv[]) try
-{
-    if (argc < 2)
+    if (mem_report)
     {
-        printf("Usage: %s <input>\n", argc == 0 ? "qmdd" : argv[0]);
-        return 0;
+        print_memory_report(report);
     }
 
-    std::string infilename = argv[1];
+    if (!shapefilename.empty())
+    {
+        FILE* f = fopen(shapefilename.c_str(), "w");
+        if (!f)
+        {
+            throw std::runtime_error("failed to open " + shapefilename);
+        }
+        write_shape_json(f, spec, analyze_shape(*dd, root), report.gate_index);
+        fclose(f);
+    }
 
-    std::ifstream infile(infilename);
-    if (!infile)
+    if (residency_report)
     {
-        throw std::runtime_error("failed to open " + infilename);
+        printf("level      nodes     mapped KiB   resident KiB  pinned\n");
+        for (const qmdd::level_residency& level : dd->get_level_residency())
+        {
+            const char* name = level.var < spec.variable_names.size() ? spec.variable_names[level.var].c_str() : "1";
+            printf("%-8s %9u %14zu %14zu  %s\n", name, level.num_nodes, level.mapped_bytes / 1024, level.resident_bytes / 1024, level.pinned ? "yes" : "no");
+        }
     }
 
-    // reads the whole file into a string. Total C++ nonsense, but it works.
-    std::string spec_str(std::istreambuf_iterator<char>{infile}, std::istreambuf_iterator<char>{});
+    if (!report.completed)
+    {
+        printf("budget exceeded: %s\n", report.stop_reason.c_str());
+        printf("stopped at gate %d (gate stream offset %d): %u nodes, %u weights, %zu bytes, %.3f seconds\n",
+            report.gate_index, report.gate_offset, report.num_nodes, report.num_weights, report.bytes_used, report.seconds);
+
+        if (!partialfilename.empty())
+        {
+            write_qmdd(*dd, root, partialfilename.c_str());
+            if (report.gate_index == 0)
+                printf("no gates applied, identity written to %s\n", partialfilename.c_str());
+            else
+                printf("partial product of gates 0 to %d written to %s\n", report.gate_index - 1, partialfilename.c_str());
+        }
 
-    program_spec spec;
-    try {
-        spec = parse(spec_str.c_str());
-    }
-    catch (const std::exception& e) {
-        throw std::runtime_error(infilename + ":" + e.what());
+        return 2;
     }
 
-    qmdd::edge root;
-    qmdd dd = qmdd(spec.num_variables);
-    decode(spec, dd, &root);
-
     std::string outfilename = infilename + ".dot";
     
-    write_dot(infilename.c_str(), spec, dd, root, outfilename.c_str());
+    write_dot(infilename.c_str(), spec, *dd, root, outfilename.c_str());
 
     display_dot(outfilename.c_str());
 